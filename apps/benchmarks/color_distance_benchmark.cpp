@@ -0,0 +1,169 @@
+/*********************************************************************************************************************
+ * File : color_distance_benchmark.cpp                                                                               *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <boost/program_options.hpp>
+#include <opencv2/core.hpp>
+
+#include <capsule_descriptor.h>
+#include <color_distance.h>
+
+namespace boost_po = boost::program_options;
+
+/// @brief Runs @p func @p n_repeats times and returns the best duration in milliseconds
+template <typename F>
+double time_best_of(int n_repeats, F func)
+{
+    double best_ms = 1e30;
+    for (int k = 0; k < n_repeats; k++)
+    {
+        const auto begin = std::chrono::high_resolution_clock::now();
+        func();
+        const auto end = std::chrono::high_resolution_clock::now();
+        best_ms = std::min(best_ms, std::chrono::duration<double, std::milli>(end - begin).count());
+    }
+    return best_ms;
+}
+
+int main(int argc, char **argv)
+{
+    int n_capsules, n_cutouts, n_repeats;
+    boost_po::options_description options("Compare the color distance kernels to the original cv::Scalar loop");
+    // clang-format off
+    options.add_options()
+        ("help,h", "Produce help message.")
+        ("capsules,c", boost_po::value<int>(&n_capsules)->default_value(2000), "Number of reference capsules.")
+        ("cutouts,n", boost_po::value<int>(&n_cutouts)->default_value(5000), "Number of cutouts of the input image.")
+        ("repeats,r", boost_po::value<int>(&n_repeats)->default_value(5), "Number of runs, the best one is kept.")
+        ;
+    // clang-format on
+
+    boost_po::variables_map vm;
+    try
+    {
+        boost_po::store(boost_po::command_line_parser(argc, argv).options(options).run(), vm);
+        boost_po::notify(vm);
+    }
+    catch (boost_po::error &e)
+    {
+        std::cerr << options << std::endl;
+        std::cerr << "Parsing error:" << e.what() << std::endl;
+        return 1;
+    }
+    if (vm.count("help"))
+    {
+        std::cout << options << std::endl;
+        return 0;
+    }
+
+    // Random colors
+    std::mt19937 generator(42);
+    std::uniform_real_distribution<float> distribution(0.f, 255.f);
+    std::vector<cv::Scalar> capsules_means(n_capsules), cutouts_means(n_cutouts);
+    ColorsSoA cutouts_soa;
+    for (auto &mean : capsules_means)
+        mean = cv::Scalar(distribution(generator), distribution(generator), distribution(generator));
+    for (auto &mean : cutouts_means)
+    {
+        mean = cv::Scalar(distribution(generator), distribution(generator), distribution(generator));
+        cutouts_soa.push_back(mean[0], mean[1], mean[2]);
+    }
+
+    std::vector<double> reference(size_t(n_capsules) * n_cutouts);
+    std::vector<float> errors(size_t(n_capsules) * n_cutouts);
+
+    // Original loop, one pair of cv::Scalar at a time
+    const double reference_ms = time_best_of(n_repeats, [&]() {
+        double *output = reference.data();
+        for (const auto &ref_mean : capsules_means)
+            for (const auto &cutout_mean : cutouts_means)
+            {
+                const cv::Scalar diff_means = ref_mean - cutout_mean;
+                const double diff_b = diff_means[0];
+                const double diff_g = diff_means[1];
+                const double diff_r = diff_means[2];
+                *output++ = std::sqrt(3 * diff_r * diff_r + 4 * diff_g * diff_g + 2 * diff_b * diff_b);
+            }
+    });
+    std::cout << n_capsules << " capsules x " << n_cutouts << " cutouts, single thread" << std::endl;
+    std::cout << "cv::Scalar loop: " << reference_ms << " ms" << std::endl;
+
+    std::vector<ColorDistanceKernel> kernels = {ColorDistanceKernel::SCALAR};
+    if (get_best_color_distance_kernel() != ColorDistanceKernel::SCALAR)
+        kernels.push_back(ColorDistanceKernel::AVX2);
+    if (get_best_color_distance_kernel() == ColorDistanceKernel::AVX512)
+        kernels.push_back(ColorDistanceKernel::AVX512);
+
+    for (const auto kernel : kernels)
+        for (const bool take_sqrt : {true, false})
+        {
+            const double kernel_ms = time_best_of(n_repeats, [&]() {
+                for (int i = 0; i < n_capsules; i++)
+                {
+                    const float ref_bgr[3] = {float(capsules_means[i][0]),
+                                              float(capsules_means[i][1]),
+                                              float(capsules_means[i][2])};
+                    compute_weighted_color_distances(ref_bgr, cutouts_soa, errors.data() + size_t(i) * n_cutouts,
+                                                     take_sqrt, kernel);
+                }
+            });
+
+            // Check the results against the original loop
+            double max_diff = 0;
+            for (size_t k = 0; k < errors.size(); k++)
+            {
+                const double error = take_sqrt ? errors[k] : std::sqrt(errors[k]);
+                max_diff = std::max(max_diff, std::abs(error - reference[k]));
+            }
+
+            std::cout << get_color_distance_kernel_name(kernel) << (take_sqrt ? "" : " (squared)") << ": "
+                      << kernel_ms << " ms, x" << reference_ms / kernel_ms << ", max error " << max_diff << std::endl;
+        }
+
+    // Lab sectors descriptors, compared to the scalar kernel
+    const size_t n_values = 3 * CapsuleDescriptor::n_regions;
+    std::vector<float> capsules_labs(n_capsules * n_values);
+    DescriptorsSoA cutouts_labs(n_values);
+    std::vector<float> cutout_lab(n_values);
+    std::vector<float> lab_weights;
+    for (int k = 0; k < CapsuleDescriptor::n_regions; k++)
+        lab_weights.insert(lab_weights.end(), 3, CapsuleDescriptor::region_weights[k]);
+    for (auto &value : capsules_labs)
+        value = distribution(generator);
+    for (int j = 0; j < n_cutouts; j++)
+    {
+        for (auto &value : cutout_lab)
+            value = distribution(generator);
+        cutouts_labs.push_back(cutout_lab.data());
+    }
+
+    std::vector<float> lab_reference(errors.size());
+    std::cout << "Lab sectors descriptors (" << n_values << " values)" << std::endl;
+    double lab_reference_ms = 0;
+    for (const auto kernel : kernels)
+    {
+        std::vector<float> &output = (kernel == ColorDistanceKernel::SCALAR) ? lab_reference : errors;
+        const double kernel_ms = time_best_of(n_repeats, [&]() {
+            for (int i = 0; i < n_capsules; i++)
+                compute_weighted_descriptor_distances(capsules_labs.data() + i * n_values, lab_weights.data(),
+                                                      cutouts_labs, output.data() + size_t(i) * n_cutouts, true,
+                                                      kernel);
+        });
+        if (kernel == ColorDistanceKernel::SCALAR)
+            lab_reference_ms = kernel_ms;
+
+        double max_diff = 0;
+        for (size_t k = 0; k < output.size(); k++)
+            max_diff = std::max(max_diff, double(std::abs(output[k] - lab_reference[k])));
+        std::cout << get_color_distance_kernel_name(kernel) << ": " << kernel_ms << " ms, x"
+                  << lab_reference_ms / kernel_ms << ", max error " << max_diff << std::endl;
+    }
+    return 0;
+}
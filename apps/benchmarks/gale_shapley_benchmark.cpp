@@ -0,0 +1,501 @@
+/*********************************************************************************************************************
+ * File : gale_shapley_benchmark.cpp                                                                                 *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+#include <boost/program_options.hpp>
+
+#include <cost_matrix.h>
+#include <gale_shapley/gale_shapley_algorithm.h>
+#include <thread_pool.h>
+
+namespace boost_po = boost::program_options;
+
+/// @brief Round-based implementation that preceded the flat preference arrays, kept as a baseline. All the free men
+/// propose, then all the women dispose, until nobody proposes anymore
+namespace legacy
+{
+/// @brief Class representing a woman in the Gale-Shapley Algorithm
+class Woman
+{
+public:
+    /// @brief Constructor
+    /// @param scores Coefficient (i, @p woman_id) corresponds to the love score with the man i. The lower the score
+    /// the better
+    /// @param woman_id Index of the woman, i.e. of her column in @p scores
+    Woman(const CostMatrix &scores, size_t woman_id);
+
+    /// @brief Stores a new proposal
+    /// @param man_id Id of the man proposing
+    void add_proposal(size_t man_id);
+
+    /// @brief Gets the id of the man shes's currently engaged to
+    size_t get_man_id() const;
+
+    /// @brief Checks if she would accept a proposal with the score @p score, given her current engagement
+    /// @note Since she only trades up, a man she would reject now will be rejected forever
+    bool would_accept(float score) const;
+
+    /// @brief Looks over the proposals, finds the best man and accepts it if he's better than the man
+    /// she's already engaged to
+    /// @param old_man_id Id of the previous engaged man
+    /// @param new_man_id Id of the new engaged man
+    /// @return true if she's decided to get engaged with a new man
+    bool update_engagement(size_t &old_man_id, size_t &new_man_id);
+
+    static size_t number_of_engaged_women;
+
+private:
+    /// @brief Gets the love score with the man @p man_id
+    float get_score(size_t man_id) const;
+
+    int engaged_man_id;
+    float engaged_score;
+    std::vector<size_t> proposals;
+    const CostMatrix *scores; ///< Scores, used to convert man indices to actual love scores
+    size_t woman_id;
+};
+
+/// @brief Class representing a man in the Gale-Shapley Algorithm
+///
+/// He only ranks his @p n_candidates best women at once, and ranks the next ones lazily if he has proposed to all of
+/// them. Women are ranked by increasing score, and then by increasing index in case of tie. Since women only trade up,
+/// those who would reject him right now are skipped for good.
+class Man
+{
+public:
+    /// @brief Constructor
+    /// @param scores Coefficient (@p man_id, j) corresponds to the love score with the woman j. The lower the score
+    /// the better
+    /// @param man_id Index of the man, i.e. of his row in @p scores
+    /// @param n_candidates Number of women ranked at once. 0 to rank all of them upfront
+    Man(const CostMatrix &scores, size_t man_id, size_t n_candidates = 0);
+
+    /// @brief Proposes to the woman he likes the most of those he has not yet proposed to, skipping the ones that
+    /// would reject him
+    /// @param women All the women
+    /// @param best_woman_id Output id of the woman he wants to proposed to
+    /// @return false if there's no woman left that would accept him
+    bool propose_to_best_woman(const std::vector<Woman> &women, size_t &best_woman_id);
+
+    /// @brief Sets him as engaged
+    void engage();
+
+    /// @brief Sets him as unengaged
+    void break_engagement();
+
+    /// @brief Checks if he's engaged
+    bool is_engaged() const;
+
+private:
+    /// @brief Ranks his next best women, among those that haven't been ranked yet and that would accept him
+    /// @param women All the women. Empty to rank them regardless of their current engagement
+    /// @return false if there's no woman left to rank
+    bool rank_next_women(const std::vector<Woman> &women);
+
+    bool engaged;
+    const CostMatrix *scores;
+    size_t man_id;
+    size_t n_candidates;
+    bool all_women_ranked;
+    uint32_t last_ranked_woman;         ///< Worst woman ranked so far
+    std::vector<uint32_t> sorted_women; ///< Stack of the ranked women indices, best women on top (i.e. at the back)
+};
+
+/// @brief Algorithm for finding a solution to a stable matching problem, when there are more men than women and when
+/// affinity scores are reciprocal, i.e. a man likes a woman as much as she likes him.
+///
+/// Obviously, there will remain single men.
+class GaleShapleyAlgorithm
+{
+public:
+    /// @brief Constructor
+    /// @param n_candidates Number of women each man ranks at once, the following ones being ranked lazily if he has
+    /// proposed to all of them. It brings memory and time down to O((n_men + n_women) * n_candidates) in practice.
+    /// 0 to rank all the women upfront
+    GaleShapleyAlgorithm(size_t n_candidates = 0);
+
+    /// @brief Loads input love scores, solves the stable matching problem and return the optimal matches
+    /// @param input_scores Coefficient (i, j) corresponds to the love score between a man i and a woman j. The lower
+    /// the score the better
+    /// @param output_matches Coefficient [i] corresponds to the index of the man engaged to the woman i
+    /// @return true if the problem has been succesfully solved
+    bool solve(const CostMatrix &input_scores, std::vector<size_t> &output_matches);
+
+private:
+    /// @brief Finds a solution to the stable matching problem
+    /// @return true if the problem has been succesfully solved
+    bool find_stable_configuration();
+
+    size_t n_candidates_;
+    std::vector<Man> men_;
+    std::vector<Woman> women_;
+};
+
+size_t Woman::number_of_engaged_women = 0;
+
+Woman::Woman(const CostMatrix &scores, size_t woman_id) : engaged_man_id(-1),
+                                                          engaged_score(-1),
+                                                          scores(&scores),
+                                                          woman_id(woman_id) {}
+
+void Woman::add_proposal(size_t man_id)
+{
+    proposals.push_back(man_id);
+}
+
+size_t Woman::get_man_id() const
+{
+    return engaged_man_id;
+}
+
+bool Woman::would_accept(float score) const
+{
+    return engaged_man_id == -1 || score < engaged_score;
+}
+
+bool Woman::update_engagement(size_t &old_man_id, size_t &new_man_id)
+{
+    if (proposals.empty())
+        return false;
+
+    auto it_best = std::min_element(proposals.cbegin(), proposals.cend(),
+                                    [&](const size_t a, const size_t b) { return get_score(a) < get_score(b); });
+    const size_t best_man_id = *it_best;
+    const float best_man_score = get_score(best_man_id);
+
+    proposals.clear();
+
+    if (engaged_man_id == -1)
+        number_of_engaged_women++;
+    else if (best_man_score >= engaged_score)
+        return false;
+
+    old_man_id = engaged_man_id;
+    new_man_id = best_man_id;
+
+    engaged_man_id = best_man_id;
+    engaged_score = best_man_score;
+    return true;
+}
+
+float Woman::get_score(size_t man_id) const
+{
+    return (*scores)(man_id, woman_id);
+}
+
+Man::Man(const CostMatrix &scores, size_t man_id, size_t n_candidates) : engaged(false),
+                                                                        scores(&scores),
+                                                                        man_id(man_id),
+                                                                        n_candidates(n_candidates),
+                                                                        all_women_ranked(false),
+                                                                        last_ranked_woman(0)
+{
+    if (this->n_candidates == 0 || this->n_candidates > scores.cols())
+        this->n_candidates = scores.cols();
+    rank_next_women(std::vector<Woman>());
+}
+
+bool Man::propose_to_best_woman(const std::vector<Woman> &women, size_t &best_woman_id)
+{
+    while (true)
+    {
+        if (sorted_women.empty() && !rank_next_women(women))
+            return false;
+
+        best_woman_id = sorted_women.back();
+        sorted_women.pop_back();
+        if (women[best_woman_id].would_accept((*scores)(man_id, best_woman_id)))
+            return true;
+    }
+}
+
+void Man::engage()
+{
+    engaged = true;
+}
+
+void Man::break_engagement()
+{
+    engaged = false;
+}
+
+bool Man::is_engaged() const
+{
+    return engaged;
+}
+
+bool Man::rank_next_women(const std::vector<Woman> &women)
+{
+    if (all_women_ranked)
+        return false;
+
+    // Scratch buffers, shared by all the men built on the same thread
+    thread_local std::vector<float> row;
+    thread_local std::vector<uint32_t> candidates;
+    const size_t n_women = scores->cols();
+    row.resize(n_women);
+    scores->get_row(man_id, row.data());
+    const auto is_better = [](uint32_t a, uint32_t b) {
+        return row[a] < row[b] || (row[a] == row[b] && a < b);
+    };
+
+    // Candidates are worse than the last ranked woman, and wouldn't reject him right away
+    const bool first_ranking = (sorted_women.capacity() == 0);
+    candidates.clear();
+    for (uint32_t j = 0; j < n_women; j++)
+        if ((first_ranking || is_better(last_ranked_woman, j)) && (women.empty() || women[j].would_accept(row[j])))
+            candidates.push_back(j);
+
+    // Partial selection of the best ones
+    const size_t n = std::min(n_candidates, candidates.size());
+    all_women_ranked = (n == candidates.size());
+    if (n == 0)
+        return false;
+    if (n < candidates.size())
+        std::nth_element(candidates.begin(), candidates.begin() + n, candidates.end(), is_better);
+    std::sort(candidates.begin(), candidates.begin() + n, is_better);
+
+    // Best women on top of the stack
+    sorted_women.assign(std::reverse_iterator<std::vector<uint32_t>::iterator>(candidates.begin() + n),
+                        std::reverse_iterator<std::vector<uint32_t>::iterator>(candidates.begin()));
+    last_ranked_woman = candidates[n - 1];
+    return true;
+}
+
+GaleShapleyAlgorithm::GaleShapleyAlgorithm(size_t n_candidates) : n_candidates_(n_candidates) {}
+
+bool GaleShapleyAlgorithm::solve(const CostMatrix &input_scores, std::vector<size_t> &output_matches)
+{
+    // Check if there are enough men
+    const int n_men = input_scores.rows();
+    const int n_women = input_scores.cols();
+    if (n_men < n_women)
+    {
+        std::cerr << "There's not enough men to get each woman engaged. Got " << n_men << " men and "
+                  << n_women << " women." << std::endl;
+        return false;
+    }
+
+    // Men rank their best women
+    men_.reserve(n_men);
+    for (int i = 0; i < n_men; i++)
+        men_.emplace_back(input_scores, i, n_candidates_);
+
+    // Women read their scores directly from the matrix
+    women_.reserve(n_women);
+    for (int j = 0; j < n_women; j++)
+        women_.emplace_back(input_scores, j);
+
+    std::cout << "Gale-Shapley Algorithm: " << men_.size() << " men and " << women_.size() << " women";
+    if (n_candidates_ > 0)
+        std::cout << ", " << n_candidates_ << " candidates per man";
+    std::cout << "." << std::endl;
+
+    // Solve
+    if (!find_stable_configuration())
+        return false;
+
+    output_matches.clear();
+    output_matches.reserve(women_.size());
+    for (const auto &woman : women_)
+        output_matches.emplace_back(woman.get_man_id());
+
+    return true;
+}
+
+bool GaleShapleyAlgorithm::find_stable_configuration()
+{
+    std::cout << "Starts solving..." << std::endl;
+    bool men_keep_proposing = true; // More optimal to use this as termination criterion !
+    int last_decile = 0;            // From 0 to 10
+    while (men_keep_proposing)
+    {
+        men_keep_proposing = false;
+        int n_changes = 0;
+        // Men propose
+        size_t man_id = 0;
+        for (auto it_man = men_.begin(); it_man != men_.end(); it_man++, man_id++)
+        {
+            if (it_man->is_engaged())
+                continue;
+
+            size_t best_woman_id;
+            if (!it_man->propose_to_best_woman(women_, best_woman_id))
+                continue;
+
+            men_keep_proposing = true;
+            women_[best_woman_id].add_proposal(man_id);
+        }
+
+        // Women dispose
+        for (auto &woman : women_)
+        {
+            size_t old_man_id, new_man_id;
+            if (woman.update_engagement(old_man_id, new_man_id))
+            {
+                n_changes++;
+                if (old_man_id < men_.size()) // Otherwise she was single
+                    men_[old_man_id].break_engagement();
+                men_[new_man_id].engage();
+            }
+        }
+
+        const int decile = (10 * Woman::number_of_engaged_women) / women_.size();
+        if (decile > last_decile)
+        {
+            last_decile = decile;
+            std::cout << "Engaged women: " << 10 * decile << "%" << std::endl;
+        }
+    }
+
+    return true;
+}
+} // namespace legacy
+
+/// @brief Runs @p func @p n_repeats times and returns the best duration in milliseconds
+template <typename F>
+double time_best_of(int n_repeats, F func)
+{
+    double best_ms = 1e30;
+    for (int k = 0; k < n_repeats; k++)
+    {
+        const auto begin = std::chrono::high_resolution_clock::now();
+        func();
+        const auto end = std::chrono::high_resolution_clock::now();
+        best_ms = std::min(best_ms, std::chrono::duration<double, std::milli>(end - begin).count());
+    }
+    return best_ms;
+}
+
+/// @brief Silences std::cout while in scope, to keep the progress of the solvers out of the timings
+class SilentCout
+{
+public:
+    SilentCout() : old_buffer_(std::cout.rdbuf(sink_.rdbuf())) {}
+    ~SilentCout() { std::cout.rdbuf(old_buffer_); }
+
+private:
+    std::ostringstream sink_;
+    std::streambuf *old_buffer_;
+};
+
+int main(int argc, char **argv)
+{
+    int n_men, n_women, n_replaced, n_repeats;
+    std::vector<size_t> candidates;
+    boost_po::options_description options("Compare the flat Gale-Shapley solver to the round-based one");
+    // clang-format off
+    options.add_options()
+        ("help,h", "Produce help message.")
+        ("men,m", boost_po::value<int>(&n_men)->default_value(20000), "Number of men, i.e. of capsules.")
+        ("women,w", boost_po::value<int>(&n_women)->default_value(5000), "Number of women, i.e. of cutouts.")
+        ("candidates,k", boost_po::value<std::vector<size_t>>(&candidates)->multitoken()->default_value({0, 16}, "0 16"),
+            "Numbers of women ranked at once by each man. 0 to rank all of them upfront.")
+        ("replaced,p", boost_po::value<int>(&n_replaced)->default_value(20),
+            "Number of men replaced before solving again from the previous matching.")
+        ("repeats,r", boost_po::value<int>(&n_repeats)->default_value(3), "Number of runs, the best one is kept.")
+        ;
+    // clang-format on
+
+    boost_po::variables_map vm;
+    try
+    {
+        boost_po::store(boost_po::command_line_parser(argc, argv).options(options).run(), vm);
+        boost_po::notify(vm);
+    }
+    catch (boost_po::error &e)
+    {
+        std::cerr << options << std::endl;
+        std::cerr << "Parsing error:" << e.what() << std::endl;
+        return 1;
+    }
+    if (vm.count("help"))
+    {
+        std::cout << options << std::endl;
+        return 0;
+    }
+
+    // Random scores
+    std::mt19937 generator(42);
+    std::uniform_real_distribution<float> distribution(0.f, 1.f);
+    CostMatrix scores(n_men, n_women);
+    std::vector<float> row(n_women);
+    for (int i = 0; i < n_men; i++)
+    {
+        for (auto &score : row)
+            score = distribution(generator);
+        scores.set_row(i, row.data());
+    }
+
+    ThreadPool thread_pool;
+    std::cout << n_men << " men x " << n_women << " women, " << thread_pool.size() << " threads" << std::endl;
+    for (const size_t n_candidates : candidates)
+    {
+        std::vector<size_t> legacy_matches, matches;
+        bool legacy_success = false, success = false;
+        const double legacy_ms = time_best_of(n_repeats, [&]() {
+            SilentCout silent;
+            legacy::Woman::number_of_engaged_women = 0;
+            legacy::GaleShapleyAlgorithm solver(n_candidates);
+            legacy_success = solver.solve(scores, legacy_matches);
+        });
+        const double flat_ms = time_best_of(n_repeats, [&]() {
+            SilentCout silent;
+            GaleShapleyAlgorithm solver(thread_pool, n_candidates);
+            success = solver.solve(scores, matches);
+        });
+
+        // Both solvers find the men-optimal stable matching, which is unique without ties
+        size_t n_differences = 0;
+        for (size_t j = 0; j < std::min(matches.size(), legacy_matches.size()); j++)
+            n_differences += (matches[j] != legacy_matches[j]);
+
+        std::cout << "K = " << n_candidates << (n_candidates == 0 ? " (all women)" : "") << std::endl;
+        std::cout << "  Round-based: " << legacy_ms << " ms" << (legacy_success ? "" : ", failed") << std::endl;
+        std::cout << "  Flat arrays: " << flat_ms << " ms, x" << legacy_ms / flat_ms << (success ? "" : ", failed")
+                  << ", " << n_differences << " different matches" << std::endl;
+    }
+
+    // Replace a few men, i.e. capsules, and solve again from the previous matching
+    const size_t n_candidates = candidates.empty() ? 0 : candidates.back();
+    std::vector<size_t> initial_matches, cold_matches, warm_matches;
+    GaleShapleyAlgorithm solver(thread_pool, n_candidates);
+    {
+        SilentCout silent;
+        solver.solve(scores, initial_matches);
+    }
+    std::uniform_int_distribution<int> man_distribution(0, n_men - 1);
+    for (int k = 0; k < n_replaced; k++)
+    {
+        for (auto &score : row)
+            score = distribution(generator);
+        scores.set_row(man_distribution(generator), row.data());
+    }
+    const double cold_ms = time_best_of(n_repeats, [&]() {
+        SilentCout silent;
+        solver.solve(scores, cold_matches);
+    });
+    const double warm_ms = time_best_of(n_repeats, [&]() {
+        SilentCout silent;
+        solver.solve(scores, initial_matches, warm_matches);
+    });
+
+    // The warm matching is stable, but may differ from the men-optimal one
+    size_t n_differences = 0;
+    for (size_t j = 0; j < std::min(cold_matches.size(), warm_matches.size()); j++)
+        n_differences += (cold_matches[j] != warm_matches[j]);
+    std::cout << n_replaced << " men replaced, K = " << n_candidates << std::endl;
+    std::cout << "  Cold start: " << cold_ms << " ms" << std::endl;
+    std::cout << "  Warm start: " << warm_ms << " ms, x" << cold_ms / warm_ms << ", " << n_differences
+              << " different matches" << std::endl;
+    return 0;
+}
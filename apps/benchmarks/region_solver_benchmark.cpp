@@ -0,0 +1,198 @@
+/*********************************************************************************************************************
+ * File : region_solver_benchmark.cpp                                                                                *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <capsule_descriptor.h>
+#include <capsule_index.h>
+#include <capsules_solver.h>
+#include <thread_pool.h>
+
+namespace boost_po = boost::program_options;
+namespace fs = boost::filesystem;
+
+/// @brief Runs @p func once and returns its duration in milliseconds
+template <typename F>
+double time_once(F func)
+{
+    const auto begin = std::chrono::high_resolution_clock::now();
+    func();
+    const auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+/// @brief Redirects std::cout to a string while it's alive, to silence the solver
+class SilentCout
+{
+public:
+    SilentCout() : old_buffer_(std::cout.rdbuf(sink_.rdbuf())) {}
+    ~SilentCout() { std::cout.rdbuf(old_buffer_); }
+
+private:
+    std::ostringstream sink_;
+    std::streambuf *old_buffer_;
+};
+
+/// @brief Draws a disk of a given rim color, with a motif of another color at its center
+cv::Mat draw_capsule(int size, const cv::Scalar &rim_bgr, const cv::Scalar &motif_bgr)
+{
+    cv::Mat capsule(size, size, CV_8UC3, rim_bgr);
+    cv::circle(capsule, cv::Point(size / 2, size / 2), size / 4, motif_bgr, -1);
+    return capsule;
+}
+
+int main(int argc, char **argv)
+{
+    int n_capsules, n_rows, n_cols, capsule_size;
+    std::string assignment_method, metric;
+    CapsulesSolverOptions solver_options;
+    boost_po::options_description options("Compare solving a grid region by region to solving it at once");
+    // clang-format off
+    options.add_options()
+        ("help,h", "Produce help message.")
+        ("capsules,c", boost_po::value<int>(&n_capsules)->default_value(20000), "Number of reference capsules.")
+        ("rows,r", boost_po::value<int>(&n_rows)->default_value(100), "Number of rows of the grid.")
+        ("cols,l", boost_po::value<int>(&n_cols)->default_value(100), "Number of columns of the grid.")
+        ("region-cells,g", boost_po::value<size_t>(&solver_options.region_cells)->default_value(1024), "Cells per region.")
+        ("region-slack,k", boost_po::value<float>(&solver_options.region_slack)->default_value(0.5f), "Spare capsules given to each region, relatively to its number of cells.")
+        ("assignment,a", boost_po::value<std::string>(&assignment_method)->default_value("gale-shapley"), "Assignment algorithm: 'gale-shapley' or 'auction'.")
+        ("metric,m", boost_po::value<std::string>(&metric)->default_value("bgr"), "Color metric: 'bgr' or 'lab-sectors'.")
+        ("size,s", boost_po::value<int>(&capsule_size)->default_value(16), "Side in pixels of the synthetic capsules.")
+        ;
+    // clang-format on
+
+    boost_po::variables_map vm;
+    try
+    {
+        boost_po::store(boost_po::command_line_parser(argc, argv).options(options).run(), vm);
+        boost_po::notify(vm);
+    }
+    catch (boost_po::error &e)
+    {
+        std::cerr << options << std::endl;
+        std::cerr << "Parsing error:" << e.what() << std::endl;
+        return 1;
+    }
+    if (vm.count("help"))
+    {
+        std::cout << options << std::endl;
+        return 0;
+    }
+    if (!AssignmentSolver::parse_method(assignment_method, solver_options.assignment_method) ||
+        !CapsuleDescriptor::parse_metric(metric, solver_options.metric))
+    {
+        std::cerr << options << std::endl;
+        return 1;
+    }
+    if (solver_options.region_cells == 0 || n_capsules < n_rows * n_cols)
+    {
+        std::cerr << "Needs regions, and at least as many capsules as cells." << std::endl;
+        return 1;
+    }
+
+    // Random capsules, packed in an archive in a temporary directory so that nothing has to be decoded
+    ThreadPool thread_pool;
+    std::mt19937 generator(42);
+    std::uniform_real_distribution<float> distribution(0.f, 255.f);
+    const auto random_color = [&]() {
+        return cv::Scalar(distribution(generator), distribution(generator), distribution(generator));
+    };
+    const fs::path capsules_dir = fs::temp_directory_path() / fs::unique_path("region_solver_benchmark_%%%%%%%%");
+    fs::create_directories(capsules_dir);
+    bool success = false;
+    {
+        std::vector<std::string> filenames(n_capsules);
+        std::vector<cv::Mat> capsules(n_capsules);
+        for (int i = 0; i < n_capsules; i++)
+        {
+            filenames[i] = "capsule_" + std::to_string(i) + ".png";
+            capsules[i] = draw_capsule(capsule_size, random_color(), random_color());
+        }
+        CapsuleIndexWriter writer(capsules_dir.string(), capsule_size, true);
+        success = writer.open() && writer.append(filenames, capsules, thread_pool);
+    }
+    CapsuleIndex capsule_index(capsules_dir.string(), capsule_size);
+    success = success && capsule_index.load();
+    if (!success)
+    {
+        std::cerr << "Unable to create the capsule archive in " << capsules_dir << std::endl;
+        fs::remove_all(capsules_dir);
+        return 1;
+    }
+    std::vector<size_t> capsule_ids(capsule_index.size());
+    std::iota(capsule_ids.begin(), capsule_ids.end(), 0);
+
+    // Cells of a smooth gradient with some noise, like a photo, stored row after row
+    std::normal_distribution<float> noise(0.f, 12.f);
+    std::vector<CapsuleDescriptor> cutouts_descriptors(n_rows * n_cols);
+    for (int y = 0; y < n_rows; y++)
+        for (int x = 0; x < n_cols; x++)
+        {
+            const cv::Scalar bgr(255.f * x / n_cols + noise(generator), 255.f * y / n_rows + noise(generator),
+                                 128.f + noise(generator));
+            CapsuleDescriptor::compute(draw_capsule(capsule_size, bgr, bgr * 0.8),
+                                       cutouts_descriptors[y * n_cols + x]);
+        }
+
+    std::cout << n_capsules << " capsules, " << n_rows << "x" << n_cols << " cells, " << thread_pool.size()
+              << " threads" << std::endl;
+
+    // The whole grid at once, silently, as the reference
+    std::vector<size_t> flat_matches;
+    bool flat_success = false;
+    CapsulesSolverOptions flat_options = solver_options;
+    flat_options.region_cells = 0;
+    CapsulesSolver flat_solver(thread_pool, flat_options);
+    const double flat_ms = time_once([&]() {
+        SilentCout silent;
+        flat_success = flat_solver.match(capsule_index, capsule_ids, cutouts_descriptors, n_rows, n_cols,
+                                         flat_matches);
+    });
+
+    // Region by region, with its own messages: a single summary per phase
+    std::vector<size_t> region_matches;
+    bool region_success = false;
+    CapsulesSolver region_solver(thread_pool, solver_options);
+    const double region_ms = time_once([&]() {
+        region_success = region_solver.match(capsule_index, capsule_ids, cutouts_descriptors, n_rows, n_cols,
+                                             region_matches);
+    });
+    fs::remove_all(capsules_dir);
+    if (!flat_success || !region_success)
+    {
+        std::cerr << "Failed to solve " << (flat_success ? "region by region" : "at once") << std::endl;
+        return 1;
+    }
+
+    // Both matchings must use distinct capsules, and their errors are measured with the same metric
+    std::vector<size_t> sorted_matches = region_matches;
+    std::sort(sorted_matches.begin(), sorted_matches.end());
+    const bool distinct = std::adjacent_find(sorted_matches.cbegin(), sorted_matches.cend()) == sorted_matches.cend();
+    std::vector<float> flat_errors, region_errors;
+    flat_solver.compute_matching_errors(capsule_index, capsule_ids, cutouts_descriptors, flat_matches, flat_errors);
+    region_solver.compute_matching_errors(capsule_index, capsule_ids, cutouts_descriptors, region_matches,
+                                          region_errors);
+    const double flat_error = std::accumulate(flat_errors.cbegin(), flat_errors.cend(), 0.0);
+    const double region_error = std::accumulate(region_errors.cbegin(), region_errors.cend(), 0.0);
+
+    std::cout << "At once: " << flat_ms << " ms, total error " << flat_error << std::endl;
+    std::cout << "Region by region: " << region_ms << " ms, x" << flat_ms / region_ms << ", total error "
+              << region_error << ", gap " << 100 * (region_error - flat_error) / std::max(1e-9, flat_error) << "%"
+              << (distinct ? "" : ", some capsules used twice") << std::endl;
+    return distinct ? 0 : 1;
+}
@@ -0,0 +1,202 @@
+/*********************************************************************************************************************
+ * File : capsule_archive_app.cpp                                                                                    *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <atomic>
+#include <set>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <timer.h>
+
+#include <capsule_index.h>
+
+namespace boost_po = boost::program_options;
+namespace fs = boost::filesystem;
+
+struct Config
+{
+    std::string capsules_dir_path;
+    std::string png_dir_path;
+    bool import_pngs = false;
+    bool export_pngs = false;
+    int n_threads = 0;
+};
+
+/// @brief Utility function to parse command line attributes
+bool parse_command_line(int argc, char *argv[], Config &config)
+{
+    std::cout << "Convert capsules between PNG images and the capsule archive of a capsules directory."
+              << std::endl
+              << std::endl;
+
+    boost_po::options_description options;
+    // clang-format off
+    options.add_options()
+        ("help,h", "Produce help message.")
+        ("capsules-dir,c", boost_po::value<std::string>(&config.capsules_dir_path)->default_value("/tmp/Capsules"), "Path to the capsules directory holding the archive.")
+        ("png-dir,p",      boost_po::value<std::string>(&config.png_dir_path), "Path to the directory of the PNG images. Defaults to the capsules directory.")
+        ("import,i",       boost_po::bool_switch(&config.import_pngs)->default_value(false), "Append the PNG images to the archive, skipping the ones already archived.")
+        ("export,e",       boost_po::bool_switch(&config.export_pngs)->default_value(false), "Write the capsules of the archive as PNG images.")
+        ("threads,t",      boost_po::value<int>(&config.n_threads)->default_value(0), "Number of worker threads. 0 to use the hardware concurrency.")
+        ;
+    // clang-format on
+
+    boost_po::variables_map vm;
+    try
+    {
+        boost_po::store(boost_po::command_line_parser(argc, argv).options(options).run(), vm);
+        boost_po::notify(vm);
+    }
+    catch (boost_po::error &e)
+    {
+        std::cerr << options << std::endl;
+        std::cerr << "Parsing error:" << e.what() << std::endl;
+        return false;
+    }
+
+    if (vm.count("help"))
+    {
+        std::cout << options << std::endl;
+        return false;
+    }
+
+    if (config.import_pngs == config.export_pngs)
+    {
+        std::cerr << "Choose either --import or --export." << std::endl;
+        return false;
+    }
+    if (config.n_threads < 0)
+    {
+        std::cerr << "The number of threads must be positive. Got " << config.n_threads << "." << std::endl;
+        return false;
+    }
+    if (config.png_dir_path.empty())
+        config.png_dir_path = config.capsules_dir_path;
+    if (config.import_pngs && !fs::exists(config.png_dir_path))
+    {
+        std::cerr << "The PNG directory path doesn't exist: " << config.png_dir_path << std::endl;
+        return false;
+    }
+    if (config.export_pngs && !fs::exists(fs::path(config.capsules_dir_path) / CapsuleIndex::archive_filename))
+    {
+        std::cerr << "There's no capsule archive in " << config.capsules_dir_path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/// @brief Appends the PNG images of a directory to the capsule archive, batch after batch
+bool import_pngs(const Config &config, ThreadPool &thread_pool)
+{
+    std::vector<cv::String> paths;
+    cv::glob(config.png_dir_path + "/*.png", paths);
+    if (paths.empty())
+    {
+        std::cerr << "No PNG image in " << config.png_dir_path << std::endl;
+        return false;
+    }
+
+    // The size of the capsules is the one of the existing archive, or the one of the first image
+    CapsuleIndex archive(config.capsules_dir_path);
+    int capsule_size = 0;
+    if (fs::exists(fs::path(config.capsules_dir_path) / CapsuleIndex::archive_filename) && archive.load())
+        capsule_size = archive.get_thumbnail_size();
+    else
+        capsule_size = cv::imread(paths.front()).rows;
+    if (capsule_size <= 0)
+    {
+        std::cerr << "Unable to read " << paths.front() << std::endl;
+        return false;
+    }
+
+    fs::create_directories(config.capsules_dir_path);
+    CapsuleIndexWriter writer(config.capsules_dir_path, capsule_size, true);
+    if (!writer.open(&archive))
+        return false;
+    std::set<std::string> archived_filenames;
+    for (size_t i = 0; i < archive.size(); i++)
+        archived_filenames.insert(archive.get_record(i).filename);
+
+    // Decode the images in parallel, and append them by batches to bound the memory
+    const size_t batch_size = 256;
+    size_t n_imported = 0, n_skipped = 0;
+    for (size_t batch_begin = 0; batch_begin < paths.size(); batch_begin += batch_size)
+    {
+        std::vector<std::string> filenames;
+        std::vector<std::string> batch_paths;
+        for (size_t i = batch_begin; i < std::min(paths.size(), batch_begin + batch_size); i++)
+        {
+            const std::string filename = fs::path(paths[i]).filename().string();
+            if (archived_filenames.count(filename))
+            {
+                n_skipped++;
+                continue;
+            }
+            filenames.push_back(filename);
+            batch_paths.push_back(paths[i]);
+        }
+
+        std::vector<cv::Mat> capsules(batch_paths.size());
+        std::atomic<size_t> n_failures(0);
+        thread_pool.parallel_for(0, batch_paths.size(), [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; k++)
+            {
+                capsules[k] = cv::imread(batch_paths[k]);
+                if (capsules[k].empty() || capsules[k].rows != capsules[k].cols)
+                {
+                    std::cerr << "Unable to read the square capsule " + batch_paths[k] + "\n";
+                    n_failures++;
+                }
+            }
+        });
+        if (n_failures > 0 || !writer.append(filenames, capsules, thread_pool))
+            return false;
+        n_imported += capsules.size();
+    }
+    std::cout << "Imported " << n_imported << " capsules, skipped " << n_skipped << " already archived." << std::endl;
+    return true;
+}
+
+/// @brief Writes the capsules of the archive as PNG images
+bool export_pngs(const Config &config, ThreadPool &thread_pool)
+{
+    CapsuleIndex archive(config.capsules_dir_path);
+    if (!archive.load() || !archive.is_archive())
+        return false;
+
+    fs::create_directories(config.png_dir_path);
+    std::atomic<size_t> n_failures(0);
+    thread_pool.parallel_for(0, archive.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            const std::string path = (fs::path(config.png_dir_path) / archive.get_record(i).filename).string();
+            if (!cv::imwrite(path, archive.get_image(i)))
+            {
+                std::cerr << "Unable to write " + path + "\n";
+                n_failures++;
+            }
+        }
+    });
+    if (n_failures > 0)
+        return false;
+    std::cout << "Exported " << archive.size() << " capsules." << std::endl;
+    if (fs::equivalent(config.png_dir_path, config.capsules_dir_path))
+        std::cout << "The archive takes precedence over the images, remove " << CapsuleIndex::archive_filename
+                  << " to use them." << std::endl;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Config config;
+    if (!parse_command_line(argc, argv, config))
+        return 1;
+
+    ThreadPool thread_pool(config.n_threads);
+    Timer timer(config.import_pngs ? "Import capsules" : "Export capsules", Timer::MS);
+    const bool success = config.import_pngs ? import_pngs(config, thread_pool) : export_pngs(config, thread_pool);
+    return success ? 0 : 1;
+}
@@ -18,6 +18,8 @@ struct Config
     cv::Mat input_img;
     std::string capsules_dir_path;
     int n_rows;
+    int n_threads;
+    CapsulesSolverOptions solver_options;
 
     bool display_errors;
     std::string output_dir_path;
@@ -27,6 +29,9 @@ struct Config
 bool parse_command_line(int argc, char *argv[], Config &config)
 {
     std::string image_path;
+    bool quantize_costs = false;
+    std::string assignment_method;
+    std::string metric;
 
     const std::string short_program_desc(
         "Find the optimal arrangement of champagne capsules to represent a given photograph.\n");
@@ -49,12 +54,28 @@ bool parse_command_line(int argc, char *argv[], Config &config)
         ("input-image,i", boost_po::value<std::string>(&image_path), "Path to an image file.")
         ("input-capsules,c", boost_po::value<std::string>(&config.capsules_dir_path)->default_value("/tmp/Capsules"), "Path to the directory containing the loaded capsules.")
         ("nbr-rows,r", boost_po::value<int>(&config.n_rows), "Number of capsules rows of the final composition.")
+        ("threads,t", boost_po::value<int>(&config.n_threads)->default_value(0), "Number of worker threads. 0 to use the hardware concurrency.")
+        ("quantize-costs,q", boost_po::bool_switch(&quantize_costs)->default_value(false), "Store the errors matrix on 16 bits instead of 32 to halve its memory footprint.")
+        ("squared-errors", boost_po::bool_switch(&config.solver_options.squared_errors)->default_value(false), "Match on squared color distances, which skips the square roots.")
+        ("assignment,a", boost_po::value<std::string>(&assignment_method)->default_value("gale-shapley"), "Matching algorithm: \"gale-shapley\" (stable matching) or \"auction\" (minimum total error).")
+        ("candidates,k", boost_po::value<size_t>(&config.solver_options.n_candidates)->default_value(0), "Number of cells each capsule ranks at once in Gale-Shapley, the next ones being ranked lazily. 0 to rank all of them.")
+        ("nearest-capsules,n", boost_po::value<size_t>(&config.solver_options.n_nearest_capsules)->default_value(0), "Only compare the cells to the capsules that are among the N closest in color to at least one cell. 0 to compare them to all the capsules.")
+        ("metric,m", boost_po::value<std::string>(&metric)->default_value("bgr"), "Distance between capsules and cells: \"bgr\" (mean colors) or \"lab-sectors\" (Lab means of the center and 6 sectors of the disks).")
+        ("memory-budget,b", boost_po::value<size_t>(&config.solver_options.memory_budget_mb)->default_value(0), "Memory for the errors matrix and the matching, in MB. Beyond half of it, the matrix is mapped to a scratch file, Gale-Shapley ranks fewer cells at once and the auction scans the matrix by tiles. 0 for no limit.")
+        ("scratch-dir", boost_po::value<std::string>(&config.solver_options.scratch_directory)->default_value("/tmp"), "Directory of the scratch file holding the errors matrix when it exceeds the memory budget.")
+        ("region-cells", boost_po::value<size_t>(&config.solver_options.region_cells)->default_value(0), "Solve the grid region by region, with about this many cells per region, after distributing color clusters of capsules among the regions. 0 to solve the whole grid at once.")
+        ("region-slack", boost_po::value<float>(&config.solver_options.region_slack)->default_value(0.5f), "Spare capsules given to each region, relatively to its number of cells.")
+        ("refine-seconds", boost_po::value<double>(&config.solver_options.refine_seconds)->default_value(0), "Time budget in seconds of the local search swapping capsules between cells, or with unused capsules, after the matching. 0 to skip it.")
+        ("refine-neighbours", boost_po::value<size_t>(&config.solver_options.refine_neighbours)->default_value(16), "Number of capsules closest in color to a cell that the local search tries on it.")
+        ("dithering", boost_po::value<float>(&config.solver_options.dithering)->default_value(0.f), "Weight in [0, 1] of the blurred mosaic against the blurred image in the objective of the local search, letting the errors of neighbouring cells compensate each other. 0 to score the cells independently.")
+        ("compare-flat", boost_po::bool_switch(&config.solver_options.compare_flat)->default_value(false), "When solving region by region, also solve the whole grid at once and report the gap in total error.")
         ;
     // clang-format on
 
     boost_po::options_description output_options("Output options");
     // clang-format off
     output_options.add_options()
+        ("render-width", boost_po::value<int>(&config.solver_options.render_width)->default_value(0), "Width in pixels of an additional rendering of the mosaic, saved to /tmp/CapsulesImage_print.png, e.g. for a print-size output. 0 to skip it.")
         ("display-errors,e", boost_po::value(&config.display_errors)->default_value(false), "Activate computation and display of the error map or not.")
         ("out-dir,o", boost_po::value<std::string>(&config.output_dir_path)->default_value("/tmp/placomosaic"), "Path of the output directory used to save the images and generate an html "
                                                                        "grid listing the ids of the capsules used in the composition.")
@@ -101,6 +122,44 @@ bool parse_command_line(int argc, char *argv[], Config &config)
         std::cerr << "The number of rows must be strictly positive. Got " << config.n_rows << "." << std::endl;
         return false;
     }
+    config.solver_options.cost_storage = quantize_costs ? CostMatrix::UINT16 : CostMatrix::FLOAT32;
+    if (!AssignmentSolver::parse_method(assignment_method, config.solver_options.assignment_method))
+    {
+        std::cerr << "Unknown assignment algorithm: " << assignment_method << std::endl;
+        return false;
+    }
+    if (!CapsuleDescriptor::parse_metric(metric, config.solver_options.metric))
+    {
+        std::cerr << "Unknown metric: " << metric << std::endl;
+        return false;
+    }
+
+    if (config.solver_options.region_slack < 0)
+    {
+        std::cerr << "The region slack must be positive. Got " << config.solver_options.region_slack << "." << std::endl;
+        return false;
+    }
+    if (config.solver_options.dithering < 0 || config.solver_options.dithering > 1)
+    {
+        std::cerr << "The dithering must be in [0, 1]. Got " << config.solver_options.dithering << "." << std::endl;
+        return false;
+    }
+    if (config.solver_options.dithering > 0 && config.solver_options.refine_seconds <= 0)
+    {
+        std::cerr << "The dithering is optimized by the local search, which needs a time budget (--refine-seconds)."
+                  << std::endl;
+        return false;
+    }
+    if (config.solver_options.render_width < 0)
+    {
+        std::cerr << "The render width must be positive. Got " << config.solver_options.render_width << "." << std::endl;
+        return false;
+    }
+    if (config.n_threads < 0)
+    {
+        std::cerr << "The number of threads must be positive. Got " << config.n_threads << "." << std::endl;
+        return false;
+    }
     if (!fs::exists(image_path))
     {
         std::cerr << "The input image path doesn't exist: " << image_path << std::endl;
@@ -132,7 +191,8 @@ int main(int argc, char **argv)
     if (!parse_command_line(argc, argv, config))
         return 1;
 
-    CapsulesSolver solver;
+    ThreadPool thread_pool(config.n_threads);
+    CapsulesSolver solver(thread_pool, config.solver_options);
     solver.solve(config.input_img, config.capsules_dir_path, config.n_rows);
     return 0;
 }
@@ -17,6 +17,10 @@ struct Config
 {
     std::string capsules_dir_path;
     bool display_caps = false;
+    std::string video_path;
+    bool use_archive = false;
+    int png_compression = 1;
+    int n_threads = 0;
 };
 
 /// @brief Utility function to parse command line attributes
@@ -31,7 +35,11 @@ bool parse_command_line(int argc, char *argv[], Config &config)
     options.add_options()
         ("help,h", "Produce help message.")
         ("input-capsules,i", boost_po::value<std::string>(&config.capsules_dir_path)->default_value("/tmp/Capsules"), "Path to the folder containing the pictures of the capsules grids.")
+        ("video,v",          boost_po::value<std::string>(&config.video_path), "Video, or image sequence such as frames/img_%04d.jpg, showing the capsules grids one after the other. Replaces --input-capsules.")
         ("display,d",        boost_po::bool_switch(&config.display_caps)->default_value(false), "Display the rectified capsules grid with circles showing where capsules have been extracted.")
+        ("threads,t",        boost_po::value<int>(&config.n_threads)->default_value(0), "Number of worker threads. 0 to use the hardware concurrency.")
+        ("archive,a",        boost_po::bool_switch(&config.use_archive)->default_value(false), "Append the capsules to the capsule archive (capsules.pack) instead of saving them as PNG images.")
+        ("png-compression",  boost_po::value<int>(&config.png_compression)->default_value(1), "zlib compression level of the PNG images of the capsules, from 0 (fastest) to 9 (smallest).")
         ;
     // clang-format on
 
@@ -54,7 +62,19 @@ bool parse_command_line(int argc, char *argv[], Config &config)
         return false;
     }
 
-    if (!fs::exists(config.capsules_dir_path))
+    if (config.n_threads < 0)
+    {
+        std::cerr << "The number of threads must be positive. Got " << config.n_threads << "." << std::endl;
+        return false;
+    }
+
+    if (config.png_compression < 0 || config.png_compression > 9)
+    {
+        std::cerr << "The PNG compression level must be in [0, 9]. Got " << config.png_compression << "." << std::endl;
+        return false;
+    }
+
+    if (config.video_path.empty() && !fs::exists(config.capsules_dir_path))
     {
         std::cerr << "The input capsules directory path doesn't exist: " << config.capsules_dir_path << std::endl;
         return false;
@@ -69,10 +89,17 @@ int main(int argc, char **argv)
     if (!parse_command_line(argc, argv, config))
         return 1;
 
-    CapsuleExtractionPattern capsule_pattern(2160, 1630, 58, 20, 6, 5, 140);
-    CapsuleExtractor extractor(capsule_pattern);
+    CapsuleExtractionPattern capsule_pattern(2160, 1630, 58, 20, 6, 5, 140, config.use_archive);
+    if (!capsule_pattern.is_valid())
+        return 1;
+    ThreadPool thread_pool(config.n_threads);
+    CapsuleExtractor extractor(capsule_pattern, thread_pool, config.png_compression);
     {
         Timer timer("Extract and save capsules", Timer::MS);
-        extractor.extract_capsules_from_directory(config.capsules_dir_path, config.display_caps);
+        if (config.video_path.empty())
+            extractor.extract_capsules_from_directory(config.capsules_dir_path, config.display_caps);
+        else
+            extractor.extract_capsules_from_video(config.video_path, config.display_caps);
     }
+    std::cout << "Indexed the colors of " << extractor.get_color_index().size() << " capsules." << std::endl;
 }
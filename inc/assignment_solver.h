@@ -0,0 +1,57 @@
+/*********************************************************************************************************************
+ * File : assignment_solver.h                                                                                        *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef ASSIGNMENT_SOLVER_H
+#define ASSIGNMENT_SOLVER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cost_matrix.h"
+#include "thread_pool.h"
+
+/// @brief Interface of the algorithms assigning a distinct man to each woman, when there are at least as many men as
+/// women. Men are the reference capsules and women are the locations in the image.
+class AssignmentSolver
+{
+public:
+    enum Method
+    {
+        GALE_SHAPLEY, ///< Stable matching
+        AUCTION       ///< Minimum total cost
+    };
+
+    virtual ~AssignmentSolver() {}
+
+    /// @brief Solves the assignment problem
+    /// @param input_scores Coefficient (i, j) corresponds to the score between a man i and a woman j. The lower the
+    /// score the better
+    /// @param output_matches Coefficient [j] corresponds to the index of the man assigned to the woman j
+    /// @return true if the problem has been succesfully solved
+    virtual bool solve(const CostMatrix &input_scores, std::vector<size_t> &output_matches) = 0;
+
+    /// @brief Enables or disables the progress messages, e.g. when several problems are solved concurrently
+    void set_verbose(bool verbose) { verbose_ = verbose; }
+
+    /// @brief Creates a solver
+    /// @param method Algorithm to use
+    /// @param thread_pool Worker threads available to the algorithm
+    /// @param n_candidates Number of women each man ranks at once in Gale-Shapley. 0 to rank all of them
+    /// @param max_resident_bytes Memory in bytes that the rows of a mapped scores matrix may take at once in the
+    /// auction. 0 for no limit
+    static std::unique_ptr<AssignmentSolver> create(Method method, ThreadPool &thread_pool, size_t n_candidates = 0,
+                                                    size_t max_resident_bytes = 0);
+
+    /// @brief Parses the name of a method: "gale-shapley" or "auction"
+    /// @return false if the name is unknown
+    static bool parse_method(const std::string &name, Method &output_method);
+
+protected:
+    bool verbose_ = true; ///< Whether progress messages are printed
+};
+
+#endif // ASSIGNMENT_SOLVER_H
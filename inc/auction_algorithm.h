@@ -0,0 +1,57 @@
+/*********************************************************************************************************************
+ * File : auction_algorithm.h                                                                                        *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef AUCTION_ALGORITHM_H
+#define AUCTION_ALGORITHM_H
+
+#include <vector>
+
+#include "assignment_solver.h"
+
+/// @brief Auction algorithm with epsilon-scaling, finding an assignment of minimum total cost when there are more men
+/// than women (Bertsekas, asymmetric assignment problem).
+///
+/// Women bid for men, whose prices rise until each woman is assigned. Bids of all the unassigned women are computed
+/// in parallel (Jacobi auction), and epsilon is divided at each phase so that the first phases quickly set coarse
+/// prices. A final reverse auction lowers the prices of the men left unassigned, which makes the solution optimal
+/// for the rectangular problem: its total cost is within n_women * epsilon of the minimum.
+///
+/// Each bidding round scans the whole scores matrix. When it's mapped to a scratch file, the rows are scanned by tiles
+/// that fit in the memory budget, each tile being released before the next one.
+class AuctionAlgorithm : public AssignmentSolver
+{
+public:
+    /// @brief Constructor
+    /// @param thread_pool Worker threads computing the bids
+    /// @param max_gap_ratio Bound on the gap to the optimal total cost, relative to the range of the scores
+    /// @param max_resident_bytes Memory in bytes that the rows of a mapped scores matrix may take at once. 0 for no
+    /// limit
+    AuctionAlgorithm(ThreadPool &thread_pool, double max_gap_ratio = 1e-3, size_t max_resident_bytes = 0);
+
+    bool solve(const CostMatrix &input_scores, std::vector<size_t> &output_matches) override;
+
+private:
+    /// @brief Gets the number of rows of the scores matrix scanned at once, within the memory budget
+    size_t get_tile_rows(const CostMatrix &scores) const;
+
+    /// @brief Unassigned women bid for their best men until they're all assigned
+    void run_forward_auction(const CostMatrix &scores, double epsilon);
+
+    /// @brief Unassigned men whose price is above the lowest price of the assigned ones lower it, possibly by
+    /// stealing a woman
+    void run_reverse_auction(const CostMatrix &scores, double epsilon);
+
+    ThreadPool &thread_pool_;
+    double max_gap_ratio_;
+    size_t max_resident_bytes_;
+
+    std::vector<double> prices_;        ///< Price of each man
+    std::vector<double> profits_;       ///< Profit of each woman: -score - price of her man
+    std::vector<int> man_assignment_;   ///< Woman assigned to each man, -1 if none
+    std::vector<int> woman_assignment_; ///< Man assigned to each woman, -1 if none
+};
+
+#endif // AUCTION_ALGORITHM_H
@@ -0,0 +1,115 @@
+/*********************************************************************************************************************
+ * File : bounded_queue.h                                                                                            *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+/// @brief Blocking FIFO queue with a maximum capacity, connecting the stages of a pipeline.
+///
+/// Producers block while the queue is full, which keeps a fast stage from piling up work in memory, and consumers
+/// block while it's empty. Once the producers are done, the queue is closed so that the consumers stop after
+/// draining it.
+template <typename T>
+class BoundedQueue
+{
+public:
+    /// @brief Constructor
+    /// @param capacity Maximum number of items in the queue
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity == 0 ? 1 : capacity), closed_(false) {}
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    /// @brief Pushes an item, waiting for a free slot if the queue is full
+    /// @return false if the queue has been closed, in which case the item is dropped
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]() { return closed_ || items_.size() < capacity_; });
+        if (closed_)
+            return false;
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /// @brief Pops the oldest item, waiting for one if the queue is empty
+    /// @return false if the queue has been closed and drained
+    bool pop(T &output_item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+        if (items_.empty())
+            return false;
+        output_item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    /// @brief Closes the queue. Waiting producers and consumers are released, the remaining items can still be popped
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    bool closed_;
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+/// @brief Window of the items of a pipeline that may be in flight, when they're numbered and consumed in order.
+///
+/// Since the stages process the items out of order, the last stage keeps the early ones until the next one arrives.
+/// A producer only starts an item once it's within the window ahead of the next item to be consumed, so that a slow
+/// item doesn't let all the following ones pile up.
+class SequenceWindow
+{
+public:
+    /// @brief Constructor
+    /// @param size Maximum number of items in flight, from the next one to be consumed
+    explicit SequenceWindow(size_t size) : size_(size == 0 ? 1 : size), next_(0) {}
+
+    SequenceWindow(const SequenceWindow &) = delete;
+    SequenceWindow &operator=(const SequenceWindow &) = delete;
+
+    /// @brief Waits until an item is within the window
+    /// @note The items before it must be started by other threads, or already be
+    /// @param id Number of the item, from 0
+    void wait(size_t id)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        advanced_.wait(lock, [this, id]() { return id < next_ + size_; });
+    }
+
+    /// @brief Moves the window once the items before @p next have been consumed
+    void advance(size_t next)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        next_ = next;
+        advanced_.notify_all();
+    }
+
+private:
+    size_t size_;
+    size_t next_; ///< Next item to be consumed
+    std::mutex mutex_;
+    std::condition_variable advanced_;
+};
+
+#endif // BOUNDED_QUEUE_H
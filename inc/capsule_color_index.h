@@ -0,0 +1,85 @@
+/*********************************************************************************************************************
+ * File : capsule_color_index.h                                                                                      *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef CAPSULE_COLOR_INDEX_H
+#define CAPSULE_COLOR_INDEX_H
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+#include "capsule_index.h"
+
+/// @brief Spatial index of the capsules mean colors, answering nearest neighbours and radius queries for the color
+/// distance of @ref compute_weighted_color_distances.
+///
+/// Colors are scaled by the square roots of the channels weights, so that the weighted distance becomes a plain
+/// Euclidean one, and bucketed into a uniform 3D grid. Since the BGR cube is bounded, the grid is allocated once and
+/// capsules can be inserted at any time without rebuilding anything.
+class CapsuleColorIndex
+{
+public:
+    /// @brief Constructor
+    /// @param cell_size Side of the grid cells, in units of color distance
+    CapsuleColorIndex(float cell_size = 16.f);
+
+    /// @brief Inserts a capsule
+    /// @param id ID returned by the queries for this capsule
+    /// @param mean_bgr Mean color of the capsule
+    void insert(size_t id, const float mean_bgr[3]);
+
+    /// @brief Inserts all the capsules of a capsule index, using their position in the index as ID
+    void insert(const CapsuleIndex &capsule_index);
+
+    /// @brief Removes a capsule, e.g. when its picture has been replaced
+    /// @param id ID given to the capsule when it was inserted
+    /// @return false if there's no capsule with this ID
+    bool remove(size_t id);
+
+    /// @brief Gets the number of indexed capsules
+    size_t size() const;
+
+    /// @brief Finds the @p k capsules closest to a color
+    /// @param bgr Query color
+    /// @param k Number of capsules to find
+    /// @param output_ids IDs of the min(k, size()) closest capsules, sorted by increasing distance and then by ID
+    void find_nearest(const float bgr[3], size_t k, std::vector<size_t> &output_ids) const;
+
+    /// @brief Finds all the capsules within a given color distance
+    /// @param bgr Query color
+    /// @param radius Maximum color distance, included
+    /// @param output_ids IDs of the capsules, in no particular order
+    void find_within_radius(const float bgr[3], float radius, std::vector<size_t> &output_ids) const;
+
+private:
+    /// @brief Capsule stored in a cell of the grid
+    struct Entry
+    {
+        float x, y, z; ///< Weighted color
+        size_t id;
+    };
+
+    /// @brief Maps a BGR color to the weighted space where the color distance is Euclidean
+    void to_weighted_space(const float bgr[3], float output_xyz[3]) const;
+
+    /// @brief Gets the grid coordinate of a weighted coordinate along an axis, clamped to the grid
+    int get_cell_coordinate(float value, int axis) const;
+
+    /// @brief Gets the cell at the given grid coordinates
+    const std::vector<Entry> &get_cell(int cx, int cy, int cz) const
+    {
+        return cells_[(cz * n_cells_[1] + cy) * n_cells_[0] + cx];
+    }
+
+    float cell_size_;
+    int n_cells_[3];                              ///< Number of cells along each axis
+    float scales_[3];                             ///< Square roots of the channels weights
+    std::vector<std::vector<Entry>> cells_;       ///< Capsules bucketed by cell, x being the fastest axis
+    std::unordered_map<size_t, size_t> cell_ids_; ///< Index in cells_ of the cell of each capsule, by ID
+    size_t size_;
+};
+
+#endif // CAPSULE_COLOR_INDEX_H
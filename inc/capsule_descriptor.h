@@ -0,0 +1,56 @@
+/*********************************************************************************************************************
+ * File : capsule_descriptor.h                                                                                       *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef CAPSULE_DESCRIPTOR_H
+#define CAPSULE_DESCRIPTOR_H
+
+#include <string>
+#include <opencv2/core/mat.hpp>
+
+/// @brief Color descriptor of a disk inscribed in a square image, shared by the capsules and the cutouts of the
+/// input image.
+///
+/// Pixels outside of the disk are ignored, so that the black background doesn't darken the colors. The disk is split
+/// into 7 regions: 6 angular sectors of 60 degrees on the ring outside of half the radius, starting from the right and
+/// going clockwise in image coordinates, and the central disk of half the radius. The latter describes the motif
+/// printed at the center of the capsule, and the former its rim.
+struct CapsuleDescriptor
+{
+    /// @brief Distance used to compare two descriptors
+    enum Metric
+    {
+        MEAN_BGR,   ///< Weighted distance between the mean colors of the disks
+        LAB_SECTORS ///< Euclidean distance between the Lab means of the regions, weighted by their area
+    };
+
+    static const int n_regions = 7; ///< 6 sectors and the center
+
+    float mean_bgr[3];               ///< Mean color of the disk
+    float regions_lab[n_regions][3]; ///< Mean Lab color of each region. L in [0, 100], a and b in [-127, 127]
+
+    static const float region_weights[n_regions]; ///< Area of each region, relatively to the disk's one
+
+    /// @brief Computes the descriptor of the disk inscribed in an image
+    /// @param image Square BGR image of a capsule or a cutout
+    /// @param output_descriptor Output descriptor
+    /// @return true if it was successful
+    static bool compute(const cv::Mat &image, CapsuleDescriptor &output_descriptor);
+
+    /// @brief Computes the descriptor of the disk inscribed in a square window of an image, reading the pixels in
+    /// place, row span by row span, without allocating anything
+    /// @param image BGR image, CV_8UC3
+    /// @param lab Conversion of @p image to Lab, CV_32FC3, from BGR values in [0, 1]
+    /// @param window Square window containing the disk, inside both images
+    /// @param output_descriptor Output descriptor
+    static void compute(const cv::Mat &image, const cv::Mat &lab, const cv::Rect &window,
+                        CapsuleDescriptor &output_descriptor);
+
+    /// @brief Converts the name of a metric, as given on the command line, into a metric
+    /// @return false if the name is unknown
+    static bool parse_metric(const std::string &name, Metric &output_metric);
+};
+
+#endif // CAPSULE_DESCRIPTOR_H
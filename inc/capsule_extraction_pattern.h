@@ -7,13 +7,21 @@
 #ifndef CAPSULE_EXTRACTION_PATTERN_H
 #define CAPSULE_EXTRACTION_PATTERN_H
 
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <opencv2/core/mat.hpp>
 
+#include "capsule_color_index.h"
+#include "capsule_index.h"
+#include "capsule_writer.h"
+#include "thread_pool.h"
+
 /// @brief Class representing an orthogonal grid of capsules, and extracts cutouts of the capsules when the user
 /// gives the class a warped 2D observation of this 2D grid in the 3D world.
 ///
-/// @note The capsules images are saved in the output directory
+/// @note The capsules images are saved in the output directory, along with an index of their descriptors, or appended
+/// to the capsule archive of the directory. The capsules saved by the previous runs are kept
 class CapsuleExtractionPattern
 {
 public:
@@ -55,31 +63,105 @@ public:
     /// @param n_rows Number of circles rows in the grid
     /// @param radius Radius in pixels of the grid circles. It will determine the export size in pixels of the
     /// extracted capsules
+    /// @param use_archive Append the capsules to the capsule archive of the output directory, instead of saving them
+    /// as PNG images
     CapsuleExtractionPattern(int width,
                              int height,
                              int edge_x,
                              int edge_y,
                              int n_cols,
                              int n_rows,
-                             int radius);
+                             int radius,
+                             bool use_archive = false);
 
     /// @brief Maps the 2D detection of the 4 corners to our reference rectangular contour and extracts capsules on it
     /// using the geometry information
-    /// @note The capsules images are saved in the output directory
-    /// @param capsules_batch_id All the capsules extracted on this image share the ID of the image
+    /// @note It's reentrant, so that several pictures can be processed in parallel
     /// @param corners 4 points of the rectangle detected on the image
     /// @param src_img Image on which the rectangle has been detected
     /// @param output_rectified_image Detected ROI after the affine transformation, that makes it rectangular
+    /// @param output_capsules Images of the capsules, cropped into disks, row after row
     /// @param draw_circles Draw circles on @p output_rectified_image to show where capsules have been extracted
-    bool warp_image_and_extract_capsules(const size_t capsules_batch_id,
-                                         const std::vector<cv::Point2f> &corners,
+    /// @return true if it was successful
+    bool warp_image_and_extract_capsules(const std::vector<cv::Point2f> &corners,
                                          const cv::Mat &src_img,
                                          cv::Mat &output_rectified_image,
-                                         bool draw_circles = true);
+                                         std::vector<cv::Mat> &output_capsules,
+                                         bool draw_circles = true) const;
+
+    /// @brief Maps the 2D detection of the 4 corners to our reference rectangular contour, e.g. to display where the
+    /// capsules are extracted
+    /// @note It's reentrant, so that several pictures can be processed in parallel
+    /// @param corners 4 points of the rectangle detected on the image
+    /// @param src_img Image on which the rectangle has been detected
+    /// @param output_rectified_image Detected ROI after the affine transformation, that makes it rectangular
+    /// @param draw_circles Draw circles on @p output_rectified_image around the capsules
+    /// @return true if it was successful
+    bool rectify_image(const std::vector<cv::Point2f> &corners,
+                       const cv::Mat &src_img,
+                       cv::Mat &output_rectified_image,
+                       bool draw_circles = true) const;
+
+    /// @brief Extracts the capsules straight from a picture of the grid, without rectifying the whole grid.
+    ///
+    /// Only the disks of the capsules are warped, each one through a remap table mapping its pixels to the picture by
+    /// the homography of the grid. The picture can thus be the full-resolution one, the detection being done on a
+    /// downscaled copy: it's halved only while the grid is more than twice as large as the reference one, so that
+    /// bilinear sampling doesn't alias.
+    /// @note It's reentrant, so that several pictures can be processed in parallel
+    /// @param corners 4 points of the rectangle detected on the image
+    /// @param src_img Picture from which the capsules are extracted
+    /// @param corners_scale Scale of @p src_img relatively to the image on which the corners have been detected
+    /// @param thread_pool Worker threads used to warp the capsules in parallel
+    /// @param output_capsules Images of the capsules, cropped into disks, row after row
+    /// @return true if it was successful
+    bool extract_capsules(const std::vector<cv::Point2f> &corners,
+                          const cv::Mat &src_img,
+                          double corners_scale,
+                          ThreadPool &thread_pool,
+                          std::vector<cv::Mat> &output_capsules) const;
+
+    /// @brief Queues the images of capsules to be saved in the output directory by a background writer
+    /// @note They're named capsule_<batch_name>_<k>.png, k being the index of the capsule in the grid. Nothing is
+    /// written with the archive, which stores their raw pixels in their records instead, nor if @ref is_valid is false
+    /// @param batch_name Name shared by all the capsules extracted on the same image
+    /// @param capsules Images of the capsules, as returned by @ref warp_image_and_extract_capsules. They mustn't be
+    /// modified until written
+    /// @param writer Background writer encoding the images
+    /// @return Ticket of the images in @p writer, to wait for them before calling @ref index_capsules
+    size_t write_capsules(const std::string &batch_name, const std::vector<cv::Mat> &capsules,
+                          CapsuleWriter &writer) const;
+
+    /// @brief Appends capsules to the capsule index, or to the capsule archive
+    /// @note Their images, if any, must have been written by @ref write_capsules
+    /// @param batch_name Name shared by all the capsules extracted on the same image
+    /// @param capsules Images of the capsules, as returned by @ref warp_image_and_extract_capsules
+    /// @param thread_pool Worker threads used to describe the capsules in parallel
+    /// @return true if it was successful
+    bool index_capsules(const std::string &batch_name, const std::vector<cv::Mat> &capsules, ThreadPool &thread_pool);
+
+    /// @brief Deletes the images of capsules saved by @ref write_capsules and @ref index_capsules, or removes them
+    /// from the archive
+    /// @note Their records will be dropped from the capsule index the next time it's loaded. They're removed from the
+    /// color index right away
+    /// @param batch_name Name shared by all the capsules extracted on the same image
+    /// @param n_capsules Number of capsules of the batch
+    /// @return true if it was successful. On failure in archive mode, nothing has been removed
+    bool remove_capsules(const std::string &batch_name, size_t n_capsules);
+
+    /// @brief Checks that the capsule index, or the capsule archive, of the output directory has been opened
+    /// @note Nothing is saved otherwise, not to corrupt the capsules already there
+    bool is_valid() const;
+
+    /// @brief Gets the directory in which the capsules are saved
+    const std::string &get_output_directory() const;
 
     /// @brief Gets how many capsules there are on such a pattern
     int get_number_of_capsules_per_image() const;
 
+    /// @brief Gets the color index of the capsules currently saved, their IDs being the ones of the capsule index
+    const CapsuleColorIndex &get_color_index() const;
+
 private:
     size_t next_capsule_id_; ///< Next ID to be assigned
 
@@ -88,15 +170,18 @@ private:
     int n_cols_;
     int n_rows_;
     int radius_;
+    bool use_archive_; ///< Whether the capsules are appended to the archive instead of being saved as images
+    bool valid_;       ///< Whether the index writer has been opened
 
     std::vector<std::vector<cv::Point2f>> grid_; ///< 2D grid containing the position of the center of each circle
     std::vector<cv::Point2f> refcorners_;        ///< 4 corners of the rectangle
-    cv::Mat_<double> H_;                         ///< Homography
 
-    cv::Mat capsule_;      ///< Tmp image use to store a capsule
     cv::Mat capsule_mask_; ///< Mask of the same size of the capsules. Used to crop them into disks
 
     const std::string output_directory_ = "/tmp/Capsules/";
+    CapsuleIndexWriter index_writer_;                     ///< Indexes the capsules as soon as they're saved
+    CapsuleColorIndex color_index_;                       ///< Colors of the capsules currently saved
+    std::unordered_map<std::string, size_t> capsule_ids_; ///< ID of each capsule in the color index, by filename
 };
 
 #endif // CAPSULE_EXTRACTION_PATTERN_H
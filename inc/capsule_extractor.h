@@ -7,16 +7,38 @@
 #ifndef CAPSULE_EXTRACTOR_H
 #define CAPSULE_EXTRACTOR_H
 
+#include <memory>
+#include <string>
+#include <opencv2/videoio.hpp>
+
+#include "bounded_queue.h"
 #include "capsule_extraction_pattern.h"
+#include "photo_manifest.h"
+#include "thread_pool.h"
 
 /// @brief Class that processes pictures of capsules grids (warped 2D observations) and detects the contour of the grid
 /// so that the class @ref CapsuleExtractionPattern can extract and save the cutouts of the capsules.
+///
+/// Pictures go through a pipeline of 3 stages connected by bounded queues: decoding, detection and warping, and
+/// encoding and writing. The first two stages run on their own threads, each one with its own scratch buffers,
+/// while the calling thread saves the capsules in the order of the pictures. Their images are encoded in the
+/// background by a @ref CapsuleWriter, so that a picture is indexed while the capsules of the next one are written.
+///
+/// Pictures whose content is already listed in the @ref PhotoManifest of the capsules directory are skipped before
+/// being decoded. When a picture has been modified, the capsules extracted from its previous version are replaced.
+///
+/// The pictures can also be the frames of a video, or of an image sequence, showing the grids one after the other.
+/// Only the sharpest frame in which each grid stands still then goes through the pipeline.
 class CapsuleExtractor
 {
 public:
     /// @brief Constructor
     /// @param capsules_pattern Class extracting capsules from warped 2D observation of a capsules grid
-    CapsuleExtractor(const CapsuleExtractionPattern &capsules_pattern);
+    /// @param thread_pool Worker threads used to warp and encode the capsules. Its size also sets the number of
+    /// threads of the decoding and detection stages
+    /// @param png_compression zlib compression level of the images of the capsules, from 0 (fastest) to 9 (smallest)
+    CapsuleExtractor(const CapsuleExtractionPattern &capsules_pattern, ThreadPool &thread_pool,
+                     int png_compression = 1);
 
     /// @brief Extracts capsules from a directory containing pictures of capsules grids (warped 2D observations)
     /// @note The cutouts of the capsules will then be saved
@@ -24,29 +46,128 @@ public:
     /// @param display Display the rectified capsules grid with circles showing where capsules have been extracted
     void extract_capsules_from_directory(const std::string &input_dir, bool display = false);
 
+    /// @brief Extracts capsules from a video showing capsules grids one after the other, e.g. a continuous recording
+    /// of the collection
+    /// @note The grids are told apart by the frames without any grid between them. They're only identified by the
+    /// content of their frames, since their positions in the video aren't stable
+    /// @param video_path Video file, or image sequence such as frames/img_%04d.jpg, as read by cv::VideoCapture
+    /// @param display Display the rectified capsules grid with circles showing where capsules have been extracted
+    void extract_capsules_from_video(const std::string &video_path, bool display = false);
+
+    /// @brief Gets the color index of the capsules extracted so far, updated after each picture
+    const CapsuleColorIndex &get_color_index() const;
+
 private:
+    /// @brief Picture going through the pipeline
+    struct Batch
+    {
+        size_t id;                     ///< Index of the picture in the directory, or of the grid in the video
+        std::string photo_name;        ///< Name of the picture, as listed in the manifest
+        bool replaces_by_name = true;  ///< Whether it replaces the capsules of a previous picture of the same name
+        uint64_t hash;                 ///< Hash of the content of the picture, shared by all its capsules
+        bool already_loaded = false;   ///< Whether the picture is already in the manifest, and hasn't been decoded
+        cv::Mat img;                   ///< Decoded picture
+        bool success = false;          ///< Whether capsules have been extracted
+        std::vector<cv::Mat> capsules; ///< Extracted capsules
+
+        // Display
+        cv::Mat ths_img;       ///< Thresholded picture
+        cv::Mat drawing_img;   ///< Picture with the fitted contour
+        cv::Mat rectified_img; ///< Rectified grid with circles around the capsules
+    };
+
+    /// @brief Scratch buffers of a detection thread
+    struct DetectionScratch
+    {
+        cv::Mat resized_img;
+        cv::Mat src_gray;
+        cv::Mat ths_img;
+        std::vector<cv::Point2f> best_contour;
+        std::vector<cv::Point2f> hull;
+        std::vector<cv::Point2f> approx_polygon;
+        std::vector<cv::Point2f> quadrilateral_contour;
+        std::vector<cv::Point2f> refined_contour; ///< Corners of the grid in the full-resolution picture
+        std::vector<std::vector<cv::Point>> contours;
+        std::vector<cv::Vec4i> hierarchy;
+    };
+
+    /// @brief Gets the number of threads of the detection stage
+    size_t get_number_of_detectors() const;
+
+    /// @brief Gets the number of pictures that may be in flight ahead of the next one to save, which bounds the
+    /// batches waiting to be saved in order
+    size_t get_reorder_window_size() const;
+
+    /// @brief Runs the detection and the saving stages of the pipeline, the saving one on the calling thread
+    /// @param decoded_batches Queue of the decoded pictures, whose IDs start from 0. Returns once it's closed and all
+    /// its pictures are saved
+    /// @param window Window in which the producer of @p decoded_batches starts the pictures, moved as they're saved
+    /// @param display Display the intermediate images of each picture
+    void process_batches(BoundedQueue<std::unique_ptr<Batch>> &decoded_batches, SequenceWindow &window, bool display);
+
+    /// @brief Reads the frames of a video and queues, for each grid, the sharpest frame among those in which the
+    /// grid stands still.
+    ///
+    /// The grid is detected on each frame at low resolution, and it's stable if its corners barely moved since the
+    /// previous frame. The sharpness of a stable frame is the variance of the Laplacian over the grid. The best frame
+    /// is queued once the grid has disappeared for a few frames.
+    /// @param capture Opened video
+    /// @param video_name Name of the video, from which the names of the selected frames are made
+    /// @param output_batches Queue receiving the selected frames
+    /// @param window Window in which the selected frames are queued
+    void select_frames(cv::VideoCapture &capture, const std::string &video_name,
+                       BoundedQueue<std::unique_ptr<Batch>> &output_batches, SequenceWindow &window) const;
+
     /// @brief Extracts capsules from a picture of capsules grids (warped 2D observation)
-    /// @note The cutouts of the capsules will then be saved
-    /// @param capsules_batch_id All the capsules extracted on this image share the ID of the image
-    /// @param input_img Picture of the capsules grid
-    /// @param display Display the rectified capsules grid with circles showing where capsules have been extracted
+    /// @param batch Picture to process, in which the capsules are stored
+    /// @param scratch Buffers of the calling thread
+    /// @param display Keep the intermediate images in @p batch to display them
     /// @return true if it was successful
-    bool extract_capsules(const size_t capsules_batch_id, const cv::Mat &input_img, bool display);
+    bool extract_capsules(Batch &batch, DetectionScratch &scratch, bool display) const;
 
-    /// @brief Finds largest contour in the image after applying a threshold on the grayscale intensity
+    /// @brief Shows the intermediate images of a batch
+    void display_batch(const Batch &batch) const;
+
+    /// @brief Waits for the capsules of a batch to be written, then indexes them and records the picture in the
+    /// manifest
+    /// @param batch Processed picture
+    /// @param ticket Ticket of the capsules in the writer, returned by @ref CapsuleExtractionPattern::write_capsules
+    /// @return true if it was successful
+    bool commit_batch(const Batch &batch, size_t ticket);
+
+    /// @brief Finds largest contour in the image after applying Otsu's threshold on the grayscale intensity
     /// @note It aims at finding the warped contour of the rectangular capsules grid
     /// @param src_img Image on which to extract the contour
+    /// @param scratch Buffers of the calling thread
     /// @param output_contour Output vector containing the points of the contour
-    /// @param display Display the thresholded input image
-    /// @param ths Threshold used to binarize the image
-    bool get_largest_contour(const cv::Mat &src_img, std::vector<cv::Point2f> &output_contour, bool display, int ths = 90);
+    /// @param output_ths_img Thresholded input image
+    /// @param verbose Report why the contour has been rejected
+    bool get_largest_contour(const cv::Mat &src_img, DetectionScratch &scratch,
+                             std::vector<cv::Point2f> &output_contour, cv::Mat &output_ths_img,
+                             bool verbose = true) const;
 
-    /// @brief Fits a quadrilateral to a contour
+    /// @brief Fits a quadrilateral to a contour, by approximating its convex hull with a growing tolerance until
+    /// there are 4 corners left
     /// @param input_contour Contour to fit
+    /// @param scratch Buffers of the calling thread
     /// @param output_quadrilateral 4 output points representing the optimal quadrilateral passing through the contour
     /// @note They're arranged clockwise: Top-Left, Top-Right, Bottom-Right, Bottom-Left
+    /// @param verbose Report why the contour can't be fitted
     /// @return true if it was successful
-    bool fit_quadrilateral(const std::vector<cv::Point2f> &input_contour, std::vector<cv::Point2f> &output_quadrilateral);
+    bool fit_quadrilateral(const std::vector<cv::Point2f> &input_contour, DetectionScratch &scratch,
+                           std::vector<cv::Point2f> &output_quadrilateral, bool verbose = true) const;
+
+    /// @brief Refines the corners of a quadrilateral detected on a downscaled picture, on the full-resolution one.
+    ///
+    /// The edges are searched along the normals of each side, and located to subpixel accuracy on the intensity
+    /// profiles. A line is fitted to the edge points of each side, and the corners are the intersections of these
+    /// lines. If an edge can't be found, the corners are only scaled.
+    /// @param img Full-resolution picture
+    /// @param scale Scale of @p img relatively to the picture on which the quadrilateral has been detected
+    /// @param quadrilateral 4 corners, clockwise from Top-Left, as returned by @ref fit_quadrilateral
+    /// @param output_quadrilateral 4 corners in @p img, in the same order
+    void refine_quadrilateral(const cv::Mat &img, double scale, const std::vector<cv::Point2f> &quadrilateral,
+                              std::vector<cv::Point2f> &output_quadrilateral) const;
 
     template <typename T, typename O>
     inline T clamp_val(T val, const O min, const O max) const
@@ -55,19 +176,11 @@ private:
     }
 
     CapsuleExtractionPattern capsules_pattern_; ///< Class extracting and saving capsules
+    ThreadPool &thread_pool_;
+    CapsuleWriter writer_;   ///< Background writer of the images of the capsules
+    PhotoManifest manifest_; ///< Pictures already processed
 
-    // Display
-    cv::Mat resized_img_;
-    cv::Mat drawing_img_;
     const int resized_height_ = 500; ///< Resize image before processing it
-
-    // Contour
-    cv::Mat src_gray_;
-    cv::Mat ths_img_;
-    std::vector<cv::Point2f> best_contour_;
-    std::vector<cv::Point2f> quadrilateral_contour_;
-    std::vector<std::vector<cv::Point>> contours_;
-    std::vector<cv::Vec4i> hierarchy_;
     int n_capsules_per_image_;
 };
 
@@ -0,0 +1,181 @@
+/*********************************************************************************************************************
+ * File : capsule_index.h                                                                                            *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef CAPSULE_INDEX_H
+#define CAPSULE_INDEX_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <opencv2/core/mat.hpp>
+
+#include "capsule_descriptor.h"
+#include "thread_pool.h"
+
+/// @brief Header at the beginning of the capsule index file, or of the capsule archive
+struct CapsuleIndexHeader
+{
+    char magic[8];           ///< "CAPSIDX", or "CAPSPAK" for an archive
+    uint32_t version;        ///< Version of the file format
+    uint32_t thumbnail_size; ///< Side in pixels of the square BGR thumbnails. 0 if the index has no thumbnails
+    uint32_t record_size;    ///< Size in bytes of a record, thumbnail included
+    uint32_t reserved;
+};
+
+/// @brief Fixed-size part of a record of the capsule index. It's directly followed by the thumbnail pixels, if any
+///
+/// In a capsule archive, the "thumbnail" is the capsule image itself at full resolution, and a record whose filename
+/// is empty has been removed
+struct CapsuleIndexRecord
+{
+    int64_t mtime;                ///< Last modification time of the capsule image when it was indexed. 0 in an archive
+    uint32_t id;                  ///< ID of the capsule, kept as long as the image stays in the directory
+    CapsuleDescriptor descriptor; ///< Colors of the capsule image
+    char filename[64];            ///< Name of the capsule image, relative to the capsules directory
+};
+
+class CapsuleIndex;
+
+/// @brief Appends capsules to the index of a capsules directory, as soon as they're saved.
+///
+/// Records are appended at the end of the file, the number of records being deduced from its size.
+///
+/// In archive mode, the capsules aren't saved as images at all: their records, packing the descriptor and the raw
+/// pixels, are appended to the capsule archive of the directory, which replaces both the images and the index.
+class CapsuleIndexWriter
+{
+public:
+    /// @brief Constructor
+    /// @param capsules_dir Directory in which the capsules images are saved
+    /// @param thumbnail_size Side in pixels of the thumbnails to store in the index. 0 to disable them. In archive
+    /// mode, side in pixels of the capsules
+    /// @param archive Write the capsule archive instead of the index
+    CapsuleIndexWriter(const std::string &capsules_dir, int thumbnail_size, bool archive = false);
+
+    /// @brief Creates an empty index, replacing the previous one if any
+    /// @return true if it was successful
+    bool reset();
+
+    /// @brief Brings the existing index up to date with the capsules directory and appends the next records to it,
+    /// with IDs following the existing ones. Creates an empty index if there's none
+    /// @note An existing archive is never replaced: it's the only copy of its capsules. It's compacted once its
+    /// removed records are as many as the others
+    /// @param output_index Optional output index, loaded from the capsules directory
+    /// @return false if the existing archive can't be loaded, or if the directory holds capsules of another storage
+    /// or size
+    bool open(CapsuleIndex *output_index = nullptr);
+
+    /// @brief Appends the records of capsules that have just been saved in the capsules directory
+    /// @note The records are computed in parallel, and then appended at once
+    /// @param filenames Names of the capsules images, relative to the capsules directory
+    /// @param capsules Images of the capsules, as they have been saved
+    /// @param thread_pool Worker threads used to compute the records
+    /// @param output_records Optional output copies of the appended records, thumbnails excluded
+    /// @return true if it was successful
+    bool append(const std::vector<std::string> &filenames,
+                const std::vector<cv::Mat> &capsules,
+                ThreadPool &thread_pool,
+                std::vector<CapsuleIndexRecord> *output_records = nullptr);
+
+    /// @brief Removes capsules from the archive, by clearing the filenames of their records in place, and syncs it
+    /// @note Only useful in archive mode, the records of the index being dropped when the images are deleted
+    /// @param filenames Names of the capsules
+    /// @return true if it was successful
+    bool remove(const std::vector<std::string> &filenames);
+
+private:
+    /// @brief Rewrites the archive without its removed records
+    /// @return true if it was successful
+    bool compact();
+
+    std::string capsules_dir_;
+    std::string index_path_;
+    int thumbnail_size_;
+    bool archive_;
+    uint32_t next_id_; ///< Next ID to be assigned
+};
+
+/// @brief Memory-mapped index of a capsules directory, giving access to the precomputed descriptors and thumbnails
+/// of the capsules without decoding their images.
+///
+/// If the directory contains a capsule archive, it's mapped instead of the index and the images: descriptors and
+/// full-resolution pixels are then read in place, and nothing is ever decoded.
+///
+/// @note Records are in the order they were appended by the @ref CapsuleIndexWriter, or sorted by filename, i.e. in
+/// the same order as cv::glob, once the index has been rebuilt
+class CapsuleIndex
+{
+public:
+    /// @brief Constructor
+    /// @param capsules_dir Directory containing the capsules images
+    /// @param thumbnail_size Side in pixels of the thumbnails stored in the index. 0 to disable them
+    CapsuleIndex(const std::string &capsules_dir, int thumbnail_size = default_thumbnail_size);
+
+    /// @brief Memory-maps the index and brings it up to date with the capsules directory
+    /// @note Only the images that are new or whose modification time changed are decoded. If nothing changed, the
+    /// records are read in place from the mapped file
+    /// @return true if it was successful
+    bool load();
+
+    /// @brief Gets the number of indexed capsules
+    size_t size() const;
+
+    /// @brief Gets the record of the i-th capsule
+    const CapsuleIndexRecord &get_record(size_t i) const;
+
+    /// @brief Gets the path of the image of the i-th capsule
+    std::string get_path(size_t i) const;
+
+    /// @brief Gets the thumbnail of the i-th capsule, pointing directly to the mapped file (read-only)
+    /// @return Empty image if the index has no thumbnails
+    cv::Mat get_thumbnail(size_t i) const;
+
+    /// @brief Gets the side in pixels of the thumbnails, or of the capsules in an archive
+    int get_thumbnail_size() const;
+
+    /// @brief Gets the full-resolution image of the i-th capsule, pointing to the mapped archive (read-only) or decoded
+    /// from its file
+    /// @return Empty image if it can't be read
+    cv::Mat get_image(size_t i) const;
+
+    /// @brief Checks if the capsules are read from an archive
+    bool is_archive() const;
+
+    static const std::string index_filename;   ///< Name of the index file inside the capsules directory
+    static const std::string archive_filename; ///< Name of the capsule archive inside the capsules directory
+    static const int default_thumbnail_size = 64;
+
+private:
+    /// @brief Maps the capsule archive and lists its records that haven't been removed
+    /// @return true if it was successful
+    bool load_archive();
+
+    /// @brief Gets the i-th record, followed by its thumbnail
+    const uint8_t *get_record_data(size_t i) const;
+
+    /// @brief Maps the index file if it exists and matches the expected format
+    /// @return true if it was successful
+    bool map_index_file();
+
+    /// @brief Unmaps the index file
+    void unmap_index_file();
+
+    std::string capsules_dir_;
+    std::string index_path_;
+    int thumbnail_size_;
+    size_t record_size_;
+
+    boost::interprocess::file_mapping file_mapping_;
+    boost::interprocess::mapped_region mapped_region_;
+    const uint8_t *records_; ///< First record in the mapped file
+    size_t n_records_;
+    bool archive_;                       ///< Whether the mapped file is the capsule archive
+    std::vector<uint32_t> live_records_; ///< Positions of the records that haven't been removed, in an archive
+};
+
+#endif // CAPSULE_INDEX_H
@@ -0,0 +1,85 @@
+/*********************************************************************************************************************
+ * File : capsule_writer.h                                                                                           *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef CAPSULE_WRITER_H
+#define CAPSULE_WRITER_H
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <opencv2/core/mat.hpp>
+
+#include "thread_pool.h"
+
+/// @brief Encodes and writes images in the background, so that the thread producing them doesn't wait for the disk.
+///
+/// Images are queued by batches, each batch getting a ticket. Their encodings run on the thread pool, with a bounded
+/// number of images in flight to bound the memory, and each file is synced to disk once written. Waiting for a
+/// ticket is a barrier: the images of the batch, and of all the previous ones, are then on disk.
+class CapsuleWriter
+{
+public:
+    /// @brief Constructor
+    /// @param thread_pool Worker threads used to encode the images
+    /// @param max_pending_images Number of images queued or being written beyond which @ref write blocks
+    /// @param png_compression zlib compression level of the PNG images, from 0 (none, fastest) to 9 (smallest). The
+    /// images stay lossless whatever the level
+    CapsuleWriter(ThreadPool &thread_pool, size_t max_pending_images, int png_compression = 1);
+
+    /// @brief Waits for all the images to be written
+    ~CapsuleWriter();
+
+    CapsuleWriter(const CapsuleWriter &) = delete;
+    CapsuleWriter &operator=(const CapsuleWriter &) = delete;
+
+    /// @brief Queues a batch of images, waiting for previous ones to be written if too many are in flight
+    /// @note Must not be called from a worker of the thread pool, which could end up waiting for itself
+    /// @param paths Path of each image
+    /// @param images Images to write. They're shared, not copied, and mustn't be modified until written
+    /// @return Ticket of the batch, to wait for it with @ref flush
+    size_t write(const std::vector<std::string> &paths, const std::vector<cv::Mat> &images);
+
+    /// @brief Waits until the images of a batch and of all the previous ones are written, and syncs their
+    /// directories to disk
+    /// @param ticket Ticket returned by @ref write
+    /// @return false if any of these images couldn't be written
+    bool flush(size_t ticket);
+
+    /// @brief Waits until all the queued images are written, and syncs their directories to disk
+    /// @return false if any of them couldn't be written
+    bool flush();
+
+    /// @brief Flushes a file, or the entries of a directory, to disk
+    /// @return true if it was successful
+    static bool sync_to_disk(const std::string &path, bool directory = false);
+
+private:
+    /// @brief Images of a batch still being written
+    struct PendingBatch
+    {
+        size_t n_pending_images = 0;
+        bool failed = false;
+        std::vector<std::string> directories; ///< Directories to sync once the batch is written
+    };
+
+    /// @brief Encodes and writes an image, and syncs it to disk
+    /// @return true if it was successful
+    bool write_image(const std::string &path, const cv::Mat &image) const;
+
+    ThreadPool &thread_pool_;
+    size_t max_pending_images_;
+    std::vector<int> png_params_; ///< Parameters of cv::imwrite
+
+    std::mutex mutex_;
+    std::condition_variable image_written_;
+    size_t n_pending_images_;                        ///< Images queued or being written, all batches included
+    size_t next_ticket_;                             ///< Ticket of the next batch
+    std::map<size_t, PendingBatch> pending_batches_; ///< Batches that haven't been flushed yet, by ticket
+};
+
+#endif // CAPSULE_WRITER_H
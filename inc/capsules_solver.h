@@ -9,19 +9,47 @@
 
 #include <iostream>
 #include <map>
+#include <string>
 #include <vector>
 #include <opencv2/core/mat.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include "assignment_solver.h"
+#include "capsule_descriptor.h"
+#include "capsule_index.h"
 #include "circle_grid_pattern.h"
-#include "gale_shapley/gale_shapley_algorithm.h"
+#include "cost_matrix.h"
+#include "thread_pool.h"
+
+/// @brief Settings of the capsules solver
+struct CapsulesSolverOptions
+{
+    CostMatrix::Storage cost_storage = CostMatrix::FLOAT32;                      ///< Storage of the errors matrix
+    bool squared_errors = false;                                                 ///< Match on squared color distances, which skips the square roots
+    AssignmentSolver::Method assignment_method = AssignmentSolver::GALE_SHAPLEY; ///< Algorithm matching capsules and cells
+    size_t n_candidates = 0;                                                     ///< Cells ranked at once by each capsule in Gale-Shapley. 0 for all
+    size_t n_nearest_capsules = 0;                                               ///< Only keep the capsules among the K closest in color to a cell. 0 to keep all
+    CapsuleDescriptor::Metric metric = CapsuleDescriptor::MEAN_BGR;              ///< Distance between the descriptors of capsules and cells
+    size_t memory_budget_mb = 0;                                                 ///< Memory for the errors matrix and the matching, in MB. 0 for no limit
+    std::string scratch_directory = "/tmp";                                      ///< Where the errors matrix is mapped when it exceeds the budget
+    size_t region_cells = 0;                                                     ///< Cells per region when solving region by region. 0 to solve the whole grid at once
+    float region_slack = 0.5f;                                                   ///< Spare capsules given to each region, relatively to its number of cells
+    bool compare_flat = false;                                                   ///< Also solve the whole grid at once, to report the gap of the regions
+    double refine_seconds = 0;                                                   ///< Time budget of the local search refining the matching. 0 to skip it
+    size_t refine_neighbours = 16;                                               ///< Capsules closest in color to a cell considered by the local search
+    float dithering = 0.f;                                                       ///< Weight of the blurred mosaic in the objective of the local search, in [0, 1]. 0 to score the cells independently
+    int render_width = 0;                                                        ///< Width in pixels of an additional rendering of the mosaic, e.g. for print. 0 to skip it
+};
 
 class CapsulesSolver
 {
 public:
-    CapsulesSolver();
+    /// @brief Constructor
+    /// @param thread_pool Worker threads used to extract the cutouts and compute the errors matrix
+    /// @param options Settings of the solver
+    CapsulesSolver(ThreadPool &thread_pool, const CapsulesSolverOptions &options = CapsulesSolverOptions());
 
     /// @brief Makes a composition out of reference capsules to mimic the input image @p img
     /// @param img Input image
@@ -29,6 +57,30 @@ public:
     /// @param n_rows Number of capsules rows of the final composition
     bool solve(const cv::Mat &img, const std::string &capsules_dir, int n_rows);
 
+    /// @brief Matches the capsules to the cells of a grid, at once or region by region depending on the options
+    /// @param capsule_index Index containing the precomputed descriptors of the reference capsules
+    /// @param capsule_ids Indices of the capsules to match, in @p capsule_index
+    /// @param cutouts_descriptors Descriptors of the cells, stored row after row
+    /// @param grid_rows Number of rows of the grid
+    /// @param grid_cols Number of columns of the grid
+    /// @param output_matches Coefficient [j] corresponds to the position in @p capsule_ids of the capsule put on the
+    /// cell j
+    /// @return true if it was successful
+    bool match(const CapsuleIndex &capsule_index,
+               const std::vector<size_t> &capsule_ids,
+               const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+               size_t grid_rows, size_t grid_cols,
+               std::vector<size_t> &output_matches);
+
+    /// @brief Computes the error of each cell with the capsule put on it
+    /// @param matches Coefficient [j] corresponds to the position in @p capsule_ids of the capsule put on the cell j
+    /// @param output_errors Error of each cell
+    void compute_matching_errors(const CapsuleIndex &capsule_index,
+                                 const std::vector<size_t> &capsule_ids,
+                                 const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                                 const std::vector<size_t> &matches,
+                                 std::vector<float> &output_errors) const;
+
 private:
     /// @brief Calls the class CircleGridPattern to extract circle cutouts from the image
     /// and displays them
@@ -39,21 +91,120 @@ private:
     bool extract_and_display_cutouts(const CircleGridPattern &circle_grid, const cv::Mat &img,
                                      std::vector<cv::Mat> &output_cutouts);
 
-    /// @brief Loads reference capsules and compare them to the cutouts of the input image
-    /// @param ref_capsules_paths Paths to the reference capsules
-    /// @param cutouts Cutouts of the original image
+    /// @brief Selects the reference capsules worth comparing to the cutouts, i.e. those that are among the
+    /// @ref CapsulesSolverOptions::n_nearest_capsules closest to at least one cutout with the metric of the options
+    /// @note The number of neighbours is doubled until there are enough capsules to cover all the cutouts
+    /// @param capsule_index Index containing the precomputed descriptors of the reference capsules
+    /// @param cutouts_descriptors Descriptors of the cutouts of the original image
+    /// @param output_capsule_ids Sorted indices of the selected capsules in @p capsule_index
+    void select_capsules(const CapsuleIndex &capsule_index,
+                         const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                         std::vector<size_t> &output_capsule_ids);
+
+    /// @brief Finds the capsules closest to each cell with the metric of the options
+    /// @note The BGR metric is answered by a @ref CapsuleColorIndex, the others by scanning all the capsules
+    /// @param capsule_ids Indices of the capsules to search, in @p capsule_index
+    /// @param k Number of capsules to find for each cell
+    /// @param output_nearest Coefficient [j] holds the positions in @p capsule_ids of the min(k, capsule_ids.size())
+    /// capsules closest to the cell j, sorted by increasing distance and then by position
+    void find_nearest_capsules(const CapsuleIndex &capsule_index,
+                               const std::vector<size_t> &capsule_ids,
+                               const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                               size_t k,
+                               std::vector<std::vector<size_t>> &output_nearest);
+
+    /// @brief Matches the capsules to the cells by solving a single assignment problem over the whole grid
+    /// @param capsule_index Index containing the precomputed descriptors of the reference capsules
+    /// @param capsule_ids Indices of the capsules to match, in @p capsule_index
+    /// @param cutouts_descriptors Descriptors of the cutouts of the original image
+    /// @param output_matches Coefficient [j] corresponds to the position in @p capsule_ids of the capsule put on the
+    /// cell j
+    /// @return true if it was successful
+    bool solve_at_once(const CapsuleIndex &capsule_index,
+                       const std::vector<size_t> &capsule_ids,
+                       const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                       std::vector<size_t> &output_matches);
+
+    /// @brief Matches the capsules to the cells region by region, which bounds the size of the assignment problems.
+    ///
+    /// The capsules are first grouped into color clusters, and the cells are distributed among the clusters within
+    /// their capacity. Each region then receives, from each cluster, as many capsules as it has cells assigned to it
+    /// plus some spare ones. The regions are solved independently, in parallel, and finally the bands of cells along
+    /// the borders between neighbouring regions are solved again with the spare capsules of both sides.
+    /// @param grid_rows Number of rows of the grid, the cells being stored row after row
+    /// @param grid_cols Number of columns of the grid
+    /// @return true if it was successful
+    bool solve_by_regions(const CapsuleIndex &capsule_index,
+                          const std::vector<size_t> &capsule_ids,
+                          const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                          size_t grid_rows, size_t grid_cols,
+                          std::vector<size_t> &output_matches);
+
+    /// @brief Solves the assignment problem between a subset of capsules and a subset of cells
+    /// @param capsule_positions Positions of the capsules in @p capsule_ids
+    /// @param cells Indices of the cells
+    /// @param verbose Print the progress of the solver, which is better avoided when subproblems are solved
+    /// concurrently
+    /// @param output_errors Errors matrix between the capsules and the cells
+    /// @param output_matches Coefficient [k] corresponds to the index in @p capsule_positions of the capsule put on
+    /// the cell cells[k]
+    /// @return true if it was successful
+    bool solve_subproblem(const CapsuleIndex &capsule_index,
+                          const std::vector<size_t> &capsule_ids,
+                          const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                          const std::vector<size_t> &capsule_positions,
+                          const std::vector<size_t> &cells,
+                          bool verbose,
+                          CostMatrix &output_errors,
+                          std::vector<size_t> &output_matches);
+
+    /// @brief Lowers the total error of a matching by local search, until no move improves it or the time budget of
+    /// the options is spent.
+    ///
+    /// Each pass looks, in parallel, for the best move of each cell among the capsules closest to it with the metric
+    /// of the options: either replacing its capsule by an unused one, or swapping capsules with the cell using the
+    /// other one. The moves are then applied from the best to the worst, each one being checked again against the
+    /// moves already applied. The time budget is also checked while looking for the moves, so that a pass over a
+    /// large grid stops early.
+    ///
+    /// With dithering, the moves are scored by an @ref ErrorDiffusionObjective over the hexagonal lattice instead of
+    /// the errors of the cells alone.
+    /// @param cell_neighbours Neighbours of each cell in the grid, only used with dithering
+    /// @param matches Coefficient [j] corresponds to the position in @p capsule_ids of the capsule put on the cell j.
+    /// Updated in place
+    void refine_matching(const CapsuleIndex &capsule_index,
+                         const std::vector<size_t> &capsule_ids,
+                         const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                         const std::vector<std::vector<size_t>> &cell_neighbours,
+                         std::vector<size_t> &matches);
+
+    /// @brief Gets the vector of a descriptor in which the metric of the options is the Euclidean distance
+    /// @param output_feature Array of @ref get_feature_size() values
+    void get_feature(const CapsuleDescriptor &descriptor, float *output_feature) const;
+
+    /// @brief Gets the number of values of the vectors returned by @ref get_feature
+    int get_feature_size() const;
+
+    /// @brief Compares the reference capsules to the cutouts of the input image, using the metric of the options,
+    /// in parallel
+    /// @note If the matrix exceeds half of the memory budget, it's mapped to a scratch file and filled by tiles of
+    /// rows, each tile being released once written
+    /// @param capsule_index Index containing the precomputed descriptors of the reference capsules
+    /// @param capsule_ids Indices of the capsules to compare, in @p capsule_index
+    /// @param cutouts_descriptors Descriptors of the cutouts of the original image
     /// @param output_errors Error matrix representing the difference scores between reference capsules and cutouts
-    /// of the input image. Coefficient [i][j]: score between a reference capsule i and a location j in the image.
-    /// The lower the score the better
+    /// of the input image. Coefficient (i, j): score between the reference capsule capsule_ids[i] and a location j
+    /// in the image. The lower the score the better
+    /// @param verbose Print how the matrix is stored
     /// @return true if it was successful
-    bool compute_errors_matrix(const std::vector<cv::String> &ref_capsules_paths,
-                               const std::vector<cv::Mat> &cutouts,
-                               std::vector<std::vector<double>> &output_errors);
-
-    /// @brief Multithreaded version of the method @ref compute_errors_matrix
-    bool compute_errors_matrix_multithreaded(const std::vector<cv::String> &ref_capsules_paths,
-                                             const std::vector<cv::Mat> &cutouts,
-                                             std::vector<std::vector<double>> &output_errors);
+    bool compute_errors_matrix_multithreaded(const CapsuleIndex &capsule_index,
+                                             const std::vector<size_t> &capsule_ids,
+                                             const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                                             CostMatrix &output_errors,
+                                             bool verbose);
+
+    ThreadPool &thread_pool_;
+    CapsulesSolverOptions options_;
 };
 
 #endif // CAPSULES_SOLVER_H
\ No newline at end of file
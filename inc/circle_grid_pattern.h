@@ -7,9 +7,14 @@
 #ifndef CIRCLE_GRID_PATTERN_H
 #define CIRCLE_GRID_PATTERN_H
 
+#include <functional>
+#include <utility>
 #include <vector>
 #include <opencv2/core/mat.hpp>
 
+#include "capsule_descriptor.h"
+#include "thread_pool.h"
+
 /// @brief Class composing small images into a bigger one according to a grid composed of rows of circles one above
 /// the other.
 ///
@@ -27,7 +32,8 @@ public:
     /// @param width Width in pixels of the image on which to build the grid
     /// @param height Height in pixels of the image on which to build the grid
     /// @param n_rows Grid's number of rows
-    CircleGridPattern(int width, int height, int n_rows);
+    /// @param thread_pool Worker threads used to extract the cutouts
+    CircleGridPattern(int width, int height, int n_rows, ThreadPool &thread_pool);
 
     /// @brief Extracts cutouts from an image using the grid
     /// @param image Input image from which we want to extract cutouts
@@ -36,9 +42,23 @@ public:
     /// sub-image is the one at the top-left position
     bool extract_cutouts(const cv::Mat &image, std::vector<cv::Mat> &output_cutouts) const;
 
+    /// @brief Describes the disks of the grid directly in an image, without extracting any cutout
+    ///
+    /// The rows of the grid are processed in parallel. The band of pixels covered by a row is converted to Lab at
+    /// once, and the disks are then read in place through the span table of the circle.
+    /// @param image Input image, the same as for @ref extract_cutouts
+    /// @param output_descriptors Descriptor of each circle, in the flattened grid
+    /// @note The disks are aligned on whole pixels, while the cutouts are interpolated at the exact centers
+    /// @return true if it was successful
+    bool describe_cells(const cv::Mat &image, std::vector<CapsuleDescriptor> &output_descriptors) const;
+
     /// @brief Resizes and applies a circular ROI on subimages from @p sub_images , fills the grid with them and draws
     /// it on @p output_image
     ///
+    /// Sub-images that already have the size of a cutout, e.g. sprites from a @ref SpriteAtlas, are drawn without
+    /// being resized. The rows of the grid are drawn in parallel, the even ones and then the odd ones so that the
+    /// disks drawn at the same time never overlap, each disk being copied through the spans of its rows.
+    ///
     /// @param sub_images Input vector containing as many images as the size of the grid
     /// @note The vector of images must be flattened and contains the rows one after the other. The first
     /// sub-image is the one at the top-left position
@@ -46,6 +66,35 @@ public:
     /// @return true if there aren't the right number of sub-images
     bool generate_image(const std::vector<cv::Mat> &sub_images, cv::Mat &output_image) const;
 
+    /// @brief Gives the sub-image of a circle, of any size, or an empty image if it's unavailable
+    typedef std::function<cv::Mat(size_t cell)> SubImageSource;
+
+    /// @brief Receives the bands of rows of a rendered image, from top to bottom
+    /// @return false to stop the rendering
+    typedef std::function<bool(const cv::Mat &band)> BandSink;
+
+    /// @brief Renders the grid filled with sub-images band of rows by band of rows, without ever holding the whole
+    /// image in memory, e.g. to write a print-size mosaic to a @ref PngBandWriter
+    ///
+    /// A few bands are rendered in parallel, each one resizing the sub-images of the circles it crosses, and are
+    /// given to @p write_band in order on the calling thread.
+    /// @param get_sub_image Source of the sub-images, called concurrently
+    /// @param band_height Number of rows of a band. 0 for the diameter of two circles, so that each circle is only
+    /// resized for two bands at most
+    /// @param write_band Sink of the bands
+    /// @return true if it was successful
+    bool render_bands(const SubImageSource &get_sub_image, int band_height, const BandSink &write_band) const;
+
+    /// @brief Gets the width in pixels of the rendered images
+    int get_image_width() const;
+
+    /// @brief Gets the height in pixels of the rendered images
+    int get_image_height() const;
+
+    /// @brief Finds the neighbours of each circle in the hexagonal lattice, i.e. the circles it touches
+    /// @param output_neighbours Indices of the up to 6 neighbours of each circle, in the flattened grid
+    void get_neighbours(std::vector<std::vector<size_t>> &output_neighbours) const;
+
     /// @brief Gets the number of rows in the grid
     size_t get_rows();
 
@@ -56,10 +105,29 @@ public:
     cv::Size get_cutout_size();
 
 private:
+    /// @brief Checks that an image is large enough for the grid, and has the right type
+    bool check_image(const cv::Mat &image) const;
+
+    /// @brief Renders a band of rows of the grid filled with sub-images
+    /// @param get_sub_image Source of the sub-images
+    /// @param y_begin First row of the band
+    /// @param y_end Row past the last one
+    /// @return Band of rows, or an empty image if a sub-image is unavailable
+    cv::Mat render_band(const SubImageSource &get_sub_image, int y_begin, int y_end) const;
+
+    /// @brief Copies the disk inscribed in a sub-image of the size of a cutout onto a circle of the grid
+    /// @param sub_image Square BGR image of the size of a cutout
+    /// @param cell Index of the circle, in the flattened grid
+    /// @param band_top Row of the image of the grid at which @p output_band starts
+    /// @param output_band Band of rows of the image of the grid, the disk being clipped to it
+    void draw_disk(const cv::Mat &sub_image, size_t cell, int band_top, cv::Mat &output_band) const;
+
+    ThreadPool &thread_pool_;
+
     std::vector<cv::Point2f> grid_; ///< 2D grid containing the position of the center of each circle
 
-    cv::Mat cutout_;        ///< Tmp image use to store a cutout
-    cv::Mat circular_mask_; ///< Mask of the same size of the cutouts. Used to crop them into disks
+    cv::Mat circular_mask_;                       ///< Mask of the same size of the cutouts. Used to crop them into disks
+    std::vector<std::pair<int, int>> disk_spans_; ///< Columns [begin, end) covered by the disk in each row of the mask
 
     int n_cols_;      ///< Number of columns in the grid
     int n_rows_;      ///< Number of rows in the grid
@@ -0,0 +1,121 @@
+/*********************************************************************************************************************
+ * File : cost_matrix.h                                                                                              *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef COST_MATRIX_H
+#define COST_MATRIX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <boost/interprocess/mapped_region.hpp>
+
+/// @brief Dense row-major matrix of matching costs, backed by a single aligned allocation, or by a scratch file mapped
+/// in memory when it doesn't fit in RAM.
+///
+/// Coefficient (i, j) is the cost of assigning the man i to the woman j, i.e. the reference capsule i to the location j
+/// in the image. The lower the cost the better.
+///
+/// Costs are stored either as float32, or quantized on 16 bits over [0, max_cost] to halve the memory footprint. Each
+/// row starts on a 64-byte boundary.
+///
+/// A mapped matrix is read and written like an allocated one, the system paging its rows in and out of the scratch
+/// file. Its readers release the rows they're done with, so that the resident memory doesn't grow with the matrix.
+///
+/// @note The matrix can't be copied, it's meant to be passed by reference through the pipeline
+class CostMatrix
+{
+public:
+    enum Storage
+    {
+        FLOAT32,
+        UINT16
+    };
+
+    /// @brief Creates an empty matrix
+    CostMatrix();
+
+    /// @brief Allocates the matrix, without initializing the costs
+    /// @param n_rows Number of rows, i.e. of men
+    /// @param n_cols Number of columns, i.e. of women
+    /// @param storage Type used to store the costs
+    /// @param max_cost Upper bound of the costs, used to quantize them. Larger costs are saturated
+    CostMatrix(size_t n_rows, size_t n_cols, Storage storage = FLOAT32, float max_cost = 1.f);
+
+    CostMatrix(CostMatrix &&) = default;
+    CostMatrix &operator=(CostMatrix &&) = default;
+    CostMatrix(const CostMatrix &) = delete;
+    CostMatrix &operator=(const CostMatrix &) = delete;
+
+    /// @brief (Re)allocates the matrix, without initializing the costs
+    void create(size_t n_rows, size_t n_cols, Storage storage = FLOAT32, float max_cost = 1.f);
+
+    /// @brief (Re)creates the matrix in a scratch file mapped in memory, without initializing the costs
+    /// @note The file is removed right away, its pages are freed once the matrix is destroyed
+    /// @param scratch_directory Directory in which the file is created, e.g. on a disk with enough space
+    /// @return false if the file couldn't be created or mapped
+    bool create_mapped(size_t n_rows, size_t n_cols, const std::string &scratch_directory,
+                       Storage storage = FLOAT32, float max_cost = 1.f);
+
+    /// @brief Gets the size in bytes that a matrix would take, padding included
+    static size_t get_size_in_bytes(size_t n_rows, size_t n_cols, Storage storage);
+
+    size_t rows() const;
+    size_t cols() const;
+    Storage get_storage() const;
+    bool empty() const;
+    bool is_mapped() const;
+
+    /// @brief Gets the size in bytes of the allocation
+    size_t get_size_in_bytes() const;
+
+    /// @brief Gets the cost between the man @p i and the woman @p j
+    inline float operator()(size_t i, size_t j) const
+    {
+        if (storage_ == FLOAT32)
+            return reinterpret_cast<const float *>(data_ + i * row_step_)[j];
+        return dequantization_scale_ * reinterpret_cast<const uint16_t *>(data_ + i * row_step_)[j];
+    }
+
+    /// @brief Gets a pointer to a row of costs
+    /// @note Only valid for FLOAT32 storage
+    float *get_float_row(size_t i);
+    const float *get_float_row(size_t i) const;
+
+    /// @brief Writes a row of costs, quantizing them if needed
+    /// @param i Index of the row
+    /// @param costs Array of @ref cols() costs
+    void set_row(size_t i, const float *costs);
+
+    /// @brief Reads a row of costs
+    /// @param i Index of the row
+    /// @param output_costs Array of @ref cols() costs
+    void get_row(size_t i, float *output_costs) const;
+
+    /// @brief Lets the system drop the rows [begin, end) from memory, if the matrix is mapped. They're read back from
+    /// the scratch file when accessed again
+    /// @note The memory pages shared with the neighbouring rows are released as well
+    void release_rows(size_t begin, size_t end) const;
+
+private:
+    struct FreeDeleter
+    {
+        void operator()(uint8_t *ptr) const { std::free(ptr); }
+    };
+
+    std::unique_ptr<uint8_t, FreeDeleter> allocation_;
+    boost::interprocess::mapped_region mapped_region_;
+    uint8_t *data_; ///< Either the allocation or the mapped region
+    size_t n_rows_;
+    size_t n_cols_;
+    size_t row_step_; ///< Size in bytes of a row, padding included
+    Storage storage_;
+    float quantization_scale_;   ///< Quantized cost per unit of cost
+    float dequantization_scale_; ///< Cost per quantized unit
+};
+
+#endif // COST_MATRIX_H
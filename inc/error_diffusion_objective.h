@@ -0,0 +1,75 @@
+/*********************************************************************************************************************
+ * File : error_diffusion_objective.h                                                                                *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef ERROR_DIFFUSION_OBJECTIVE_H
+#define ERROR_DIFFUSION_OBJECTIVE_H
+
+#include <cstddef>
+#include <vector>
+
+/// @brief Perceptual objective of a mosaic, letting the color errors of neighbouring cells compensate each other, in
+/// the spirit of error diffusion over the hexagonal lattice of the grid.
+///
+/// The residual of a cell is the difference between the feature of its capsule and its own one. The objective mixes
+/// the squared residuals of the cells with the squared residuals of the blurred mosaic against the blurred target,
+/// i.e. the mean residuals over the hexagons made of each cell and its 6 neighbours:
+///
+///     (1 - strength) * sum_j |r_j|^2 + strength * sum_j |(r_j + sum_{k in N(j)} r_k) / 7|^2
+///
+/// A flat area can then be rendered by alternating capsules a bit too dark and a bit too bright, instead of capsules
+/// all slightly off in the same direction.
+///
+/// Changing the capsule of a cell only changes the blurred residuals of its hexagon, so the change of the objective is
+/// evaluated in constant time.
+class ErrorDiffusionObjective
+{
+public:
+    static const size_t no_cell = static_cast<size_t>(-1);
+    static const int max_dims = 32; ///< Largest number of values of a residual
+
+    /// @brief Constructor
+    /// @param neighbours Indices of the neighbours of each cell
+    /// @param n_dims Number of values of a residual, up to @ref max_dims
+    /// @param strength Weight of the blurred residuals, in [0, 1]. 0 to score the cells independently
+    ErrorDiffusionObjective(const std::vector<std::vector<size_t>> &neighbours, int n_dims, float strength);
+
+    /// @brief Sets the residuals of all the cells
+    /// @param residuals Residuals of the cells, one after the other
+    void reset(const std::vector<float> &residuals);
+
+    /// @brief Gets the value of the objective
+    double get_value() const;
+
+    /// @brief Gets the change of the objective if the residuals of one or two cells change
+    /// @param cell_a First cell
+    /// @param change_a Change of the residual of @p cell_a
+    /// @param cell_b Second cell, or @ref no_cell
+    /// @param change_b Change of the residual of @p cell_b, ignored if there's no second cell
+    float get_delta(size_t cell_a, const float *change_a, size_t cell_b, const float *change_b) const;
+
+    /// @brief Changes the residuals of one or two cells
+    /// @note Same parameters as @ref get_delta
+    void apply(size_t cell_a, const float *change_a, size_t cell_b, const float *change_b);
+
+private:
+    /// @brief Gets the weight of the residual of @p source in the blurred residual of @p cell
+    float get_blur_weight(size_t cell, size_t source) const;
+
+    /// @brief Lists the cells whose blurred residual depends on the residual of @p cell_a or @p cell_b
+    /// @param output_cells Array of at least @ref max_affected_cells cells
+    /// @return Number of cells
+    int get_affected_cells(size_t cell_a, size_t cell_b, size_t *output_cells) const;
+
+    static const int max_affected_cells = 14; ///< Two hexagons
+
+    const std::vector<std::vector<size_t>> &neighbours_;
+    int n_dims_;
+    float strength_;
+    std::vector<float> residuals_; ///< Residual of each cell
+    std::vector<float> blurred_;   ///< Mean residual over the hexagon of each cell
+};
+
+#endif // ERROR_DIFFUSION_OBJECTIVE_H
@@ -0,0 +1,29 @@
+/*********************************************************************************************************************
+ * File : capacitated_matching.h                                                                                     *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef CAPACITATED_MATCHING_H
+#define CAPACITATED_MATCHING_H
+
+#include <vector>
+
+#include "cost_matrix.h"
+
+/// @brief Many-to-one variant of the Gale-Shapley algorithm, i.e. the college admissions problem. Proposers rank the
+/// targets by increasing score and propose to them in that order, while each target holds the best proposers up to its
+/// capacity.
+///
+/// Both sides rank by increasing score, and then by increasing index, as in @ref GaleShapleyAlgorithm.
+///
+/// @note It's meant for small numbers of targets, each proposer sorting all of them upfront
+/// @param scores Coefficient (i, j) corresponds to the score between the proposer i and the target j. The lower the
+/// score the better
+/// @param capacities Maximum number of proposers held by each target
+/// @param output_targets Coefficient [i] corresponds to the index of the target holding the proposer i
+/// @return false if the targets can't hold all the proposers
+bool solve_capacitated_matching(const CostMatrix &scores, const std::vector<size_t> &capacities,
+                                std::vector<size_t> &output_targets);
+
+#endif // CAPACITATED_MATCHING_H
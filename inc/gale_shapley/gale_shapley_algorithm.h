@@ -7,36 +7,140 @@
 #ifndef GALE_SHAPLEY_ALGORITHM_H
 #define GALE_SHAPLEY_ALGORITHM_H
 
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <vector>
 
-#include "gale_shapley/gale_shapley_man.h"
-#include "gale_shapley/gale_shapley_woman.h"
+#include "assignment_solver.h"
+#include "cost_matrix.h"
+#include "thread_pool.h"
 
 /// @brief Algorithm for finding a solution to a stable matching problem, when there are more men than women and when
 /// affinity scores are reciprocal, i.e. a man likes a woman as much as she likes him.
 ///
 /// Obviously, there will remain single men.
-class GaleShapleyAlgorithm
+///
+/// Men rank women by increasing score, and then by increasing index. Women rank men by increasing score, and then by
+/// increasing index. Both orders being strict, the men-optimal stable matching is unique, whatever the order of the
+/// proposals.
+///
+/// The preference lists of all the men are stored in a single contiguous array, each man owning a slot of
+/// n_candidates women that he reads with a cursor. Each woman only keeps her current engagement, so that a proposal is
+/// answered in O(1).
+///
+/// Free men propose concurrently, each thread having its own worklist. A woman's engagement is packed into a single
+/// 64-bit word (score, man), compared and swapped atomically, and a man she dumps is taken over by the thread that
+/// stole her. Since the stable matching is unique, the result doesn't depend on the scheduling of the threads.
+class GaleShapleyAlgorithm : public AssignmentSolver
 {
 public:
-    /// @brief Default constructor
-    GaleShapleyAlgorithm();
+    /// @brief Constructor
+    /// @param thread_pool Worker threads used to rank the women of all the men
+    /// @param n_candidates Number of women each man ranks at once, the following ones being ranked lazily if he has
+    /// proposed to all of them. It brings memory and time down to O((n_men + n_women) * n_candidates) in practice.
+    /// 0 to rank all the women upfront
+    GaleShapleyAlgorithm(ThreadPool &thread_pool, size_t n_candidates = 0);
 
     /// @brief Loads input love scores, solves the stable matching problem and return the optimal matches
-    /// @param input_scores Coefficient [i][j] corresponds to the love score between a man i and a woman j. The lower
+    /// @param input_scores Coefficient (i, j) corresponds to the love score between a man i and a woman j. The lower
+    /// the score the better
+    /// @param output_matches Coefficient [i] corresponds to the index of the man engaged to the woman i
+    /// @return true if the problem has been succesfully solved
+    bool solve(const CostMatrix &input_scores, std::vector<size_t> &output_matches) override;
+
+    /// @brief Solves the stable matching problem again, starting from the engagements of a previous matching, e.g.
+    /// after a few capsules have been added or replaced. Engagements that would be broken by a blocking pair are
+    /// dissolved first, and only the men they free propose again
+    /// @param input_scores Coefficient (i, j) corresponds to the love score between a man i and a woman j. The lower
     /// the score the better
+    /// @param initial_matches Coefficient [i] corresponds to the index of the man initially engaged to the woman i, or
+    /// @ref no_match. Invalid or duplicated men are ignored
     /// @param output_matches Coefficient [i] corresponds to the index of the man engaged to the woman i
+    /// @note The matching is stable, but it's not always the men-optimal one, which a cold start would return
     /// @return true if the problem has been succesfully solved
-    bool solve(const std::vector<std::vector<double>> &input_scores, std::vector<size_t> &output_matches);
+    bool solve(const CostMatrix &input_scores, const std::vector<size_t> &initial_matches,
+               std::vector<size_t> &output_matches);
+
+    /// @brief Forgets the last problem, keeping the buffers allocated for the next one
+    void reset();
+
+    static const size_t no_match = SIZE_MAX;
 
 private:
+    /// @brief Buffers used to rank the women of a man
+    struct RankingScratch
+    {
+        std::vector<float> row;
+        std::vector<uint32_t> candidates;
+    };
+
+    /// @brief Checks the size of the problem and allocates the buffers, with all the women single
+    /// @return false if there aren't enough men
+    bool prepare(const CostMatrix &input_scores);
+
+    /// @brief Engages the men and women of an initial matching, and breaks the engagements involved in a blocking pair
+    /// until the remaining ones are stable
+    /// @param initial_matches Man initially engaged to each woman, or @ref no_match
+    /// @param output_free_men Men that have to propose, from their favorite woman
+    void seed_engagements(const std::vector<size_t> &initial_matches, std::vector<uint32_t> &output_free_men);
+
     /// @brief Finds a solution to the stable matching problem
+    /// @param free_men Men that have to propose, all the others being already engaged or rejected by all the women
+    /// @param output_matches Coefficient [i] corresponds to the index of the man engaged to the woman i
     /// @return true if the problem has been succesfully solved
-    bool find_stable_configuration();
+    bool find_stable_configuration(const std::vector<uint32_t> &free_men, std::vector<size_t> &output_matches);
+
+    /// @brief Lets free men propose until each of them is engaged or has been rejected by all the women
+    /// @param free_men Worklist of the calling thread, that gets emptied
+    /// @param scratch Buffers of the calling thread
+    void propose(std::vector<uint32_t> &free_men, RankingScratch &scratch);
+
+    /// @brief Fills the slot of a man with his next best women, among those that haven't been ranked yet and that
+    /// would accept him, and resets his cursor
+    /// @param man_id Index of the man
+    /// @param first_ranking Rank his best women, instead of those following the last ranked one
+    /// @param scratch Buffers of the calling thread
+    /// @return false if there's no woman left to rank
+    bool rank_next_women(uint32_t man_id, bool first_ranking, RankingScratch &scratch);
+
+    /// @brief Packs a score and a man into a word whose unsigned order is the order of preference of the women, i.e.
+    /// by increasing score and then by increasing man index
+    static uint64_t pack_engagement(float score, uint32_t man_id)
+    {
+        // Flip the bits of the float so that its IEEE representation sorts like an unsigned integer
+        uint32_t bits;
+        std::memcpy(&bits, &score, sizeof(bits));
+        bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+        return (static_cast<uint64_t>(bits) << 32) | man_id;
+    }
+
+    /// @brief Checks if a woman would leave her fiance for a man
+    /// @note Since she only trades up, a man she would reject now will be rejected forever. The check may thus be
+    /// done against an outdated engagement
+    bool would_accept(uint32_t woman_id, uint32_t man_id, float score) const
+    {
+        return pack_engagement(score, man_id) < engagements_[woman_id].load(std::memory_order_relaxed);
+    }
+
+    static const uint64_t no_engagement = UINT64_MAX;
+
+    ThreadPool &thread_pool_;
+    size_t n_candidates_;
+    const CostMatrix *scores_;
+
+    // Men
+    size_t slot_size_;                     ///< Number of women ranked at once by each man
+    std::vector<uint32_t> preferences_;    ///< Ranked women of all the men, one slot after the other
+    std::vector<float> preference_scores_; ///< Score of each ranked woman, stored alongside
+    std::vector<uint32_t> cursors_;        ///< Next woman to propose to, in the slot of each man
+    std::vector<uint32_t> slot_lengths_;   ///< Number of ranked women in the slot of each man
+    std::vector<uint32_t> last_ranked_;    ///< Worst woman ranked so far by each man
+    std::vector<char> all_ranked_;         ///< Whether each man has ranked all the women that could accept him
 
-    std::vector<Man> men_;
-    std::vector<Woman> women_;
-    std::vector<std::vector<double>> scores_;
+    // Women
+    std::vector<std::atomic<uint64_t>> engagements_; ///< Packed (score, man) of each woman, or no_engagement
+    std::atomic<size_t> n_engaged_women_;
 };
 
-#endif // GALE_SHAPLEY_ALGORITHM_H
\ No newline at end of file
+#endif // GALE_SHAPLEY_ALGORITHM_H
@@ -0,0 +1,75 @@
+/*********************************************************************************************************************
+ * File : photo_manifest.h                                                                                           *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef PHOTO_MANIFEST_H
+#define PHOTO_MANIFEST_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// @brief Manifest of the pictures of capsules grids that have already been processed, keyed by a hash of their
+/// content, so that loading the capsules again only processes the new or modified pictures.
+///
+/// It's stored as a text file in the capsules directory, with one line per picture: the hash in hexadecimal, the
+/// number of capsules extracted from it and the name of the picture. Capsules are named after the hash of their
+/// picture, which keeps their names stable across runs.
+///
+/// @note All the methods are thread-safe
+class PhotoManifest
+{
+public:
+    /// @brief Picture recorded in the manifest
+    struct Entry
+    {
+        uint64_t hash;          ///< Hash of the content of the picture
+        size_t n_capsules;      ///< Number of capsules extracted from it
+        std::string photo_name; ///< Name of the picture, relative to its directory
+    };
+
+    /// @brief Constructor
+    /// @param capsules_dir Directory in which the capsules extracted from the pictures are saved
+    explicit PhotoManifest(const std::string &capsules_dir);
+
+    /// @brief Reads the manifest, if any
+    /// @return true if it was successful, or if there was no manifest yet
+    bool load();
+
+    /// @brief Checks if a picture with this content has already been processed
+    bool contains(uint64_t hash) const;
+
+    /// @brief Finds the last picture processed under a given name
+    /// @return false if no picture has been processed under this name
+    bool find_photo(const std::string &photo_name, Entry &output_entry) const;
+
+    /// @brief Records a processed picture, appending it to the manifest file
+    /// @return true if it was successful
+    bool add(const Entry &entry);
+
+    /// @brief Forgets a picture, rewriting the manifest file
+    /// @return true if it was successful
+    bool remove(uint64_t hash);
+
+    /// @brief Computes the 64-bit FNV-1a hash of a buffer
+    static uint64_t hash_content(const std::vector<uint8_t> &content);
+
+    /// @brief Computes the 64-bit FNV-1a hash of a buffer, e.g. of the pixels of a video frame
+    static uint64_t hash_content(const uint8_t *data, size_t size);
+
+    /// @brief Formats a hash as 16 hexadecimal digits, as used in the names of the capsules
+    static std::string to_hex(uint64_t hash);
+
+    static const std::string manifest_filename; ///< Name of the manifest file inside the capsules directory
+
+private:
+    std::string manifest_path_;
+    std::map<uint64_t, Entry> entries_; ///< Processed pictures, by hash
+    mutable std::mutex mutex_;
+};
+
+#endif // PHOTO_MANIFEST_H
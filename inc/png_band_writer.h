@@ -0,0 +1,62 @@
+/*********************************************************************************************************************
+ * File : png_band_writer.h                                                                                          *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef PNG_BAND_WRITER_H
+#define PNG_BAND_WRITER_H
+
+#include <cstdio>
+#include <string>
+#include <opencv2/core/mat.hpp>
+
+struct png_struct_def;
+struct png_info_def;
+
+/// @brief Writes a PNG image band of rows by band of rows, so that images too large to fit in memory can be saved
+/// while they're being rendered.
+///
+/// Rows are compressed and written to the file as soon as they're given, from top to bottom.
+class PngBandWriter
+{
+public:
+    PngBandWriter();
+
+    /// @brief Destructor. Closes the file, leaving it truncated if not all the rows have been written
+    ~PngBandWriter();
+
+    PngBandWriter(const PngBandWriter &) = delete;
+    PngBandWriter &operator=(const PngBandWriter &) = delete;
+
+    /// @brief Creates the file and writes the header of the image
+    /// @param path Path of the PNG file
+    /// @param width Width in pixels of the image
+    /// @param height Height in pixels of the image
+    /// @param compression_level zlib compression level, from 0 (none) to 9 (best). Low levels are much faster on
+    /// large images, for a slightly bigger file
+    /// @return true if it was successful
+    bool open(const std::string &path, int width, int height, int compression_level = 3);
+
+    /// @brief Writes the next rows of the image
+    /// @param band BGR image, CV_8UC3, as wide as the image
+    /// @return true if it was successful
+    bool write_rows(const cv::Mat &band);
+
+    /// @brief Ends the image and closes the file
+    /// @return false if not all the rows have been written, or if it failed
+    bool close();
+
+private:
+    /// @brief Releases the structures of libpng and closes the file
+    void release();
+
+    FILE *file_;
+    png_struct_def *png_;
+    png_info_def *info_;
+    int width_;
+    int height_;
+    int n_written_rows_;
+};
+
+#endif // PNG_BAND_WRITER_H
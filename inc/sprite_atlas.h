@@ -0,0 +1,54 @@
+/*********************************************************************************************************************
+ * File : sprite_atlas.h                                                                                             *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef SPRITE_ATLAS_H
+#define SPRITE_ATLAS_H
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <opencv2/core/mat.hpp>
+
+#include "capsule_index.h"
+#include "thread_pool.h"
+
+/// @brief Cache of capsules images resized to the size of the disks of a mosaic, ready to be drawn.
+///
+/// The sprites of a size are stored in contiguous blocks, one sprite after the other. Each capsule is resized once
+/// per size, from its thumbnail if it's large enough and from its image otherwise, so that rendering the same mosaic
+/// several times, or at several sizes, only pays for the new sprites.
+class SpriteAtlas
+{
+public:
+    /// @brief Constructor
+    /// @param capsule_index Index of the capsules, giving their thumbnails and the paths of their images
+    /// @param thread_pool Worker threads used to resize the capsules
+    SpriteAtlas(const CapsuleIndex &capsule_index, ThreadPool &thread_pool);
+
+    /// @brief Gets the sprites of capsules at a given size, resizing the ones that aren't cached yet in parallel
+    /// @param capsule_ids Indices of the capsules in the index, possibly repeated
+    /// @param size Side in pixels of the square sprites
+    /// @param output_sprites Sprite of each capsule, pointing to the atlas (read-only)
+    /// @return true if it was successful
+    bool get_sprites(const std::vector<size_t> &capsule_ids, int size, std::vector<cv::Mat> &output_sprites);
+
+    /// @brief Releases all the sprites
+    void clear();
+
+private:
+    /// @brief Sprites of a given size
+    struct SizedSprites
+    {
+        std::vector<cv::Mat> blocks;                 ///< Contiguous blocks of sprites, stacked vertically
+        std::unordered_map<size_t, cv::Mat> sprites; ///< Sprite of each cached capsule, inside a block
+    };
+
+    const CapsuleIndex &capsule_index_;
+    ThreadPool &thread_pool_;
+    std::map<int, SizedSprites> sprites_by_size_;
+};
+
+#endif // SPRITE_ATLAS_H
@@ -0,0 +1,99 @@
+/*********************************************************************************************************************
+ * File : thread_pool.h                                                                                              *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// @brief Fixed-size pool of worker threads, shared by all the stages of the application.
+///
+/// Each worker owns a queue of tasks. It processes its own queue from the back and steals tasks from the front of the
+/// other queues when it runs out of work. A thread waiting for a parallel loop to complete executes pending tasks
+/// instead of blocking, which makes nested parallel loops safe.
+class ThreadPool
+{
+public:
+    /// @brief Starts the worker threads
+    /// @param n_threads Number of worker threads. 0 to use the hardware concurrency
+    explicit ThreadPool(size_t n_threads = 0);
+
+    /// @brief Waits for the pending tasks to complete and joins the worker threads
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /// @brief Gets the number of worker threads
+    size_t size() const;
+
+    /// @brief Queues a task
+    /// @param task Function to run
+    /// @return Future that becomes ready once the task has been executed
+    template <typename F>
+    std::future<typename std::result_of<F()>::type> submit(F task)
+    {
+        typedef typename std::result_of<F()>::type R;
+        auto packaged_task = std::make_shared<std::packaged_task<R()>>(std::move(task));
+        std::future<R> future = packaged_task->get_future();
+        push_task([packaged_task]() { (*packaged_task)(); });
+        return future;
+    }
+
+    /// @brief Splits [begin, end) into chunks, runs @p func on each of them in parallel and waits for completion
+    /// @note The calling thread takes part in the work. If @p func throws, the remaining chunks are skipped and the
+    /// first exception is rethrown once all the chunks are done
+    /// @param begin First index
+    /// @param end Index past the last one
+    /// @param func Function processing the indices [chunk_begin, chunk_end)
+    /// @param chunk_size Number of indices per chunk. 0 to make a few chunks per thread
+    void parallel_for(size_t begin, size_t end,
+                      const std::function<void(size_t, size_t)> &func,
+                      size_t chunk_size = 0);
+
+private:
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    /// @brief Pushes a task to the queue of the calling worker, or to the next queue if called from outside the pool
+    void push_task(std::function<void()> task);
+
+    /// @brief Pops a task from the queue @p queue_id, or steals one from another queue
+    /// @return false if there's no pending task
+    bool pop_task(size_t queue_id, std::function<void()> &task);
+
+    /// @brief Runs one pending task, if any
+    /// @return false if there was no pending task
+    bool run_pending_task();
+
+    /// @brief Runs a task, never letting an exception escape
+    static void run_task(std::function<void()> &task);
+
+    /// @brief Main loop of a worker thread
+    void worker_loop(size_t worker_id);
+
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_condition_;
+    std::atomic<size_t> n_pending_tasks_;
+    std::atomic<size_t> next_queue_; ///< Queue receiving the next task submitted from outside the pool
+    bool stop_;
+};
+
+#endif // THREAD_POOL_H
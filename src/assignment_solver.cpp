@@ -0,0 +1,33 @@
+/*********************************************************************************************************************
+ * File : assignment_solver.cpp                                                                                      *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include "assignment_solver.h"
+#include "auction_algorithm.h"
+#include "gale_shapley/gale_shapley_algorithm.h"
+
+std::unique_ptr<AssignmentSolver> AssignmentSolver::create(Method method, ThreadPool &thread_pool, size_t n_candidates,
+                                                           size_t max_resident_bytes)
+{
+    switch (method)
+    {
+    case AUCTION:
+        return std::unique_ptr<AssignmentSolver>(new AuctionAlgorithm(thread_pool, 1e-3, max_resident_bytes));
+    case GALE_SHAPLEY:
+    default:
+        return std::unique_ptr<AssignmentSolver>(new GaleShapleyAlgorithm(thread_pool, n_candidates));
+    }
+}
+
+bool AssignmentSolver::parse_method(const std::string &name, Method &output_method)
+{
+    if (name == "gale-shapley")
+        output_method = GALE_SHAPLEY;
+    else if (name == "auction")
+        output_method = AUCTION;
+    else
+        return false;
+    return true;
+}
@@ -0,0 +1,249 @@
+/*********************************************************************************************************************
+ * File : auction_algorithm.cpp                                                                                      *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#include "auction_algorithm.h"
+
+namespace
+{
+const double scaling_factor = 6.0; ///< Ratio between the epsilons of two consecutive phases
+const double minus_infinity = -std::numeric_limits<double>::infinity();
+} // namespace
+
+AuctionAlgorithm::AuctionAlgorithm(ThreadPool &thread_pool,
+                                   double max_gap_ratio,
+                                   size_t max_resident_bytes) : thread_pool_(thread_pool),
+                                                                max_gap_ratio_(max_gap_ratio),
+                                                                max_resident_bytes_(max_resident_bytes)
+{
+}
+
+bool AuctionAlgorithm::solve(const CostMatrix &input_scores, std::vector<size_t> &output_matches)
+{
+    const size_t n_men = input_scores.rows();
+    const size_t n_women = input_scores.cols();
+    if (n_women == 0 || n_men < n_women)
+    {
+        std::cerr << "There's not enough men to get each woman assigned. Got " << n_men << " men and "
+                  << n_women << " women." << std::endl;
+        return false;
+    }
+
+    // Range of the scores
+    const size_t tile_rows = get_tile_rows(input_scores);
+    float min_score = std::numeric_limits<float>::max();
+    float max_score = std::numeric_limits<float>::lowest();
+    std::vector<float> row(n_women);
+    for (size_t i = 0; i < n_men; i++)
+    {
+        input_scores.get_row(i, row.data());
+        const auto it_minmax = std::minmax_element(row.cbegin(), row.cend());
+        min_score = std::min(min_score, *it_minmax.first);
+        max_score = std::max(max_score, *it_minmax.second);
+        if (tile_rows < n_men && (i + 1) % tile_rows == 0)
+            input_scores.release_rows(i + 1 - tile_rows, i + 1);
+    }
+    if (tile_rows < n_men)
+        input_scores.release_rows(0, n_men);
+    const double scores_range = std::max(1e-6, double(max_score) - double(min_score));
+
+    if (verbose_)
+        std::cout << "Auction Algorithm: " << n_men << " men and " << n_women << " women." << std::endl;
+    if (verbose_ && tile_rows < n_men)
+        std::cout << "Scores scanned by tiles of " << tile_rows << " rows to fit in the memory budget." << std::endl;
+
+    // Epsilon-scaling: each phase starts from the prices of the previous one
+    const double final_epsilon = max_gap_ratio_ * scores_range / n_women;
+    double epsilon = std::max(final_epsilon, scores_range / 4);
+    prices_.assign(n_men, 0);
+    profits_.assign(n_women, 0);
+    while (true)
+    {
+        man_assignment_.assign(n_men, -1);
+        woman_assignment_.assign(n_women, -1);
+        run_forward_auction(input_scores, epsilon);
+        if (verbose_)
+            std::cout << "Phase done, epsilon = " << epsilon << std::endl;
+
+        if (epsilon <= final_epsilon)
+            break;
+        epsilon = std::max(final_epsilon, epsilon / scaling_factor);
+    }
+    run_reverse_auction(input_scores, final_epsilon);
+
+    output_matches.assign(woman_assignment_.cbegin(), woman_assignment_.cend());
+    return true;
+}
+
+size_t AuctionAlgorithm::get_tile_rows(const CostMatrix &scores) const
+{
+    if (max_resident_bytes_ == 0 || !scores.is_mapped() || scores.rows() == 0)
+        return scores.rows();
+    const size_t row_size = scores.get_size_in_bytes() / scores.rows();
+    return std::min(scores.rows(), std::max<size_t>(1, max_resident_bytes_ / row_size));
+}
+
+void AuctionAlgorithm::run_forward_auction(const CostMatrix &scores, double epsilon)
+{
+    const size_t n_men = scores.rows();
+    const size_t n_women = scores.cols();
+    const size_t tile_rows = get_tile_rows(scores);
+
+    std::vector<size_t> unassigned_women;
+    for (size_t j = 0; j < n_women; j++)
+        if (woman_assignment_[j] < 0)
+            unassigned_women.push_back(j);
+
+    std::vector<size_t> bid_men(n_women);
+    std::vector<double> bid_prices(n_women);
+    std::vector<int> best_bidders(n_men, -1);
+    std::vector<size_t> bid_men_list;
+    std::vector<size_t> next_unassigned_women;
+    std::vector<double> best_values, second_values;
+    std::vector<size_t> best_men;
+    while (!unassigned_women.empty())
+    {
+        // Bidding: each unassigned woman finds her best and second best men. Chunks of women are processed in
+        // parallel, each chunk scanning the scores row by row, one tile of rows after the other
+        const size_t n_unassigned = unassigned_women.size();
+        best_values.assign(n_unassigned, minus_infinity);
+        second_values.assign(n_unassigned, minus_infinity);
+        best_men.assign(n_unassigned, 0);
+        for (size_t tile_begin = 0; tile_begin < n_men; tile_begin += tile_rows)
+        {
+            const size_t tile_end = std::min(n_men, tile_begin + tile_rows);
+            thread_pool_.parallel_for(0, n_unassigned, [&](size_t begin, size_t end) {
+                for (size_t i = tile_begin; i < tile_end; i++)
+                {
+                    const double price = prices_[i];
+                    for (size_t k = begin; k < end; k++)
+                    {
+                        const double value = -scores(i, unassigned_women[k]) - price;
+                        if (value > best_values[k])
+                        {
+                            second_values[k] = best_values[k];
+                            best_values[k] = value;
+                            best_men[k] = i;
+                        }
+                        else if (value > second_values[k])
+                            second_values[k] = value;
+                    }
+                }
+            });
+            if (tile_rows < n_men)
+                scores.release_rows(tile_begin, tile_end);
+        }
+
+        for (size_t k = 0; k < n_unassigned; k++)
+        {
+            // With a single man, there's no competition
+            const size_t j = unassigned_women[k];
+            const double second_value = (n_men > 1) ? second_values[k] : best_values[k];
+            bid_men[j] = best_men[k];
+            bid_prices[j] = prices_[best_men[k]] + best_values[k] - second_value + epsilon;
+        }
+
+        // Assignment: each man accepts his highest bid. Women are sorted, so that ties are broken by index
+        bid_men_list.clear();
+        for (const size_t j : unassigned_women)
+        {
+            const size_t i = bid_men[j];
+            if (best_bidders[i] < 0)
+                bid_men_list.push_back(i);
+            if (best_bidders[i] < 0 || bid_prices[j] > bid_prices[best_bidders[i]])
+                best_bidders[i] = j;
+        }
+
+        next_unassigned_women.clear();
+        for (const size_t j : unassigned_women)
+            if (best_bidders[bid_men[j]] != static_cast<int>(j))
+                next_unassigned_women.push_back(j);
+
+        for (const size_t i : bid_men_list)
+        {
+            const int j = best_bidders[i];
+            const int previous_woman = man_assignment_[i];
+            if (previous_woman >= 0)
+            {
+                woman_assignment_[previous_woman] = -1;
+                next_unassigned_women.push_back(previous_woman);
+            }
+            man_assignment_[i] = j;
+            woman_assignment_[j] = i;
+            prices_[i] = bid_prices[j];
+            profits_[j] = -scores(i, j) - prices_[i];
+            best_bidders[i] = -1;
+        }
+
+        std::sort(next_unassigned_women.begin(), next_unassigned_women.end());
+        std::swap(unassigned_women, next_unassigned_women);
+    }
+}
+
+void AuctionAlgorithm::run_reverse_auction(const CostMatrix &scores, double epsilon)
+{
+    const size_t n_men = scores.rows();
+    const size_t n_women = scores.cols();
+    const size_t tile_rows = get_tile_rows(scores);
+
+    // Lowest price of the assigned men
+    double lambda = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < n_men; i++)
+        if (man_assignment_[i] >= 0)
+            lambda = std::min(lambda, prices_[i]);
+
+    std::vector<size_t> overpriced_men;
+    for (size_t i = 0; i < n_men; i++)
+        if (man_assignment_[i] < 0 && prices_[i] > lambda)
+            overpriced_men.push_back(i);
+
+    std::vector<float> row(n_women);
+    while (!overpriced_men.empty())
+    {
+        const size_t i = overpriced_men.back();
+        overpriced_men.pop_back();
+
+        // Best and second best women for this man, given their current profits
+        scores.get_row(i, row.data());
+        if (tile_rows < n_men)
+            scores.release_rows(i, i + 1);
+        double best_value = minus_infinity;
+        double second_value = minus_infinity;
+        size_t best_woman = 0;
+        for (size_t j = 0; j < n_women; j++)
+        {
+            const double value = -row[j] - profits_[j];
+            if (value > best_value)
+            {
+                second_value = best_value;
+                best_value = value;
+                best_woman = j;
+            }
+            else if (value > second_value)
+                second_value = value;
+        }
+
+        if (lambda >= best_value - epsilon)
+        {
+            prices_[i] = lambda;
+            continue;
+        }
+
+        // Steal the best woman, her previous man is now unassigned
+        const int previous_man = woman_assignment_[best_woman];
+        man_assignment_[previous_man] = -1;
+        if (prices_[previous_man] > lambda)
+            overpriced_men.push_back(previous_man);
+
+        prices_[i] = std::max(lambda, second_value - epsilon);
+        man_assignment_[i] = best_woman;
+        woman_assignment_[best_woman] = i;
+        profits_[best_woman] = -row[best_woman] - prices_[i];
+    }
+}
@@ -0,0 +1,81 @@
+/*********************************************************************************************************************
+ * File : capacitated_matching.cpp                                                                                   *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <numeric>
+#include <queue>
+#include <utility>
+
+#include "gale_shapley/capacitated_matching.h"
+
+bool solve_capacitated_matching(const CostMatrix &scores, const std::vector<size_t> &capacities,
+                                std::vector<size_t> &output_targets)
+{
+    const size_t n_proposers = scores.rows();
+    const size_t n_targets = scores.cols();
+    const size_t total_capacity = std::accumulate(capacities.cbegin(), capacities.cend(), size_t(0));
+    if (capacities.size() != n_targets || total_capacity < n_proposers)
+    {
+        std::cerr << "The targets can't hold all the proposers. Got " << n_proposers << " proposers and a capacity of "
+                  << total_capacity << "." << std::endl;
+        return false;
+    }
+
+    // Each proposer sorts all the targets, best ones first
+    std::vector<float> preference_scores(n_proposers * n_targets);
+    std::vector<uint32_t> preferences(n_proposers * n_targets);
+    for (size_t i = 0; i < n_proposers; i++)
+    {
+        float *row = preference_scores.data() + i * n_targets;
+        uint32_t *order = preferences.data() + i * n_targets;
+        scores.get_row(i, row);
+        std::iota(order, order + n_targets, 0);
+        std::sort(order, order + n_targets, [row](uint32_t a, uint32_t b) {
+            return row[a] < row[b] || (row[a] == row[b] && a < b);
+        });
+    }
+
+    // Each target holds a max-heap of its (score, proposer), the worst one being on top
+    typedef std::pair<float, uint32_t> Proposal;
+    std::vector<std::priority_queue<Proposal>> held(n_targets);
+    std::vector<uint32_t> cursors(n_proposers, 0);
+    std::vector<uint32_t> free_proposers(n_proposers);
+    for (size_t i = 0; i < n_proposers; i++)
+        free_proposers[i] = n_proposers - 1 - i;
+    while (!free_proposers.empty())
+    {
+        const uint32_t proposer = free_proposers.back();
+        free_proposers.pop_back();
+        while (cursors[proposer] < n_targets)
+        {
+            const uint32_t target = preferences[proposer * n_targets + cursors[proposer]++];
+            const Proposal proposal(preference_scores[proposer * n_targets + target], proposer);
+            std::priority_queue<Proposal> &proposals = held[target];
+            if (proposals.size() < capacities[target])
+            {
+                proposals.push(proposal);
+                break;
+            }
+            if (capacities[target] > 0 && proposal < proposals.top())
+            {
+                // The worst proposer held is rejected, and proposes to his next target
+                free_proposers.push_back(proposals.top().second);
+                proposals.pop();
+                proposals.push(proposal);
+                break;
+            }
+        }
+    }
+
+    // Since the capacity is sufficient, every proposer ends up held
+    output_targets.assign(n_proposers, 0);
+    for (size_t j = 0; j < n_targets; j++)
+        for (; !held[j].empty(); held[j].pop())
+            output_targets[held[j].top().second] = j;
+    return true;
+}
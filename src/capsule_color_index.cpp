@@ -0,0 +1,195 @@
+/*********************************************************************************************************************
+ * File : capsule_color_index.cpp                                                                                    *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <queue>
+#include <utility>
+
+#include "capsule_color_index.h"
+#include "color_distance.h"
+
+CapsuleColorIndex::CapsuleColorIndex(float cell_size) : cell_size_(cell_size),
+                                                        size_(0)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        scales_[axis] = std::sqrt(color_distance_weights_bgr[axis]);
+        n_cells_[axis] = static_cast<int>(std::ceil(255.f * scales_[axis] / cell_size_)) + 1;
+    }
+    cells_.resize(n_cells_[0] * n_cells_[1] * n_cells_[2]);
+}
+
+void CapsuleColorIndex::insert(size_t id, const float mean_bgr[3])
+{
+    Entry entry;
+    float xyz[3];
+    to_weighted_space(mean_bgr, xyz);
+    entry.x = xyz[0];
+    entry.y = xyz[1];
+    entry.z = xyz[2];
+    entry.id = id;
+    const int cx = get_cell_coordinate(xyz[0], 0);
+    const int cy = get_cell_coordinate(xyz[1], 1);
+    const int cz = get_cell_coordinate(xyz[2], 2);
+    const size_t cell = (cz * n_cells_[1] + cy) * n_cells_[0] + cx;
+    cells_[cell].push_back(entry);
+    cell_ids_[id] = cell;
+    size_++;
+}
+
+void CapsuleColorIndex::insert(const CapsuleIndex &capsule_index)
+{
+    for (size_t i = 0; i < capsule_index.size(); i++)
+        insert(i, capsule_index.get_record(i).descriptor.mean_bgr);
+}
+
+bool CapsuleColorIndex::remove(size_t id)
+{
+    const auto it = cell_ids_.find(id);
+    if (it == cell_ids_.end())
+        return false;
+
+    // The order of the entries of a cell doesn't matter
+    std::vector<Entry> &entries = cells_[it->second];
+    const auto entry = std::find_if(entries.begin(), entries.end(), [id](const Entry &e) { return e.id == id; });
+    if (entry != entries.end())
+    {
+        *entry = entries.back();
+        entries.pop_back();
+        size_--;
+    }
+    cell_ids_.erase(it);
+    return true;
+}
+
+size_t CapsuleColorIndex::size() const
+{
+    return size_;
+}
+
+void CapsuleColorIndex::find_nearest(const float bgr[3], size_t k, std::vector<size_t> &output_ids) const
+{
+    output_ids.clear();
+    k = std::min(k, size_);
+    if (k == 0)
+        return;
+
+    float q[3];
+    to_weighted_space(bgr, q);
+    int c[3];
+    int max_ring = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        c[axis] = get_cell_coordinate(q[axis], axis);
+        max_ring = std::max(max_ring, std::max(c[axis], n_cells_[axis] - 1 - c[axis]));
+    }
+
+    // Max-heap of the best (squared distance, ID) found so far, the worst one being on top
+    typedef std::pair<float, size_t> Candidate;
+    std::priority_queue<Candidate> best;
+    const auto visit = [&](int cx, int cy, int cz) {
+        for (const Entry &entry : get_cell(cx, cy, cz))
+        {
+            const float dx = entry.x - q[0];
+            const float dy = entry.y - q[1];
+            const float dz = entry.z - q[2];
+            const Candidate candidate(dx * dx + dy * dy + dz * dz, entry.id);
+            if (best.size() < k)
+                best.push(candidate);
+            else if (candidate < best.top())
+            {
+                best.pop();
+                best.push(candidate);
+            }
+        }
+    };
+
+    // Visit the shells of cells at increasing Chebyshev distance from the query cell
+    for (int ring = 0; ring <= max_ring; ring++)
+    {
+        const int z_begin = std::max(0, c[2] - ring), z_end = std::min(n_cells_[2] - 1, c[2] + ring);
+        const int y_begin = std::max(0, c[1] - ring), y_end = std::min(n_cells_[1] - 1, c[1] + ring);
+        const int x_begin = std::max(0, c[0] - ring), x_end = std::min(n_cells_[0] - 1, c[0] + ring);
+        for (int cz = z_begin; cz <= z_end; cz++)
+            for (int cy = y_begin; cy <= y_end; cy++)
+            {
+                if (std::abs(cz - c[2]) == ring || std::abs(cy - c[1]) == ring)
+                {
+                    for (int cx = x_begin; cx <= x_end; cx++)
+                        visit(cx, cy, cz);
+                }
+                else
+                {
+                    if (c[0] - ring >= 0)
+                        visit(c[0] - ring, cy, cz);
+                    if (ring > 0 && c[0] + ring < n_cells_[0])
+                        visit(c[0] + ring, cy, cz);
+                }
+            }
+
+        // Any capsule outside the visited cube is farther than its closest face
+        if (best.size() == k)
+        {
+            float bound = std::numeric_limits<float>::max();
+            for (int axis = 0; axis < 3; axis++)
+            {
+                if (c[axis] - ring > 0)
+                    bound = std::min(bound, q[axis] - (c[axis] - ring) * cell_size_);
+                if (c[axis] + ring < n_cells_[axis] - 1)
+                    bound = std::min(bound, (c[axis] + ring + 1) * cell_size_ - q[axis]);
+            }
+            if (bound > 0 && best.top().first < bound * bound)
+                break;
+        }
+    }
+
+    output_ids.resize(best.size());
+    for (size_t i = best.size(); i > 0; i--)
+    {
+        output_ids[i - 1] = best.top().second;
+        best.pop();
+    }
+}
+
+void CapsuleColorIndex::find_within_radius(const float bgr[3], float radius, std::vector<size_t> &output_ids) const
+{
+    output_ids.clear();
+    float q[3];
+    to_weighted_space(bgr, q);
+    int begin[3], end[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        begin[axis] = get_cell_coordinate(q[axis] - radius, axis);
+        end[axis] = get_cell_coordinate(q[axis] + radius, axis);
+    }
+
+    const float radius2 = radius * radius;
+    for (int cz = begin[2]; cz <= end[2]; cz++)
+        for (int cy = begin[1]; cy <= end[1]; cy++)
+            for (int cx = begin[0]; cx <= end[0]; cx++)
+                for (const Entry &entry : get_cell(cx, cy, cz))
+                {
+                    const float dx = entry.x - q[0];
+                    const float dy = entry.y - q[1];
+                    const float dz = entry.z - q[2];
+                    if (dx * dx + dy * dy + dz * dz <= radius2)
+                        output_ids.push_back(entry.id);
+                }
+}
+
+void CapsuleColorIndex::to_weighted_space(const float bgr[3], float output_xyz[3]) const
+{
+    for (int axis = 0; axis < 3; axis++)
+        output_xyz[axis] = scales_[axis] * bgr[axis];
+}
+
+int CapsuleColorIndex::get_cell_coordinate(float value, int axis) const
+{
+    const int coordinate = static_cast<int>(std::floor(value / cell_size_));
+    return std::min(n_cells_[axis] - 1, std::max(0, coordinate));
+}
@@ -0,0 +1,141 @@
+/*********************************************************************************************************************
+ * File : capsule_descriptor.cpp                                                                                     *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "capsule_descriptor.h"
+
+const float CapsuleDescriptor::region_weights[CapsuleDescriptor::n_regions] = {0.125f, 0.125f, 0.125f, 0.125f,
+                                                                               0.125f, 0.125f, 0.25f};
+
+namespace
+{
+/// @brief Horizontal run of pixels of a square image belonging to the same region of the disk
+struct RegionSpan
+{
+    int y;       ///< Row of the run
+    int x_begin; ///< First column of the run
+    int x_end;   ///< Column past the last one
+    int region;  ///< Region of the pixels
+};
+
+/// @brief Splits the rows of the disk inscribed in a square image into runs of pixels of the same region, skipping
+/// the pixels outside of the disk
+/// @note The spans only depend on the size of the image, so they're computed once per size and thread
+const std::vector<RegionSpan> &get_region_spans(int size)
+{
+    thread_local int spans_size = 0;
+    thread_local std::vector<RegionSpan> spans;
+    if (spans_size == size)
+        return spans;
+
+    const int outside_disk = -1;
+    const float pi = static_cast<float>(M_PI);
+    const float center = 0.5f * size;
+    const float radius2 = center * center;
+    const float inner_radius2 = 0.25f * radius2;
+    spans.clear();
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+        {
+            const float dx = x + 0.5f - center;
+            const float dy = y + 0.5f - center;
+            const float r2 = dx * dx + dy * dy;
+            int region = outside_disk;
+            if (r2 < inner_radius2)
+                region = CapsuleDescriptor::n_regions - 1;
+            else if (r2 <= radius2)
+            {
+                // Clockwise angle in [0, 2pi), starting from the right
+                float angle = std::atan2(dy, dx);
+                if (angle < 0)
+                    angle += 2 * pi;
+                region = std::min(5, static_cast<int>(angle / (pi / 3)));
+            }
+            if (region == outside_disk)
+                continue;
+            if (!spans.empty() && spans.back().y == y && spans.back().x_end == x && spans.back().region == region)
+                spans.back().x_end++;
+            else
+                spans.push_back(RegionSpan{y, x, x + 1, region});
+        }
+    spans_size = size;
+    return spans;
+}
+} // namespace
+
+bool CapsuleDescriptor::compute(const cv::Mat &image, CapsuleDescriptor &output_descriptor)
+{
+    if (image.type() != CV_8UC3 || image.rows != image.cols || image.empty())
+    {
+        std::cerr << "Wrong image to describe. Expected a square CV_8UC3 image." << std::endl;
+        return false;
+    }
+
+    // Convert the whole square at once, it's cheaper than isolating the pixels of the disk
+    thread_local cv::Mat float_bgr;
+    thread_local cv::Mat lab;
+    image.convertTo(float_bgr, CV_32FC3, 1.0 / 255);
+    cv::cvtColor(float_bgr, lab, cv::COLOR_BGR2Lab);
+    compute(image, lab, cv::Rect(0, 0, image.cols, image.rows), output_descriptor);
+    return true;
+}
+
+void CapsuleDescriptor::compute(const cv::Mat &image, const cv::Mat &lab, const cv::Rect &window,
+                                CapsuleDescriptor &output_descriptor)
+{
+    // Accumulate the colors of each region
+    double sums_bgr[3] = {0, 0, 0};
+    double sums_lab[n_regions][3] = {};
+    int counts[n_regions] = {};
+    for (const RegionSpan &span : get_region_spans(window.width))
+    {
+        const cv::Vec3b *bgr_row = image.ptr<cv::Vec3b>(window.y + span.y) + window.x;
+        const cv::Vec3f *lab_row = lab.ptr<cv::Vec3f>(window.y + span.y) + window.x;
+        double *region_lab = sums_lab[span.region];
+        for (int x = span.x_begin; x < span.x_end; x++)
+            for (int c = 0; c < 3; c++)
+            {
+                sums_bgr[c] += bgr_row[x][c];
+                region_lab[c] += lab_row[x][c];
+            }
+        counts[span.region] += span.x_end - span.x_begin;
+    }
+
+    // Regions too small to contain a pixel get the mean color of the whole disk
+    int n_pixels = 0;
+    double disk_lab[3] = {0, 0, 0};
+    for (int k = 0; k < n_regions; k++)
+    {
+        n_pixels += counts[k];
+        for (int c = 0; c < 3; c++)
+            disk_lab[c] += sums_lab[k][c];
+    }
+    for (int c = 0; c < 3; c++)
+    {
+        output_descriptor.mean_bgr[c] = static_cast<float>(sums_bgr[c] / std::max(1, n_pixels));
+        disk_lab[c] /= std::max(1, n_pixels);
+    }
+    for (int k = 0; k < n_regions; k++)
+        for (int c = 0; c < 3; c++)
+            output_descriptor.regions_lab[k][c] = static_cast<float>(counts[k] > 0 ? sums_lab[k][c] / counts[k]
+                                                                                   : disk_lab[c]);
+}
+
+bool CapsuleDescriptor::parse_metric(const std::string &name, Metric &output_metric)
+{
+    if (name == "bgr")
+        output_metric = MEAN_BGR;
+    else if (name == "lab-sectors")
+        output_metric = LAB_SECTORS;
+    else
+        return false;
+    return true;
+}
@@ -4,7 +4,7 @@
  * 2020 Thomas Rouch                                                                                                 *
  *********************************************************************************************************************/
 
-#include <sstream>
+#include <algorithm>
 #include <iostream>
 #include <opencv2/calib3d.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -21,13 +21,19 @@ CapsuleExtractionPattern::CapsuleExtractionPattern(int width,
                                                    int edge_y,
                                                    int n_cols,
                                                    int n_rows,
-                                                   int radius) : width_(width),
-                                                                 height_(height),
-                                                                 n_cols_(n_cols),
-                                                                 n_rows_(n_rows),
-                                                                 radius_(radius),
-                                                                 refcorners_(4),
-                                                                 next_capsule_id_(0)
+                                                   int radius,
+                                                   bool use_archive) : width_(width),
+                                                                       height_(height),
+                                                                       n_cols_(n_cols),
+                                                                       n_rows_(n_rows),
+                                                                       radius_(radius),
+                                                                       use_archive_(use_archive),
+                                                                       valid_(false),
+                                                                       refcorners_(4),
+                                                                       next_capsule_id_(0),
+                                                                       index_writer_(output_directory_,
+                                                                                     use_archive ? 2 * radius : CapsuleIndex::default_thumbnail_size,
+                                                                                     use_archive)
 
 {
 
@@ -55,22 +61,62 @@ CapsuleExtractionPattern::CapsuleExtractionPattern(int width,
             back.emplace_back(x, y);
     }
 
-    // Initializes images used for capsule-cropping
-    capsule_.create(2 * radius_, 2 * radius_, CV_8UC3);
+    // Initializes the mask used for capsule-cropping
     capsule_mask_.create(2 * radius_, 2 * radius_, CV_8U);
     capsule_mask_.setTo(0);
     cv::circle(capsule_mask_, cv::Point2f(radius_, radius_), radius_, cv::Scalar::all(255), -1);
 
-    // Create output directory
-    fs::remove_all(output_directory_);
+    // Create output directory, or keep appending to the existing one
     fs::create_directories(output_directory_);
+    CapsuleIndex capsule_index(output_directory_, CapsuleIndex::default_thumbnail_size);
+    valid_ = index_writer_.open(&capsule_index);
+    if (!valid_)
+    {
+        std::cerr << "Unable to open the capsules directory " << output_directory_ << std::endl;
+        return;
+    }
+    for (size_t i = 0; i < capsule_index.size(); i++)
+    {
+        const CapsuleIndexRecord &record = capsule_index.get_record(i);
+        color_index_.insert(record.id, record.descriptor.mean_bgr);
+        capsule_ids_[record.filename] = record.id;
+    }
 }
 
-bool CapsuleExtractionPattern::warp_image_and_extract_capsules(const size_t capsules_batch_id,
-                                                               const std::vector<cv::Point2f> &corners,
+bool CapsuleExtractionPattern::warp_image_and_extract_capsules(const std::vector<cv::Point2f> &corners,
                                                                const cv::Mat &src_img,
                                                                cv::Mat &output_rectified_image,
-                                                               bool draw_circles)
+                                                               std::vector<cv::Mat> &output_capsules,
+                                                               bool draw_circles) const
+{
+    if (!rectify_image(corners, src_img, output_rectified_image, false))
+        return false;
+
+    // Extract cutouts
+    output_capsules.clear();
+    output_capsules.reserve(get_number_of_capsules_per_image());
+    for (const auto &row : grid_)
+        for (const auto &pt : row)
+        {
+            cv::Mat roi(output_rectified_image, cv::Rect(pt.x - radius_, pt.y - radius_, radius_ * 2, radius_ * 2));
+            output_capsules.emplace_back(capsule_mask_.size(), CV_8UC3, cv::Scalar::all(0));
+            roi.copyTo(output_capsules.back(), capsule_mask_);
+        }
+
+    // Draw circles around the capsules
+    if (draw_circles)
+    {
+        for (const auto &row : grid_)
+            for (const auto &pt : row)
+                cv::circle(output_rectified_image, pt, radius_, cv::Scalar(0, 0, 255), 3);
+    }
+    return true;
+}
+
+bool CapsuleExtractionPattern::rectify_image(const std::vector<cv::Point2f> &corners,
+                                             const cv::Mat &src_img,
+                                             cv::Mat &output_rectified_image,
+                                             bool draw_circles) const
 {
     if (corners.size() != 4)
     {
@@ -79,23 +125,10 @@ bool CapsuleExtractionPattern::warp_image_and_extract_capsules(const size_t caps
     }
 
     // Find the homography between the 4 observed corners and the reference ones
-    H_ = cv::findHomography(corners, refcorners_, 0);
+    const cv::Mat H = cv::findHomography(corners, refcorners_, 0);
 
     // Warp the image to get only the pattern
-    cv::warpPerspective(src_img, output_rectified_image, H_, cv::Size(width_, height_));
-
-    // Extract and save cutouts
-    int id = 0;
-    for (const auto &row : grid_)
-        for (const auto &pt : row)
-        {
-            cv::Mat roi(output_rectified_image, cv::Rect(pt.x - radius_, pt.y - radius_, radius_ * 2, radius_ * 2));
-            roi.copyTo(capsule_, capsule_mask_);
-
-            std::stringstream ss;
-            ss << output_directory_ << "capsule_" << capsules_batch_id << "_" << id++ << ".png";
-            cv::imwrite(ss.str(), capsule_);
-        }
+    cv::warpPerspective(src_img, output_rectified_image, H, cv::Size(width_, height_));
 
     // Draw circles around the capsules
     if (draw_circles)
@@ -107,7 +140,183 @@ bool CapsuleExtractionPattern::warp_image_and_extract_capsules(const size_t caps
     return true;
 }
 
+bool CapsuleExtractionPattern::extract_capsules(const std::vector<cv::Point2f> &corners,
+                                                const cv::Mat &src_img,
+                                                double corners_scale,
+                                                ThreadPool &thread_pool,
+                                                std::vector<cv::Mat> &output_capsules) const
+{
+    if (corners.size() != 4)
+    {
+        std::cerr << "Wrong number of corners. Expected 4." << std::endl;
+        return false;
+    }
+    if (src_img.empty() || src_img.type() != CV_8UC3 || corners_scale <= 0)
+    {
+        std::cerr << "Invalid picture to extract the capsules from." << std::endl;
+        return false;
+    }
+
+    // Halve the picture while the grid is more than twice as large as the reference one
+    double perimeter = 0;
+    for (int i = 0; i < 4; i++)
+        perimeter += cv::norm(corners[(i + 1) % 4] - corners[i]);
+    double scale = corners_scale;
+    const double ref_perimeter = 2. * (width_ + height_);
+    cv::Mat img = src_img;
+    while (scale * perimeter > 2 * ref_perimeter)
+    {
+        cv::Mat half_img;
+        cv::pyrDown(img, half_img);
+        img = half_img;
+        scale = corners_scale * img.cols / src_img.cols;
+    }
+    std::vector<cv::Point2f> src_corners(corners);
+    for (auto &corner : src_corners)
+        corner = corner * scale;
+
+    // Homography mapping the reference grid to the picture
+    const cv::Mat H = cv::findHomography(refcorners_, src_corners, 0);
+    const double h[9] = {H.at<double>(0, 0), H.at<double>(0, 1), H.at<double>(0, 2),
+                         H.at<double>(1, 0), H.at<double>(1, 1), H.at<double>(1, 2),
+                         H.at<double>(2, 0), H.at<double>(2, 1), H.at<double>(2, 2)};
+
+    const int size = 2 * radius_;
+    output_capsules.resize(get_number_of_capsules_per_image());
+    thread_pool.parallel_for(0, output_capsules.size(), [&](size_t begin, size_t end) {
+        thread_local cv::Mat map_x, map_y;
+        map_x.create(size, size, CV_32F);
+        map_y.create(size, size, CV_32F);
+        for (size_t k = begin; k < end; k++)
+        {
+            const cv::Point2f &center = grid_[k / n_cols_][k % n_cols_];
+            const double x0 = center.x - radius_;
+            const double y0 = center.y - radius_;
+
+            // Pixels outside of the disk are sent out of the picture, where they're filled with black
+            for (int y = 0; y < size; y++)
+            {
+                float *row_x = map_x.ptr<float>(y);
+                float *row_y = map_y.ptr<float>(y);
+                const uint8_t *mask = capsule_mask_.ptr<uint8_t>(y);
+                const double ref_y = y0 + y;
+                for (int x = 0; x < size; x++)
+                {
+                    if (!mask[x])
+                    {
+                        row_x[x] = -1.f;
+                        row_y[x] = -1.f;
+                        continue;
+                    }
+                    const double ref_x = x0 + x;
+                    const double w = 1. / (h[6] * ref_x + h[7] * ref_y + h[8]);
+                    row_x[x] = static_cast<float>((h[0] * ref_x + h[1] * ref_y + h[2]) * w);
+                    row_y[x] = static_cast<float>((h[3] * ref_x + h[4] * ref_y + h[5]) * w);
+                }
+            }
+            cv::remap(img, output_capsules[k], map_x, map_y, cv::INTER_LINEAR, cv::BORDER_CONSTANT,
+                      cv::Scalar::all(0));
+        }
+    }, 1);
+    return true;
+}
+
+namespace
+{
+std::string get_capsule_filename(const std::string &batch_name, size_t id)
+{
+    return "capsule_" + batch_name + "_" + std::to_string(id) + ".png";
+}
+} // namespace
+
+size_t CapsuleExtractionPattern::write_capsules(const std::string &batch_name,
+                                                const std::vector<cv::Mat> &capsules,
+                                                CapsuleWriter &writer) const
+{
+    // The archive stores the raw pixels of the capsules in their records instead
+    std::vector<std::string> paths;
+    if (valid_ && !use_archive_)
+    {
+        paths.resize(capsules.size());
+        for (size_t id = 0; id < capsules.size(); id++)
+            paths[id] = output_directory_ + get_capsule_filename(batch_name, id);
+    }
+    return writer.write(paths, paths.empty() ? std::vector<cv::Mat>() : capsules);
+}
+
+bool CapsuleExtractionPattern::index_capsules(const std::string &batch_name,
+                                              const std::vector<cv::Mat> &capsules,
+                                              ThreadPool &thread_pool)
+{
+    if (!valid_)
+        return false;
+
+    std::vector<std::string> filenames(capsules.size());
+    for (size_t id = 0; id < capsules.size(); id++)
+        filenames[id] = get_capsule_filename(batch_name, id);
+
+    std::vector<CapsuleIndexRecord> records;
+    if (!index_writer_.append(filenames, capsules, thread_pool, &records))
+        return false;
+    for (const auto &record : records)
+    {
+        color_index_.insert(record.id, record.descriptor.mean_bgr);
+        capsule_ids_[record.filename] = record.id;
+    }
+    return true;
+}
+
 int CapsuleExtractionPattern::get_number_of_capsules_per_image() const
 {
     return n_cols_ * n_rows_;
-}
\ No newline at end of file
+}
+
+bool CapsuleExtractionPattern::remove_capsules(const std::string &batch_name, size_t n_capsules)
+{
+    if (!valid_)
+        return false;
+
+    std::vector<std::string> filenames(n_capsules);
+    for (size_t id = 0; id < n_capsules; id++)
+        filenames[id] = get_capsule_filename(batch_name, id);
+    if (use_archive_ && !index_writer_.remove(filenames))
+        return false;
+
+    // Capsules whose images can't be deleted are still saved, and stay in the color index
+    bool success = true;
+    for (const auto &filename : filenames)
+    {
+        if (!use_archive_)
+        {
+            boost::system::error_code error;
+            fs::remove(output_directory_ + filename, error);
+            if (error)
+            {
+                std::cerr << "Unable to remove the capsule " << output_directory_ + filename << std::endl;
+                success = false;
+                continue;
+            }
+        }
+        const auto it = capsule_ids_.find(filename);
+        if (it == capsule_ids_.end())
+            continue;
+        color_index_.remove(it->second);
+        capsule_ids_.erase(it);
+    }
+    return success;
+}
+
+bool CapsuleExtractionPattern::is_valid() const
+{
+    return valid_;
+}
+
+const std::string &CapsuleExtractionPattern::get_output_directory() const
+{
+    return output_directory_;
+}
+
+const CapsuleColorIndex &CapsuleExtractionPattern::get_color_index() const
+{
+    return color_index_;
+}
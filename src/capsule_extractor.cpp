@@ -4,17 +4,38 @@
  * 2020 Thomas Rouch                                                                                                 *
  *********************************************************************************************************************/
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <thread>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <boost/filesystem.hpp>
 
 #include "capsule_extractor.h"
 
+namespace fs = boost::filesystem;
+
 //CapsuleExtractionPattern(2160, 1630, 58, 20, 6, 5, 140));
 
-CapsuleExtractor::CapsuleExtractor(const CapsuleExtractionPattern &capsules_pattern) : capsules_pattern_(capsules_pattern)
+// The writer holds up to two pictures worth of capsules, so that the next picture can be queued while the previous
+// one is still being written
+CapsuleExtractor::CapsuleExtractor(const CapsuleExtractionPattern &capsules_pattern,
+                                   ThreadPool &thread_pool,
+                                   int png_compression) : capsules_pattern_(capsules_pattern),
+                                                          thread_pool_(thread_pool),
+                                                          writer_(thread_pool,
+                                                                  2 * capsules_pattern.get_number_of_capsules_per_image(),
+                                                                  png_compression),
+                                                          manifest_(capsules_pattern.get_output_directory())
 {
     n_capsules_per_image_ = capsules_pattern.get_number_of_capsules_per_image();
+    manifest_.load();
 }
 
 void CapsuleExtractor::extract_capsules_from_directory(const std::string &input_dir, bool display)
@@ -22,113 +43,399 @@ void CapsuleExtractor::extract_capsules_from_directory(const std::string &input_
     std::vector<cv::String> filenames;
     cv::glob(input_dir + "/*.jpeg", filenames);
 
-    // Iterate over the directory and try extracting capsules on each picture
-    cv::Mat img;
-    int n_capsules = 0;
-    for (size_t i = 0; i < filenames.size(); i++)
+    // The decoding stage gets its own threads, since they block on the queue and would otherwise starve the pool
+    const size_t n_decoders = std::max<size_t>(1, thread_pool_.size() / 4);
+    BoundedQueue<std::unique_ptr<Batch>> decoded_batches(get_number_of_detectors());
+    SequenceWindow window(get_reorder_window_size());
+    std::vector<std::thread> threads;
+
+    // Decoding
+    std::atomic<size_t> next_img_to_decode(0);
+    std::atomic<size_t> n_running_decoders(n_decoders);
+    for (size_t t = 0; t < n_decoders; t++)
+        threads.emplace_back([&]() {
+            std::vector<uint8_t> content;
+            for (size_t i = next_img_to_decode++; i < filenames.size(); i = next_img_to_decode++)
+            {
+                window.wait(i);
+                // The file is read once, to hash it and then to decode it if it's new
+                std::unique_ptr<Batch> batch(new Batch);
+                batch->id = i;
+                batch->photo_name = fs::path(filenames[i]).filename().string();
+                std::ifstream file(filenames[i], std::ios::binary);
+                content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+                batch->hash = PhotoManifest::hash_content(content);
+                batch->already_loaded = manifest_.contains(batch->hash);
+                if (!batch->already_loaded)
+                    batch->img = cv::imdecode(content, cv::IMREAD_COLOR);
+                decoded_batches.push(std::move(batch));
+            }
+            if (--n_running_decoders == 0)
+                decoded_batches.close();
+        });
+
+    process_batches(decoded_batches, window, display);
+    for (auto &thread : threads)
+        thread.join();
+}
+
+void CapsuleExtractor::extract_capsules_from_video(const std::string &video_path, bool display)
+{
+    cv::VideoCapture capture(video_path);
+    if (!capture.isOpened())
     {
-        img = cv::imread(filenames[i]);
-        if (extract_capsules(i, img, display))
+        std::cerr << "Unable to open the video " << video_path << std::endl;
+        return;
+    }
+
+    // The frames are read and selected on their own thread, the selected ones going through the same stages as
+    // the pictures of a directory
+    BoundedQueue<std::unique_ptr<Batch>> decoded_batches(get_number_of_detectors());
+    SequenceWindow window(get_reorder_window_size());
+    std::thread capture_thread([&]() {
+        select_frames(capture, fs::path(video_path).filename().string(), decoded_batches, window);
+        decoded_batches.close();
+    });
+    process_batches(decoded_batches, window, display);
+    capture_thread.join();
+}
+
+size_t CapsuleExtractor::get_number_of_detectors() const
+{
+    return std::max<size_t>(1, thread_pool_.size() / 2);
+}
+
+size_t CapsuleExtractor::get_reorder_window_size() const
+{
+    return 4 * get_number_of_detectors();
+}
+
+void CapsuleExtractor::process_batches(BoundedQueue<std::unique_ptr<Batch>> &decoded_batches, SequenceWindow &window,
+                                       bool display)
+{
+    // The detection stage gets its own threads, since they block on the queues and would otherwise starve the pool
+    const size_t n_detectors = get_number_of_detectors();
+    BoundedQueue<std::unique_ptr<Batch>> extracted_batches(n_detectors);
+    std::vector<std::thread> threads;
+
+    // Detection and warping
+    std::atomic<size_t> n_running_detectors(n_detectors);
+    for (size_t t = 0; t < n_detectors; t++)
+        threads.emplace_back([&]() {
+            DetectionScratch scratch;
+            std::unique_ptr<Batch> batch;
+            while (decoded_batches.pop(batch))
+            {
+                if (!batch->already_loaded)
+                    batch->success = !batch->img.empty() && extract_capsules(*batch, scratch, display);
+                batch->img.release();
+                extracted_batches.push(std::move(batch));
+            }
+            if (--n_running_detectors == 0)
+                extracted_batches.close();
+        });
+
+    // Encoding and writing, in the order of the pictures. Batches that arrive early wait in a map, which only
+    // holds their capsules since the decoded pictures have been released, and which the window keeps small. The capsules of a picture are encoded in
+    // the background while the following one is processed, and it's only committed to the index and to the manifest
+    // once they're on disk
+    std::map<size_t, std::unique_ptr<Batch>> pending_batches;
+    size_t next_batch_to_save = 0;
+    std::unique_ptr<Batch> written_batch; // Batch whose capsules are being written
+    size_t written_ticket = 0;
+    int n_capsules = 0;
+    size_t n_skipped = 0;
+    const auto commit_written_batch = [&]() {
+        if (!written_batch)
+            return;
+        if (commit_batch(*written_batch, written_ticket))
         {
             n_capsules += n_capsules_per_image_;
             std::cout << "Loaded " << n_capsules << " capsules" << std::endl;
         }
         else
-            std::cerr << "Fail to extract from " << filenames[i] << std::endl;
+            std::cerr << "Fail to save the capsules of " << written_batch->photo_name << std::endl;
+        written_batch.reset();
+    };
+    std::unique_ptr<Batch> batch;
+    while (extracted_batches.pop(batch))
+    {
+        const size_t batch_id = batch->id;
+        pending_batches[batch_id] = std::move(batch);
+        for (auto it = pending_batches.find(next_batch_to_save); it != pending_batches.end();
+             it = pending_batches.find(++next_batch_to_save))
+        {
+            std::unique_ptr<Batch> ready_batch = std::move(it->second);
+            pending_batches.erase(it);
+            if (display)
+                display_batch(*ready_batch);
+            // Pictures of this run can also share the same content
+            if (ready_batch->already_loaded || manifest_.contains(ready_batch->hash) ||
+                (written_batch && written_batch->hash == ready_batch->hash))
+                n_skipped++;
+            else if (ready_batch->success)
+            {
+                const std::string batch_name = PhotoManifest::to_hex(ready_batch->hash);
+                const size_t ticket = capsules_pattern_.write_capsules(batch_name, ready_batch->capsules, writer_);
+                commit_written_batch();
+                written_batch = std::move(ready_batch);
+                written_ticket = ticket;
+            }
+            else
+                std::cerr << "Fail to extract from " << ready_batch->photo_name << std::endl;
+        }
+        window.advance(next_batch_to_save);
+    }
+    commit_written_batch();
+
+    for (auto &thread : threads)
+        thread.join();
+    if (n_skipped > 0)
+        std::cout << "Skipped " << n_skipped << " pictures already loaded" << std::endl;
+}
+
+void CapsuleExtractor::select_frames(cv::VideoCapture &capture, const std::string &video_name,
+                                     BoundedQueue<std::unique_ptr<Batch>> &output_batches,
+                                     SequenceWindow &window) const
+{
+    const int max_missed_frames = 5;      // Frames without a grid ending the current one
+    const float max_stable_motion = 1.5f; // Motion of the corners between two frames, in pixels of the resized frame
+
+    DetectionScratch scratch;
+    cv::Mat frame;
+    cv::Mat laplacian;
+    std::vector<cv::Point2f> previous_corners;
+    int n_missed_frames = max_missed_frames;
+    size_t n_boards = 0;
+
+    // Sharpest stable frame of the current grid
+    cv::Mat best_frame;
+    double best_sharpness = -1;
+    size_t best_frame_id = 0;
+    const auto queue_best_frame = [&]() {
+        if (best_frame.empty())
+            return;
+        window.wait(n_boards);
+        std::unique_ptr<Batch> batch(new Batch);
+        batch->id = n_boards++;
+        batch->photo_name = video_name + "#frame_" + std::to_string(best_frame_id);
+        batch->replaces_by_name = false; // Adding a grid to the video would shift the names of the next ones
+        batch->hash = PhotoManifest::hash_content(best_frame.data, best_frame.total() * best_frame.elemSize());
+        batch->already_loaded = manifest_.contains(batch->hash);
+        if (!batch->already_loaded)
+            batch->img = best_frame;
+        std::cout << "Selected the frame " << best_frame_id << " for the grid " << batch->id << std::endl;
+        output_batches.push(std::move(batch));
+        best_frame = cv::Mat();
+        best_sharpness = -1;
+    };
+
+    for (size_t frame_id = 0; capture.read(frame); frame_id++)
+    {
+        if (frame.empty() || frame.type() != CV_8UC3)
+            continue;
+        const int resized_width = (resized_height_ * frame.cols) / frame.rows;
+        cv::resize(frame, scratch.resized_img, cv::Size(resized_width, resized_height_), 0, 0, cv::INTER_AREA);
+        if (!get_largest_contour(scratch.resized_img, scratch, scratch.best_contour, scratch.ths_img, false) ||
+            !fit_quadrilateral(scratch.best_contour, scratch, scratch.quadrilateral_contour, false))
+        {
+            // The grid is considered gone, and the next one will be new, once it's been missed a few times in a row
+            if (++n_missed_frames == max_missed_frames)
+                queue_best_frame();
+            previous_corners.clear();
+            continue;
+        }
+        n_missed_frames = 0;
+
+        // The grid is stable if its corners barely moved since the previous frame, which rules out motion blur
+        float motion = max_stable_motion + 1;
+        if (!previous_corners.empty())
+        {
+            motion = 0;
+            for (int k = 0; k < 4; k++)
+                motion = std::max(motion, static_cast<float>(cv::norm(scratch.quadrilateral_contour[k] -
+                                                                      previous_corners[k])));
+        }
+        previous_corners = scratch.quadrilateral_contour;
+        if (motion > max_stable_motion)
+            continue;
+
+        // Sharpness is the variance of the Laplacian over the grid, in the full-resolution frame
+        const double scale = static_cast<double>(frame.rows) / resized_height_;
+        std::vector<cv::Point2f> corners(4);
+        for (int k = 0; k < 4; k++)
+            corners[k] = scratch.quadrilateral_contour[k] * scale;
+        const cv::Rect roi = cv::boundingRect(corners) & cv::Rect(0, 0, frame.cols, frame.rows);
+        if (roi.empty())
+            continue;
+        cv::cvtColor(frame(roi), scratch.src_gray, CV_BGR2GRAY);
+        cv::Laplacian(scratch.src_gray, laplacian, CV_64F);
+        cv::Scalar mean, stddev;
+        cv::meanStdDev(laplacian, mean, stddev);
+        const double sharpness = stddev[0] * stddev[0];
+        if (sharpness > best_sharpness)
+        {
+            frame.copyTo(best_frame);
+            best_sharpness = sharpness;
+            best_frame_id = frame_id;
+        }
+    }
+    queue_best_frame();
+}
+
+bool CapsuleExtractor::commit_batch(const Batch &batch, size_t ticket)
+{
+    // The index must only list capsules whose images are on disk
+    const std::string batch_name = PhotoManifest::to_hex(batch.hash);
+    if (!writer_.flush(ticket) || !capsules_pattern_.index_capsules(batch_name, batch.capsules, thread_pool_))
+        return false;
+
+    // Replace the capsules of the previous version of the picture. If they can't be removed, the previous version
+    // stays in the manifest along with the new one, so that its capsules are still accounted for
+    PhotoManifest::Entry previous_entry;
+    if (batch.replaces_by_name && manifest_.find_photo(batch.photo_name, previous_entry))
+    {
+        if (capsules_pattern_.remove_capsules(PhotoManifest::to_hex(previous_entry.hash), previous_entry.n_capsules))
+            manifest_.remove(previous_entry.hash);
+        else
+            std::cerr << "Fail to remove the previous capsules of " << batch.photo_name << std::endl;
     }
+
+    PhotoManifest::Entry entry;
+    entry.hash = batch.hash;
+    entry.n_capsules = batch.capsules.size();
+    entry.photo_name = batch.photo_name;
+    return manifest_.add(entry);
+}
+
+const CapsuleColorIndex &CapsuleExtractor::get_color_index() const
+{
+    return capsules_pattern_.get_color_index();
 }
 
-bool CapsuleExtractor::extract_capsules(const size_t capsules_batch_id, const cv::Mat &input_img, bool display)
+bool CapsuleExtractor::extract_capsules(Batch &batch, DetectionScratch &scratch, bool display) const
 {
-    const int resized_width = (resized_height_ * input_img.cols) / input_img.rows;
-    cv::resize(input_img, resized_img_, cv::Size(resized_width, resized_height_));
+    // The grid is detected on a small copy of the picture, averaged down so that its edges stay clean
+    const int resized_width = (resized_height_ * batch.img.cols) / batch.img.rows;
+    cv::resize(batch.img, scratch.resized_img, cv::Size(resized_width, resized_height_), 0, 0, cv::INTER_AREA);
 
-    if (!get_largest_contour(resized_img_, best_contour_, display))
+    cv::Mat &ths_img = display ? batch.ths_img : scratch.ths_img;
+    if (!get_largest_contour(scratch.resized_img, scratch, scratch.best_contour, ths_img))
         return false;
 
-    if (!fit_quadrilateral(best_contour_, quadrilateral_contour_))
+    if (!fit_quadrilateral(scratch.best_contour, scratch, scratch.quadrilateral_contour))
         return false;
 
-    // Extract the capsules
-    cv::Mat resized_rectified_img;
-    capsules_pattern_.warp_image_and_extract_capsules(capsules_batch_id, quadrilateral_contour_, resized_img_, resized_rectified_img, true);
+    // Refine the corners on the full-resolution picture, from which the capsules are then extracted
+    const double corners_scale = static_cast<double>(batch.img.rows) / resized_height_;
+    refine_quadrilateral(batch.img, corners_scale, scratch.quadrilateral_contour, scratch.refined_contour);
+    if (!capsules_pattern_.extract_capsules(scratch.refined_contour, batch.img, 1., thread_pool_, batch.capsules))
+        return false;
+    if (display && !capsules_pattern_.rectify_image(scratch.quadrilateral_contour, scratch.resized_img,
+                                                    batch.rectified_img))
+        return false;
 
-    // Show results
+    // Draw best 4-points contour
     if (display)
-    { // Draw best 4-points contour
-        resized_img_.copyTo(drawing_img_);
+    {
+        scratch.resized_img.copyTo(batch.drawing_img);
+        const auto &quadrilateral = scratch.quadrilateral_contour;
         for (int i = 0; i < 4; i++)
         {
-            cv::circle(drawing_img_, quadrilateral_contour_[i], 4 * (i + 1), cv::Scalar(0, 0, 255), -1);
-            cv::line(drawing_img_, quadrilateral_contour_[i], quadrilateral_contour_[(i + 1) % 4], cv::Scalar(0, 0, 255), 1, cv::LINE_AA);
+            cv::circle(batch.drawing_img, quadrilateral[i], 4 * (i + 1), cv::Scalar(0, 0, 255), -1);
+            cv::line(batch.drawing_img, quadrilateral[i], quadrilateral[(i + 1) % 4], cv::Scalar(0, 0, 255), 1, cv::LINE_AA);
         }
-
-        cv::imshow("Fitted contour", drawing_img_);
-        cv::imshow("Rectified", resized_rectified_img);
-        cv::waitKey();
     }
     return true;
 }
 
-bool CapsuleExtractor::get_largest_contour(const cv::Mat &src_img,
-                                           std::vector<cv::Point2f> &output_contour,
-                                           bool display,
-                                           int ths)
+void CapsuleExtractor::display_batch(const Batch &batch) const
 {
-    // Convert it to gray
-    cv::cvtColor(src_img, src_gray_, CV_BGR2GRAY);
-    cv::threshold(src_gray_, ths_img_, ths, 255, cv::THRESH_BINARY_INV);
-
-    if (display)
+    if (!batch.ths_img.empty())
+    {
+        cv::imshow("Thresholded image", batch.ths_img);
+        cv::waitKey();
+    }
+    if (batch.success)
     {
-        cv::imshow("Thresholded image", ths_img_);
+        cv::imshow("Fitted contour", batch.drawing_img);
+        cv::imshow("Rectified", batch.rectified_img);
         cv::waitKey();
     }
+}
+
+bool CapsuleExtractor::get_largest_contour(const cv::Mat &src_img,
+                                           DetectionScratch &scratch,
+                                           std::vector<cv::Point2f> &output_contour,
+                                           cv::Mat &output_ths_img,
+                                           bool verbose) const
+{
+    // Convert it to gray, and separate the dark grid from the white sheet with Otsu's threshold
+    cv::cvtColor(src_img, scratch.src_gray, CV_BGR2GRAY);
+    cv::threshold(scratch.src_gray, output_ths_img, 0, 255, cv::THRESH_BINARY_INV | cv::THRESH_OTSU);
 
     // Find contours
-    contours_.clear();
-    hierarchy_.clear();
-    cv::findContours(ths_img_, contours_, hierarchy_, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE,
+    auto &contours = scratch.contours;
+    contours.clear();
+    scratch.hierarchy.clear();
+    cv::findContours(output_ths_img, contours, scratch.hierarchy, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE,
                      cv::Point(0, 0));
 
-    if (contours_.empty())
+    if (contours.empty())
         return false;
 
-    // Find the contour with the largest area
-    std::sort(contours_.begin(), contours_.end(),
-              [](const std::vector<cv::Point> &left, const std::vector<cv::Point> &right) {
-                  return cv::contourArea(left) > cv::contourArea(right);
-              });
+    // Find the two contours with the largest areas, each area being computed once
+    size_t largest = 0;
+    double largest_area = -1;
+    double second_area = 0;
+    for (size_t k = 0; k < contours.size(); k++)
+    {
+        const double area = cv::contourArea(contours[k]);
+        if (area > largest_area)
+        {
+            second_area = std::max(second_area, largest_area);
+            largest_area = area;
+            largest = k;
+        }
+        else
+            second_area = std::max(second_area, area);
+    }
 
     output_contour.clear();
-    output_contour.insert(output_contour.end(), contours_[0].begin(), contours_[0].end());
-    if (contours_.size() == 1)
-        return true;
+    output_contour.insert(output_contour.end(), contours[largest].begin(), contours[largest].end());
 
-    // Make sure the first contour is way larger than the second one
-    if (cv::contourArea(contours_[1]) < 0.1 * cv::contourArea(output_contour))
+    // Make sure the largest contour is way larger than the second one
+    if (second_area < 0.1 * largest_area)
         return true;
 
-    std::cerr << "Error: Contour isn't large enough." << std::endl;
+    if (verbose)
+        std::cerr << "Error: Contour isn't large enough." << std::endl;
     return false;
 }
 
 bool CapsuleExtractor::fit_quadrilateral(const std::vector<cv::Point2f> &input_contour,
-                                         std::vector<cv::Point2f> &output_quadrilateral)
+                                         DetectionScratch &scratch,
+                                         std::vector<cv::Point2f> &output_quadrilateral,
+                                         bool verbose) const
 {
-    const double epsilon = 0.1 * cv::arcLength(input_contour, true);
-    std::vector<std::vector<cv::Point2f>> approx_polygon;
-    approx_polygon.emplace_back();
-    cv::approxPolyDP(input_contour, approx_polygon.back(), epsilon, true);
+    // Capsules overlapping the border of the grid dent its contour, which its convex hull ignores. The tolerance of
+    // the polygonal approximation then grows until only the 4 corners are left
+    cv::convexHull(input_contour, scratch.hull);
+    const double perimeter = cv::arcLength(scratch.hull, true);
+    auto &approx_polygon = scratch.approx_polygon;
+    approx_polygon.clear();
+    for (double tolerance = 0.01; tolerance <= 0.1 && approx_polygon.size() != 4; tolerance += 0.01)
+        cv::approxPolyDP(scratch.hull, approx_polygon, tolerance * perimeter, true);
 
-    if (approx_polygon[0].size() != 4)
+    if (approx_polygon.size() != 4)
     {
-        std::cerr << "Error: Wrong number of points : " << approx_polygon[0].size() << std::endl;
+        if (verbose)
+            std::cerr << "Error: Wrong number of points : " << approx_polygon.size() << std::endl;
         return false;
     }
 
     output_quadrilateral.clear();
-    output_quadrilateral.insert(output_quadrilateral.end(), approx_polygon[0].begin(), approx_polygon[0].end());
+    output_quadrilateral.insert(output_quadrilateral.end(), approx_polygon.begin(), approx_polygon.end());
 
     // Sort the 4-points clockwise, starting from Top-Left:
     // Top-Left, Top-Right, Bottom-Right, Bottom-Left
@@ -154,3 +461,116 @@ bool CapsuleExtractor::fit_quadrilateral(const std::vector<cv::Point2f> &input_c
 
     return true;
 }
+
+namespace
+{
+/// @brief Samples the intensity of a BGR image at a subpixel position, by bilinear interpolation
+/// @note The position must be at least one pixel away from the right and bottom borders
+float sample_intensity(const cv::Mat &img, float x, float y)
+{
+    const int x0 = static_cast<int>(x);
+    const int y0 = static_cast<int>(y);
+    const float fx = x - x0;
+    const float fy = y - y0;
+    const auto intensity = [&img](int px, int py) {
+        const cv::Vec3b &bgr = img.at<cv::Vec3b>(py, px);
+        return (bgr[0] + bgr[1] + bgr[2]) / 3.f;
+    };
+    return (1 - fy) * ((1 - fx) * intensity(x0, y0) + fx * intensity(x0 + 1, y0)) +
+           fy * ((1 - fx) * intensity(x0, y0 + 1) + fx * intensity(x0 + 1, y0 + 1));
+}
+} // namespace
+
+void CapsuleExtractor::refine_quadrilateral(const cv::Mat &img,
+                                            double scale,
+                                            const std::vector<cv::Point2f> &quadrilateral,
+                                            std::vector<cv::Point2f> &output_quadrilateral) const
+{
+    const int n_samples = 48;       // Edge points searched on each side
+    const float min_gradient = 8.f; // Smallest intensity step accepted as an edge
+    const int search_radius = static_cast<int>(std::ceil(2 * scale)) + 2;
+
+    output_quadrilateral.resize(4);
+    for (int i = 0; i < 4; i++)
+        output_quadrilateral[i] = quadrilateral[i] * scale;
+
+    // Fit a line to the edge points of each side, found at full resolution along the normals of the coarse side
+    std::vector<cv::Vec4f> lines(4);
+    std::vector<cv::Point2f> edge_points;
+    std::vector<float> profile(2 * search_radius + 1);
+    for (int i = 0; i < 4; i++)
+    {
+        const cv::Point2f p0 = output_quadrilateral[i];
+        const cv::Point2f p1 = output_quadrilateral[(i + 1) % 4];
+        const float length = static_cast<float>(cv::norm(p1 - p0));
+        if (length < 1)
+            return;
+        const cv::Point2f dir = (p1 - p0) / length;
+        const cv::Point2f normal(dir.y, -dir.x); // Outwards, since the corners are clockwise
+
+        edge_points.clear();
+        for (int k = 1; k < n_samples; k++)
+        {
+            // Skip the ends of the side, close to the other sides
+            const cv::Point2f center = p0 + dir * (length * (0.1f + 0.8f * k / n_samples));
+            const cv::Point2f first = center - normal * search_radius;
+            const cv::Point2f last = center + normal * search_radius;
+            if (std::min(first.x, last.x) < 0 || std::min(first.y, last.y) < 0 ||
+                std::max(first.x, last.x) >= img.cols - 1 || std::max(first.y, last.y) >= img.rows - 1)
+                continue;
+            for (int t = -search_radius; t <= search_radius; t++)
+            {
+                const cv::Point2f pt = center + normal * t;
+                profile[t + search_radius] = sample_intensity(img, pt.x, pt.y);
+            }
+
+            // The edge is the strongest step from the dark grid to the white sheet, located to subpixel accuracy by
+            // a parabola through the gradients around it
+            int best = 0;
+            float best_gradient = min_gradient;
+            for (int t = 1; t + 1 < static_cast<int>(profile.size()); t++)
+            {
+                const float gradient = 0.5f * (profile[t + 1] - profile[t - 1]);
+                if (gradient > best_gradient)
+                {
+                    best_gradient = gradient;
+                    best = t;
+                }
+            }
+            if (best == 0)
+                continue;
+            float offset = 0;
+            if (best > 1 && best + 2 < static_cast<int>(profile.size()))
+            {
+                const float before = 0.5f * (profile[best] - profile[best - 2]);
+                const float after = 0.5f * (profile[best + 2] - profile[best]);
+                const float curvature = before - 2 * best_gradient + after;
+                if (curvature < 0)
+                    offset = 0.5f * (before - after) / curvature;
+            }
+            edge_points.push_back(center + normal * (best - search_radius + offset));
+        }
+
+        // Too few edge points, the picture is left as it was detected
+        if (edge_points.size() < static_cast<size_t>(n_samples / 4))
+            return;
+        cv::fitLine(edge_points, lines[i], cv::DIST_HUBER, 0, 0.01, 0.01);
+    }
+
+    // Each corner is the intersection of the lines of its two sides, unless it moved further than the uncertainty
+    // of the coarse detection
+    std::vector<cv::Point2f> refined(4);
+    for (int i = 0; i < 4; i++)
+    {
+        const cv::Vec4f &a = lines[(i + 3) % 4];
+        const cv::Vec4f &b = lines[i];
+        const float det = a[0] * b[1] - a[1] * b[0];
+        if (std::abs(det) < 1e-3f)
+            return;
+        const float t = ((b[2] - a[2]) * b[1] - (b[3] - a[3]) * b[0]) / det;
+        refined[i] = cv::Point2f(a[2] + t * a[0], a[3] + t * a[1]);
+        if (cv::norm(refined[i] - output_quadrilateral[i]) > 2 * search_radius)
+            return;
+    }
+    output_quadrilateral = refined;
+}
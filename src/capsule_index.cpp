@@ -0,0 +1,541 @@
+/*********************************************************************************************************************
+ * File : capsule_index.cpp                                                                                          *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <opencv2/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <boost/filesystem.hpp>
+
+#include "capsule_index.h"
+#include "capsule_writer.h"
+
+namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+const std::string CapsuleIndex::index_filename = "capsules.idx";
+const std::string CapsuleIndex::archive_filename = "capsules.pack";
+
+namespace
+{
+const char index_magic[8] = "CAPSIDX";
+const char archive_magic[8] = "CAPSPAK";
+const uint32_t index_version = 2;
+
+/// @brief Gets the size of a record, rounded up to keep the records 8-byte aligned in the mapped file
+size_t get_record_size(int thumbnail_size)
+{
+    const size_t size = sizeof(CapsuleIndexRecord) + 3 * thumbnail_size * thumbnail_size;
+    return (size + 7) & ~size_t(7);
+}
+
+/// @brief Fills a record from the image of a capsule
+/// @return false if the filename is too long to be stored, or if the image can't be described
+bool fill_record(uint32_t id, const std::string &filename, int64_t mtime, const cv::Mat &capsule,
+                 int thumbnail_size, uint8_t *output_record)
+{
+    if (filename.size() >= sizeof(CapsuleIndexRecord::filename))
+    {
+        std::cerr << "Capsule filename is too long to be indexed: " << filename << std::endl;
+        return false;
+    }
+
+    std::memset(output_record, 0, get_record_size(thumbnail_size));
+    CapsuleIndexRecord &record = *reinterpret_cast<CapsuleIndexRecord *>(output_record);
+    record.mtime = mtime;
+    record.id = id;
+    if (!CapsuleDescriptor::compute(capsule, record.descriptor))
+        return false;
+    std::strncpy(record.filename, filename.c_str(), sizeof(record.filename) - 1);
+
+    if (thumbnail_size > 0)
+    {
+        cv::Mat thumbnail(thumbnail_size, thumbnail_size, CV_8UC3, output_record + sizeof(CapsuleIndexRecord));
+        cv::resize(capsule, thumbnail, thumbnail.size(), 0, 0, cv::INTER_AREA);
+    }
+    return true;
+}
+
+CapsuleIndexHeader make_header(int thumbnail_size, bool archive)
+{
+    CapsuleIndexHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, archive ? archive_magic : index_magic, sizeof(header.magic));
+    header.version = index_version;
+    header.thumbnail_size = thumbnail_size;
+    header.record_size = get_record_size(thumbnail_size);
+    return header;
+}
+
+int64_t get_mtime(const std::string &path)
+{
+    return static_cast<int64_t>(fs::last_write_time(path));
+}
+} // namespace
+
+CapsuleIndexWriter::CapsuleIndexWriter(const std::string &capsules_dir,
+                                       int thumbnail_size,
+                                       bool archive) : capsules_dir_(capsules_dir),
+                                                       index_path_((fs::path(capsules_dir) / (archive ? CapsuleIndex::archive_filename : CapsuleIndex::index_filename)).string()),
+                                                       thumbnail_size_(thumbnail_size),
+                                                       archive_(archive),
+                                                       next_id_(0)
+{
+}
+
+bool CapsuleIndexWriter::reset()
+{
+    std::ofstream index_file(index_path_, std::ios::binary | std::ios::trunc);
+    const CapsuleIndexHeader header = make_header(thumbnail_size_, archive_);
+    index_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    index_file.close();
+    next_id_ = 0;
+    if (!index_file)
+    {
+        std::cerr << "Unable to create the capsule index " << index_path_ << std::endl;
+        return false;
+    }
+
+    // The archive holds the only copy of the capsules, its creation must be on disk before any of them
+    if (archive_ && (!CapsuleWriter::sync_to_disk(index_path_) || !CapsuleWriter::sync_to_disk(capsules_dir_, true)))
+    {
+        std::cerr << "Unable to sync the capsule archive " << index_path_ << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool CapsuleIndexWriter::open(CapsuleIndex *output_index)
+{
+    // The index loads the archive whenever there's one
+    const bool has_archive = fs::exists(fs::path(capsules_dir_) / CapsuleIndex::archive_filename);
+    if (archive_ && !has_archive)
+        return reset();
+    CapsuleIndex index(capsules_dir_, thumbnail_size_);
+    if (!index.load())
+    {
+        // The index can be rebuilt from the images, but the archive is the only copy of its capsules
+        if (has_archive)
+        {
+            std::cerr << "Unable to load the capsule archive of " << capsules_dir_ << ", it's left untouched."
+                      << std::endl;
+            return false;
+        }
+        return reset();
+    }
+    if (index.is_archive() != archive_ || index.get_thumbnail_size() != thumbnail_size_)
+    {
+        std::cerr << "The capsules directory " << capsules_dir_ << " already holds capsules of another storage or size."
+                  << std::endl;
+        return false;
+    }
+
+    if (!fs::exists(index_path_))
+        return reset();
+
+    // Drop the partial record an interrupted append may have left at the end of the archive, so that the next
+    // records stay aligned
+    if (archive_)
+    {
+        const uintmax_t file_size = fs::file_size(index_path_);
+        const uintmax_t records_end = file_size - (file_size - sizeof(CapsuleIndexHeader)) %
+                                                      get_record_size(thumbnail_size_);
+        if (records_end != file_size)
+        {
+            std::cerr << "Dropping the partial record at the end of the capsule archive " << index_path_ << std::endl;
+            fs::resize_file(index_path_, records_end);
+            if (!CapsuleWriter::sync_to_disk(index_path_))
+            {
+                std::cerr << "Unable to sync the capsule archive " << index_path_ << std::endl;
+                return false;
+            }
+        }
+
+        // The removed records keep their space until the archive is compacted, once they take as much as the others
+        const size_t n_records = (records_end - sizeof(CapsuleIndexHeader)) / get_record_size(thumbnail_size_);
+        if (n_records - index.size() > 0 && n_records - index.size() >= index.size())
+        {
+            if (!compact())
+                return false;
+            index = CapsuleIndex(capsules_dir_, thumbnail_size_);
+            if (!index.load())
+            {
+                std::cerr << "Unable to load the compacted capsule archive " << index_path_ << std::endl;
+                return false;
+            }
+        }
+    }
+
+    next_id_ = 0;
+    for (size_t i = 0; i < index.size(); i++)
+        next_id_ = std::max(next_id_, index.get_record(i).id + 1);
+    if (output_index)
+        *output_index = std::move(index);
+    return true;
+}
+
+bool CapsuleIndexWriter::append(const std::vector<std::string> &filenames,
+                                const std::vector<cv::Mat> &capsules,
+                                ThreadPool &thread_pool,
+                                std::vector<CapsuleIndexRecord> *output_records)
+{
+    if (filenames.size() != capsules.size())
+    {
+        std::cerr << "Wrong number of capsules filenames. Expected " << capsules.size() << "." << std::endl;
+        return false;
+    }
+
+    // Describe the capsules in parallel
+    const size_t record_size = get_record_size(thumbnail_size_);
+    std::vector<uint8_t> records(capsules.size() * record_size);
+    std::vector<char> valid(capsules.size());
+    thread_pool.parallel_for(0, capsules.size(), [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; k++)
+        {
+            const int64_t mtime = archive_ ? 0 : get_mtime((fs::path(capsules_dir_) / filenames[k]).string());
+            valid[k] = fill_record(next_id_ + k, filenames[k], mtime, capsules[k], thumbnail_size_,
+                                   records.data() + k * record_size);
+        }
+    });
+    if (std::find(valid.cbegin(), valid.cend(), 0) != valid.cend())
+        return false;
+
+    std::ofstream index_file(index_path_, std::ios::binary | std::ios::app);
+    index_file.write(reinterpret_cast<const char *>(records.data()), records.size());
+    index_file.close();
+    if (!index_file)
+    {
+        std::cerr << "Unable to append to the capsule index " << index_path_ << std::endl;
+        return false;
+    }
+
+    // The records of the archive must be on disk before the pictures they come from are recorded as loaded
+    if (archive_ && !CapsuleWriter::sync_to_disk(index_path_))
+    {
+        std::cerr << "Unable to sync the capsule archive " << index_path_ << std::endl;
+        return false;
+    }
+    if (output_records)
+    {
+        output_records->resize(capsules.size());
+        for (size_t k = 0; k < capsules.size(); k++)
+            std::memcpy(&(*output_records)[k], records.data() + k * record_size, sizeof(CapsuleIndexRecord));
+    }
+    next_id_ += capsules.size();
+    return true;
+}
+
+bool CapsuleIndexWriter::remove(const std::vector<std::string> &filenames)
+{
+    if (!archive_ || filenames.empty())
+        return true;
+
+    std::fstream archive_file(index_path_, std::ios::binary | std::ios::in | std::ios::out);
+    const size_t record_size = get_record_size(thumbnail_size_);
+    const size_t n_records = (fs::file_size(index_path_) - sizeof(CapsuleIndexHeader)) / record_size;
+    const std::set<std::string> removed_filenames(filenames.cbegin(), filenames.cend());
+    char filename[sizeof(CapsuleIndexRecord::filename)];
+    const char no_filename[sizeof(filename)] = {};
+    for (size_t i = 0; i < n_records && archive_file; i++)
+    {
+        const std::streamoff offset = sizeof(CapsuleIndexHeader) + i * record_size +
+                                      offsetof(CapsuleIndexRecord, filename);
+        archive_file.seekg(offset);
+        archive_file.read(filename, sizeof(filename));
+        filename[sizeof(filename) - 1] = '\0';
+        if (removed_filenames.count(filename) == 0)
+            continue;
+        archive_file.seekp(offset);
+        archive_file.write(no_filename, sizeof(no_filename));
+    }
+    archive_file.close();
+    if (!archive_file)
+    {
+        std::cerr << "Unable to remove capsules from the archive " << index_path_ << std::endl;
+        return false;
+    }
+
+    // The removal must be on disk before the pictures of the capsules are dropped from the manifest
+    if (!CapsuleWriter::sync_to_disk(index_path_))
+    {
+        std::cerr << "Unable to sync the capsule archive " << index_path_ << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool CapsuleIndexWriter::compact()
+{
+    // Copy the remaining records to a new archive, which replaces the previous one atomically once it's on disk
+    const std::string tmp_path = index_path_ + ".tmp";
+    const size_t record_size = get_record_size(thumbnail_size_);
+    const size_t n_records = (fs::file_size(index_path_) - sizeof(CapsuleIndexHeader)) / record_size;
+    size_t n_kept = 0;
+    {
+        std::ifstream archive_file(index_path_, std::ios::binary);
+        std::ofstream compacted_file(tmp_path, std::ios::binary | std::ios::trunc);
+        std::vector<char> buffer(std::max(sizeof(CapsuleIndexHeader), record_size));
+        archive_file.read(buffer.data(), sizeof(CapsuleIndexHeader));
+        compacted_file.write(buffer.data(), sizeof(CapsuleIndexHeader));
+        for (size_t i = 0; i < n_records && archive_file; i++)
+        {
+            archive_file.read(buffer.data(), record_size);
+            if (reinterpret_cast<const CapsuleIndexRecord *>(buffer.data())->filename[0] == '\0')
+                continue;
+            compacted_file.write(buffer.data(), record_size);
+            n_kept++;
+        }
+        compacted_file.close();
+        if (!archive_file || !compacted_file)
+        {
+            std::cerr << "Unable to compact the capsule archive " << index_path_ << std::endl;
+            fs::remove(tmp_path);
+            return false;
+        }
+    }
+    if (!CapsuleWriter::sync_to_disk(tmp_path))
+    {
+        std::cerr << "Unable to sync the compacted capsule archive " << tmp_path << std::endl;
+        fs::remove(tmp_path);
+        return false;
+    }
+    fs::rename(tmp_path, index_path_);
+    if (!CapsuleWriter::sync_to_disk(capsules_dir_, true))
+    {
+        std::cerr << "Unable to sync the capsules directory " << capsules_dir_ << std::endl;
+        return false;
+    }
+    std::cout << "Compacted the capsule archive: " << n_records - n_kept << " removed capsules dropped." << std::endl;
+    return true;
+}
+
+CapsuleIndex::CapsuleIndex(const std::string &capsules_dir,
+                           int thumbnail_size) : capsules_dir_(capsules_dir),
+                                                 index_path_((fs::path(capsules_dir) / index_filename).string()),
+                                                 thumbnail_size_(thumbnail_size),
+                                                 record_size_(get_record_size(thumbnail_size)),
+                                                 records_(nullptr),
+                                                 n_records_(0),
+                                                 archive_(false)
+{
+}
+
+bool CapsuleIndex::load()
+{
+    if (fs::exists(fs::path(capsules_dir_) / archive_filename))
+        return load_archive();
+    archive_ = false;
+
+    std::vector<cv::String> paths;
+    cv::glob(capsules_dir_ + "/*.png", paths);
+
+    // Look for the images that are already indexed and haven't been modified since
+    map_index_file();
+    std::map<std::string, const uint8_t *> indexed_records;
+    uint32_t next_id = 0;
+    for (size_t i = 0; i < n_records_; i++)
+    {
+        const uint8_t *record = records_ + i * record_size_;
+        const CapsuleIndexRecord &header = *reinterpret_cast<const CapsuleIndexRecord *>(record);
+        indexed_records[header.filename] = record;
+        next_id = std::max(next_id, header.id + 1);
+    }
+
+    std::vector<std::string> filenames(paths.size());
+    std::vector<int64_t> mtimes(paths.size());
+    std::vector<const uint8_t *> valid_records(paths.size(), nullptr);
+    // The records don't have to follow the order of the glob, since the writer appends the capsules in the order of
+    // their extraction. The index is up to date if each image has a valid record, and there's no other record
+    bool up_to_date = (n_records_ == paths.size() && indexed_records.size() == n_records_);
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        filenames[i] = fs::path(paths[i]).filename().string();
+        mtimes[i] = get_mtime(paths[i]);
+        const auto it = indexed_records.find(filenames[i]);
+        if (it != indexed_records.end() &&
+            reinterpret_cast<const CapsuleIndexRecord *>(it->second)->mtime == mtimes[i])
+            valid_records[i] = it->second;
+        up_to_date = up_to_date && valid_records[i] != nullptr;
+    }
+
+    if (up_to_date)
+    {
+        std::cout << "Capsule index is up to date: " << n_records_ << " capsules." << std::endl;
+        return true;
+    }
+
+    // Rebuild the index, copying the valid records and decoding only the other images
+    std::vector<uint8_t> records(paths.size() * record_size_);
+    size_t n_records = 0;
+    size_t n_rescanned = 0;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        uint8_t *record = records.data() + n_records * record_size_;
+        if (valid_records[i])
+        {
+            std::memcpy(record, valid_records[i], record_size_);
+            n_records++;
+            continue;
+        }
+
+        const cv::Mat capsule = cv::imread(paths[i]);
+        if (capsule.empty())
+        {
+            std::cerr << "Fail to load the capsule " << paths[i] << std::endl;
+            continue;
+        }
+        if (fill_record(next_id, filenames[i], mtimes[i], capsule, thumbnail_size_, record))
+        {
+            next_id++;
+            n_records++;
+            n_rescanned++;
+        }
+    }
+    std::cout << "Capsule index: " << n_records - n_rescanned << " capsules up to date, "
+              << n_rescanned << " rescanned." << std::endl;
+
+    // Replace the index file atomically and map it again
+    unmap_index_file();
+    const std::string tmp_path = index_path_ + ".tmp";
+    {
+        std::ofstream index_file(tmp_path, std::ios::binary | std::ios::trunc);
+        const CapsuleIndexHeader header = make_header(thumbnail_size_, false);
+        index_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        index_file.write(reinterpret_cast<const char *>(records.data()), n_records * record_size_);
+        if (!index_file)
+        {
+            std::cerr << "Unable to write the capsule index " << tmp_path << std::endl;
+            return false;
+        }
+    }
+    fs::rename(tmp_path, index_path_);
+
+    if (!map_index_file() || n_records_ != n_records)
+    {
+        std::cerr << "Unable to map the capsule index " << index_path_ << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool CapsuleIndex::load_archive()
+{
+    const std::string archive_path = (fs::path(capsules_dir_) / archive_filename).string();
+    archive_ = true;
+    if (!map_index_file())
+    {
+        std::cerr << "Unable to map the capsule archive " << archive_path << std::endl;
+        return false;
+    }
+
+    // Skip the removed records
+    live_records_.clear();
+    for (size_t i = 0; i < n_records_; i++)
+        if (reinterpret_cast<const CapsuleIndexRecord *>(records_ + i * record_size_)->filename[0] != '\0')
+            live_records_.push_back(i);
+    std::cout << "Capsule archive: " << live_records_.size() << " capsules of " << thumbnail_size_ << "x"
+              << thumbnail_size_ << " pixels, " << n_records_ - live_records_.size() << " removed." << std::endl;
+    n_records_ = live_records_.size();
+    return true;
+}
+
+size_t CapsuleIndex::size() const
+{
+    return n_records_;
+}
+
+const uint8_t *CapsuleIndex::get_record_data(size_t i) const
+{
+    return records_ + (archive_ ? live_records_[i] : i) * record_size_;
+}
+
+const CapsuleIndexRecord &CapsuleIndex::get_record(size_t i) const
+{
+    return *reinterpret_cast<const CapsuleIndexRecord *>(get_record_data(i));
+}
+
+std::string CapsuleIndex::get_path(size_t i) const
+{
+    return (fs::path(capsules_dir_) / get_record(i).filename).string();
+}
+
+cv::Mat CapsuleIndex::get_thumbnail(size_t i) const
+{
+    if (thumbnail_size_ <= 0)
+        return cv::Mat();
+    uint8_t *pixels = const_cast<uint8_t *>(get_record_data(i) + sizeof(CapsuleIndexRecord));
+    return cv::Mat(thumbnail_size_, thumbnail_size_, CV_8UC3, pixels);
+}
+
+int CapsuleIndex::get_thumbnail_size() const
+{
+    return thumbnail_size_;
+}
+
+cv::Mat CapsuleIndex::get_image(size_t i) const
+{
+    return archive_ ? get_thumbnail(i) : cv::imread(get_path(i));
+}
+
+bool CapsuleIndex::is_archive() const
+{
+    return archive_;
+}
+
+bool CapsuleIndex::map_index_file()
+{
+    unmap_index_file();
+    const std::string path = archive_ ? (fs::path(capsules_dir_) / archive_filename).string() : index_path_;
+    if (!fs::exists(path) || fs::file_size(path) < sizeof(CapsuleIndexHeader))
+        return false;
+
+    try
+    {
+        file_mapping_ = bip::file_mapping(path.c_str(), bip::read_only);
+        mapped_region_ = bip::mapped_region(file_mapping_, bip::read_only);
+    }
+    catch (bip::interprocess_exception &e)
+    {
+        std::cerr << "Unable to map " << path << ": " << e.what() << std::endl;
+        return false;
+    }
+
+    // The capsules of an archive have the size given by its header
+    const uint8_t *data = static_cast<const uint8_t *>(mapped_region_.get_address());
+    const CapsuleIndexHeader &header = *reinterpret_cast<const CapsuleIndexHeader *>(data);
+    if (archive_ && std::memcmp(header.magic, archive_magic, sizeof(header.magic)) == 0)
+    {
+        thumbnail_size_ = header.thumbnail_size;
+        record_size_ = get_record_size(thumbnail_size_);
+    }
+    if (std::memcmp(header.magic, archive_ ? archive_magic : index_magic, sizeof(header.magic)) != 0 ||
+        header.version != index_version ||
+        header.thumbnail_size != static_cast<uint32_t>(thumbnail_size_) ||
+        header.record_size != record_size_)
+    {
+        // Outdated format, the whole directory will be indexed again
+        unmap_index_file();
+        return false;
+    }
+
+    records_ = data + sizeof(CapsuleIndexHeader);
+    n_records_ = (mapped_region_.get_size() - sizeof(CapsuleIndexHeader)) / record_size_;
+    return true;
+}
+
+void CapsuleIndex::unmap_index_file()
+{
+    mapped_region_ = bip::mapped_region();
+    file_mapping_ = bip::file_mapping();
+    records_ = nullptr;
+    n_records_ = 0;
+}
@@ -0,0 +1,141 @@
+/*********************************************************************************************************************
+ * File : capsule_writer.cpp                                                                                         *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <opencv2/highgui/highgui.hpp>
+#include <boost/filesystem.hpp>
+
+#include "capsule_writer.h"
+
+namespace fs = boost::filesystem;
+
+CapsuleWriter::CapsuleWriter(ThreadPool &thread_pool, size_t max_pending_images,
+                             int png_compression) : thread_pool_(thread_pool),
+                                                    max_pending_images_(std::max<size_t>(max_pending_images, 1)),
+                                                    png_params_{cv::IMWRITE_PNG_COMPRESSION,
+                                                                std::min(std::max(png_compression, 0), 9)},
+                                                    n_pending_images_(0),
+                                                    next_ticket_(0) {}
+
+CapsuleWriter::~CapsuleWriter()
+{
+    flush();
+}
+
+size_t CapsuleWriter::write(const std::vector<std::string> &paths, const std::vector<cv::Mat> &images)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    const size_t ticket = next_ticket_++;
+    PendingBatch &batch = pending_batches_[ticket];
+    for (const auto &path : paths)
+    {
+        const std::string directory = fs::path(path).parent_path().string();
+        if (std::find(batch.directories.begin(), batch.directories.end(), directory) == batch.directories.end())
+            batch.directories.push_back(directory);
+    }
+
+    for (size_t k = 0; k < std::min(paths.size(), images.size()); k++)
+    {
+        // Wait for room in the queue, so that the images don't pile up in memory if the disk is slower
+        image_written_.wait(lock, [this]() { return n_pending_images_ < max_pending_images_; });
+        n_pending_images_++;
+        batch.n_pending_images++;
+
+        const std::string path = paths[k];
+        const cv::Mat image = images[k];
+        thread_pool_.submit([this, ticket, path, image]() {
+            const bool written = write_image(path, image);
+            std::lock_guard<std::mutex> task_lock(mutex_);
+            PendingBatch &task_batch = pending_batches_[ticket];
+            task_batch.failed = task_batch.failed || !written;
+            task_batch.n_pending_images--;
+            n_pending_images_--;
+            image_written_.notify_all();
+        });
+    }
+    if (paths.size() != images.size())
+    {
+        std::cerr << "Got " << paths.size() << " paths for " << images.size() << " images." << std::endl;
+        batch.failed = true;
+    }
+    return ticket;
+}
+
+bool CapsuleWriter::flush(size_t ticket)
+{
+    std::vector<std::string> directories;
+    bool success = true;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        image_written_.wait(lock, [this, ticket]() {
+            for (auto it = pending_batches_.begin(); it != pending_batches_.end() && it->first <= ticket; ++it)
+                if (it->second.n_pending_images > 0)
+                    return false;
+            return true;
+        });
+
+        // Release the batches, gathering the directories of their files
+        while (!pending_batches_.empty() && pending_batches_.begin()->first <= ticket)
+        {
+            const PendingBatch &batch = pending_batches_.begin()->second;
+            success = success && !batch.failed;
+            for (const auto &directory : batch.directories)
+                if (std::find(directories.begin(), directories.end(), directory) == directories.end())
+                    directories.push_back(directory);
+            pending_batches_.erase(pending_batches_.begin());
+        }
+    }
+
+    // The files are only durable once their entries in the directories are
+    for (const auto &directory : directories)
+    {
+        if (!sync_to_disk(directory.empty() ? "." : directory, true))
+        {
+            std::cerr << "Unable to sync the directory " << directory << std::endl;
+            success = false;
+        }
+    }
+    return success;
+}
+
+bool CapsuleWriter::flush()
+{
+    size_t last_ticket;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (next_ticket_ == 0)
+            return true;
+        last_ticket = next_ticket_ - 1;
+    }
+    return flush(last_ticket);
+}
+
+bool CapsuleWriter::sync_to_disk(const std::string &path, bool directory)
+{
+    const int fd = ::open(path.c_str(), directory ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+    if (fd < 0)
+        return false;
+    const bool synced = (::fsync(fd) == 0);
+    return (::close(fd) == 0) && synced;
+}
+
+bool CapsuleWriter::write_image(const std::string &path, const cv::Mat &image) const
+{
+    if (!cv::imwrite(path, image, png_params_))
+    {
+        std::cerr << "Unable to write the image " << path << std::endl;
+        return false;
+    }
+    if (!sync_to_disk(path, false))
+    {
+        std::cerr << "Unable to sync the image " << path << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -4,71 +4,159 @@
  * 2020 Thomas Rouch                                                                                                 *
  *********************************************************************************************************************/
 
-#include <future>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
 
 #include "timer.h"
+#include "capsule_color_index.h"
 #include "capsules_solver.h"
+#include "color_distance.h"
+#include "error_diffusion_objective.h"
+#include "gale_shapley/capacitated_matching.h"
+#include "png_band_writer.h"
+#include "sprite_atlas.h"
 
-CapsulesSolver::CapsulesSolver() {}
+namespace
+{
+/// Largest weighted color distance between two BGR colors: sqrt(3 + 4 + 2) * 255
+const float max_color_error = 765.f;
+
+/// Largest distance between two Lab sectors descriptors, since the weights sum to 1: sqrt(100^2 + 2 * 255^2)
+const float max_lab_sectors_error = 375.f;
+} // namespace
+
+CapsulesSolver::CapsulesSolver(ThreadPool &thread_pool,
+                               const CapsulesSolverOptions &options) : thread_pool_(thread_pool),
+                                                                       options_(options) {}
 
 bool CapsulesSolver::solve(const cv::Mat &img, const std::string &capsules_dir, int n_rows)
 {
     // Extract circle cutouts in the input image
-    CircleGridPattern circle_grid(img.cols, img.rows, n_rows);
+    CircleGridPattern circle_grid(img.cols, img.rows, n_rows, thread_pool_);
     std::vector<cv::Mat> cutouts;
     if (!extract_and_display_cutouts(circle_grid, img, cutouts))
         return false;
 
-    // Find reference capsules paths
-    std::vector<cv::String> ref_capsules_paths;
-    cv::glob(capsules_dir + "/*.png", ref_capsules_paths);
-    std::cout << "Found " << ref_capsules_paths.size() << " reference capsules." << std::endl;
-    if (ref_capsules_paths.size() < cutouts.size())
+    // Load the descriptors of the reference capsules, only decoding the images that aren't indexed yet
+    CapsuleIndex capsule_index(capsules_dir);
+    {
+        Timer timer("Load capsule index", Timer::MS);
+        if (!capsule_index.load())
+        {
+            std::cerr << "Failed to load the capsule index" << std::endl;
+            return false;
+        }
+    }
+    std::cout << "Found " << capsule_index.size() << " reference capsules." << std::endl;
+    if (capsule_index.size() < cutouts.size())
     {
         std::cerr << "Not enough reference capsules. Needs at least " << cutouts.size() << "." << std::endl;
         return false;
     }
 
-    // Compare the reference capsules to the cutouts of the input image
-    std::vector<std::vector<double>> errors;
+    // Describe the cells the same way as the capsules, directly in the image
+    std::vector<CapsuleDescriptor> cutouts_descriptors;
     {
-        Timer timer("Compute difference scores", Timer::MS);
-        std::cout << "Start comparing images..." << std::endl;
-        if (!compute_errors_matrix_multithreaded(ref_capsules_paths, cutouts, errors))
-        {
-            std::cerr << "Failed" << std::endl;
+        Timer timer("Describe cutouts", Timer::MS);
+        if (!circle_grid.describe_cells(img, cutouts_descriptors))
             return false;
-        }
     }
-    std::cout << "Done" << std::endl;
 
-    // Solve
-    std::cout << "Start finding the optimal matches..." << std::endl;
-    GaleShapleyAlgorithm algo;
+    // Discard the capsules whose colors are too far from the image
+    std::vector<size_t> capsule_ids;
+    {
+        Timer timer("Select candidate capsules", Timer::MS);
+        select_capsules(capsule_index, cutouts_descriptors, capsule_ids);
+    }
+    std::cout << "Kept " << capsule_ids.size() << " candidate capsules." << std::endl;
+
+    // Match the capsules to the cells
+    std::cout << "Color distance kernel: " << get_color_distance_kernel_name(get_best_color_distance_kernel())
+              << std::endl;
     std::vector<size_t> matches;
+    if (!match(capsule_index, capsule_ids, cutouts_descriptors, circle_grid.get_rows(), circle_grid.get_cols(),
+               matches))
     {
-        Timer timer("Find the optimal matching", Timer::MS);
-        if (!algo.solve(errors, matches))
+        std::cerr << "Failed" << std::endl;
+        return false;
+    }
+    if (options_.refine_seconds > 0)
+    {
+        Timer timer("Refine the matching", Timer::MS);
+        std::vector<std::vector<size_t>> cell_neighbours;
+        if (options_.dithering > 0)
+            circle_grid.get_neighbours(cell_neighbours);
+        refine_matching(capsule_index, capsule_ids, cutouts_descriptors, cell_neighbours, matches);
+    }
+    std::vector<float> final_errors;
+    compute_matching_errors(capsule_index, capsule_ids, cutouts_descriptors, matches, final_errors);
+    const double total_error = std::accumulate(final_errors.cbegin(), final_errors.cend(), 0.0);
+    std::cout << "Done. Total error: " << total_error << std::endl;
+
+    // Measure what the regions cost, when the whole grid can be solved at once as well
+    if (options_.region_cells > 0 && options_.compare_flat)
+    {
+        std::vector<size_t> flat_matches;
+        std::vector<float> flat_errors;
+        if (!solve_at_once(capsule_index, capsule_ids, cutouts_descriptors, flat_matches))
         {
             std::cerr << "Failed" << std::endl;
             return false;
         }
+        compute_matching_errors(capsule_index, capsule_ids, cutouts_descriptors, flat_matches, flat_errors);
+        const double flat_error = std::accumulate(flat_errors.cbegin(), flat_errors.cend(), 0.0);
+        std::cout << "Total error solving at once: " << flat_error << ". Gap of the regions: "
+                  << 100 * (total_error - flat_error) / std::max(1e-9, flat_error) << "%" << std::endl;
     }
-    std::cout << "Done" << std::endl;
 
-    // Display solution
+    // Display solution, the capsules being resized once to the size of the disks
     std::cout << "Start generating the optimal image..." << std::endl;
+    SpriteAtlas sprite_atlas(capsule_index, thread_pool_);
+    std::vector<size_t> optim_capsule_ids(matches.size());
+    for (size_t i = 0; i < matches.size(); i++)
+        optim_capsule_ids[i] = capsule_ids[matches[i]];
     cv::Mat optim_display;
     {
         Timer timer("Generate optimal image", Timer::MS);
         std::vector<cv::Mat> optim_capsules;
-        optim_capsules.resize(cutouts.size());
-        for (size_t i = 0; i < cutouts.size(); i++)
+        if (!sprite_atlas.get_sprites(optim_capsule_ids, circle_grid.get_cutout_size().width, optim_capsules) ||
+            !circle_grid.generate_image(optim_capsules, optim_display))
+            return false;
+    }
+    if (options_.render_width > 0)
+    {
+        Timer timer("Generate print image", Timer::MS);
+        const int render_height = static_cast<int>(std::lround(static_cast<double>(img.rows) * options_.render_width /
+                                                               img.cols));
+        CircleGridPattern render_grid(options_.render_width, render_height, n_rows, thread_pool_);
+        if (render_grid.get_cols() != circle_grid.get_cols())
         {
-            const int j = matches[i];
-            optim_capsules[i] = cv::imread(ref_capsules_paths[j]);
+            std::cerr << "The print grid doesn't have the same number of columns as the image grid." << std::endl;
+            return false;
+        }
+
+        // Stream it band by band to the file, the capsules being resized on the fly so that the memory doesn't
+        // depend on the resolution
+        const bool use_thumbnails = capsule_index.get_thumbnail_size() >= render_grid.get_cutout_size().width;
+        const auto get_capsule = [&](size_t cell) {
+            const size_t j = optim_capsule_ids[cell];
+            return use_thumbnails ? capsule_index.get_thumbnail(j) : capsule_index.get_image(j);
+        };
+        PngBandWriter png_writer;
+        if (!png_writer.open("/tmp/CapsulesImage_print.png", render_grid.get_image_width(),
+                             render_grid.get_image_height()) ||
+            !render_grid.render_bands(get_capsule, 0,
+                                      [&png_writer](const cv::Mat &band) { return png_writer.write_rows(band); }) ||
+            !png_writer.close())
+        {
+            std::cerr << "Failed to write the print image" << std::endl;
+            return false;
         }
-        circle_grid.generate_image(optim_capsules, optim_display);
     }
     std::cout << "Done" << std::endl;
     cv::imwrite("/tmp/CapsulesImage.png", optim_display);
@@ -80,13 +168,6 @@ bool CapsulesSolver::solve(const cv::Mat &img, const std::string &capsules_dir,
     cv::Mat error_map, difficult_map;
     {
         Timer timer("Compute the error map", Timer::MS);
-        std::vector<double> final_errors;
-        final_errors.reserve(cutouts.size());
-        for (size_t i = 0; i < cutouts.size(); i++)
-        {
-            const int j = matches[i];
-            final_errors.push_back(errors[j][i]);
-        }
         auto it_minmax = std::minmax_element(final_errors.cbegin(), final_errors.cend());
         const double error_min = *(it_minmax.first);
         const double error_max = *(it_minmax.second);
@@ -122,6 +203,19 @@ bool CapsulesSolver::solve(const cv::Mat &img, const std::string &capsules_dir,
     cv::imshow("Error map", error_map);
     cv::imshow("Colors badly rendered", difficult_map);
     cv::waitKey();
+    return true;
+}
+
+bool CapsulesSolver::match(const CapsuleIndex &capsule_index,
+                           const std::vector<size_t> &capsule_ids,
+                           const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                           size_t grid_rows, size_t grid_cols,
+                           std::vector<size_t> &output_matches)
+{
+    if (options_.region_cells == 0)
+        return solve_at_once(capsule_index, capsule_ids, cutouts_descriptors, output_matches);
+    Timer timer("Solve region by region", Timer::MS);
+    return solve_by_regions(capsule_index, capsule_ids, cutouts_descriptors, grid_rows, grid_cols, output_matches);
 }
 
 bool CapsulesSolver::extract_and_display_cutouts(const CircleGridPattern &circle_grid,
@@ -139,77 +233,704 @@ bool CapsulesSolver::extract_and_display_cutouts(const CircleGridPattern &circle
     return true;
 }
 
-bool CapsulesSolver::compute_errors_matrix(const std::vector<cv::String> &ref_capsules_paths,
-                                           const std::vector<cv::Mat> &cutouts,
-                                           std::vector<std::vector<double>> &output_errors)
+void CapsulesSolver::select_capsules(const CapsuleIndex &capsule_index,
+                                     const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                                     std::vector<size_t> &output_capsule_ids)
 {
-    output_errors.reserve(ref_capsules_paths.size());
+    output_capsule_ids.clear();
+    const size_t n_cutouts = cutouts_descriptors.size();
+    size_t k = options_.n_nearest_capsules;
+    if (k == 0 || k * n_cutouts >= capsule_index.size())
+    {
+        output_capsule_ids.resize(capsule_index.size());
+        std::iota(output_capsule_ids.begin(), output_capsule_ids.end(), 0);
+        return;
+    }
+
+    // Flag the capsules that are close to at least one cutout
+    std::vector<size_t> all_ids(capsule_index.size());
+    std::iota(all_ids.begin(), all_ids.end(), 0);
+    std::vector<bool> selected(capsule_index.size());
+    std::vector<std::vector<size_t>> nearest;
+    while (true)
+    {
+        find_nearest_capsules(capsule_index, all_ids, cutouts_descriptors, k, nearest);
+        std::fill(selected.begin(), selected.end(), false);
+        for (const auto &cell_nearest : nearest)
+            for (size_t i : cell_nearest)
+                selected[i] = true;
+
+        for (size_t i = 0; i < selected.size(); i++)
+            if (selected[i])
+                output_capsule_ids.push_back(i);
+        if (output_capsule_ids.size() >= n_cutouts)
+            return;
+
+        // Not enough distinct capsules, e.g. on a flat image
+        output_capsule_ids.clear();
+        k *= 2;
+    }
+}
 
-    std::vector<cv::Scalar> cutouts_means;
-    cutouts_means.reserve(cutouts.size());
-    for (const auto &cutout : cutouts)
-        cutouts_means.emplace_back(cv::mean(cutout));
+void CapsulesSolver::find_nearest_capsules(const CapsuleIndex &capsule_index,
+                                           const std::vector<size_t> &capsule_ids,
+                                           const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                                           size_t k,
+                                           std::vector<std::vector<size_t>> &output_nearest)
+{
+    const size_t n_capsules = capsule_ids.size();
+    const size_t n_cells = cutouts_descriptors.size();
+    output_nearest.assign(n_cells, std::vector<size_t>());
 
-    cv::Mat ref_caps;
-    double output_error;
-    for (const auto &ref_path : ref_capsules_paths)
+    // The weighted BGR distance is the one of the 3D color grid
+    if (options_.metric == CapsuleDescriptor::MEAN_BGR)
     {
-        output_errors.emplace_back();
-        ref_caps = cv::imread(ref_path);
-        cv::Scalar ref_mean = cv::mean(ref_caps);
-        for (const auto &cutout_mean : cutouts_means)
+        CapsuleColorIndex color_index;
+        for (size_t i = 0; i < n_capsules; i++)
+            color_index.insert(i, capsule_index.get_record(capsule_ids[i]).descriptor.mean_bgr);
+        thread_pool_.parallel_for(0, n_cells, [&](size_t begin, size_t end) {
+            for (size_t j = begin; j < end; j++)
+                color_index.find_nearest(cutouts_descriptors[j].mean_bgr, k, output_nearest[j]);
+        });
+        return;
+    }
+
+    // Other metrics have too many dimensions for a grid, so the features are scanned linearly
+    const int n_dims = get_feature_size();
+    std::vector<float> capsule_features(n_capsules * n_dims);
+    for (size_t i = 0; i < n_capsules; i++)
+        get_feature(capsule_index.get_record(capsule_ids[i]).descriptor, &capsule_features[i * n_dims]);
+    const size_t n_nearest = std::min(k, n_capsules);
+    thread_pool_.parallel_for(0, n_cells, [&](size_t begin, size_t end) {
+        std::vector<float> cell_feature(n_dims);
+        std::vector<std::pair<float, size_t>> distances(n_capsules);
+        for (size_t j = begin; j < end; j++)
         {
-            const cv::Scalar diff_means = ref_mean - cv::mean(cutout_mean);
-            const double output_error = std::sqrt(diff_means[0] * diff_means[0] + diff_means[1] * diff_means[1] + diff_means[2] * diff_means[2]);
-            output_errors.back().emplace_back(output_error);
+            get_feature(cutouts_descriptors[j], cell_feature.data());
+            for (size_t i = 0; i < n_capsules; i++)
+            {
+                float distance2 = 0;
+                for (int d = 0; d < n_dims; d++)
+                {
+                    const float diff = capsule_features[i * n_dims + d] - cell_feature[d];
+                    distance2 += diff * diff;
+                }
+                distances[i] = std::make_pair(distance2, i);
+            }
+            std::partial_sort(distances.begin(), distances.begin() + n_nearest, distances.end());
+            output_nearest[j].resize(n_nearest);
+            for (size_t n = 0; n < n_nearest; n++)
+                output_nearest[j][n] = distances[n].second;
         }
+    });
+}
+
+bool CapsulesSolver::compute_errors_matrix_multithreaded(const CapsuleIndex &capsule_index,
+                                                         const std::vector<size_t> &capsule_ids,
+                                                         const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                                                         CostMatrix &output_errors,
+                                                         bool verbose)
+{
+    // Both metrics are weighted Euclidean distances, the BGR one having a dedicated kernel
+    const bool lab_sectors = (options_.metric == CapsuleDescriptor::LAB_SECTORS);
+    const size_t n_lab_values = 3 * CapsuleDescriptor::n_regions;
+    ColorsSoA cutouts_means;
+    DescriptorsSoA cutouts_labs(lab_sectors ? n_lab_values : 0);
+    std::vector<float> lab_weights;
+    for (int k = 0; k < CapsuleDescriptor::n_regions; k++)
+        lab_weights.insert(lab_weights.end(), 3, CapsuleDescriptor::region_weights[k]);
+    cutouts_means.reserve(cutouts_descriptors.size());
+    cutouts_labs.reserve(cutouts_descriptors.size());
+    for (const auto &descriptor : cutouts_descriptors)
+    {
+        if (lab_sectors)
+            cutouts_labs.push_back(&descriptor.regions_lab[0][0]);
+        else
+            cutouts_means.push_back(descriptor.mean_bgr[0], descriptor.mean_bgr[1], descriptor.mean_bgr[2]);
+    }
+
+    // The matrix is preallocated, so that each chunk of capsules writes its own rows without locking
+    const bool take_sqrt = !options_.squared_errors;
+    const float max_distance = lab_sectors ? max_lab_sectors_error : max_color_error;
+    const float max_error = take_sqrt ? max_distance : max_distance * max_distance;
+    const size_t n_capsules = capsule_ids.size();
+    const size_t n_cutouts = cutouts_descriptors.size();
+    const size_t budget = options_.memory_budget_mb * 1024 * 1024;
+    const size_t matrix_size = CostMatrix::get_size_in_bytes(n_capsules, n_cutouts, options_.cost_storage);
+    size_t tile_rows = n_capsules;
+    if (budget == 0 || 2 * matrix_size <= budget)
+        output_errors.create(n_capsules, n_cutouts, options_.cost_storage, max_error);
+    else
+    {
+        // Only a tile of rows is resident at once, the rest lives in the scratch file
+        if (!output_errors.create_mapped(n_capsules, n_cutouts, options_.scratch_directory, options_.cost_storage,
+                                         max_error))
+            return false;
+        tile_rows = std::max<size_t>(1, budget / 2 / CostMatrix::get_size_in_bytes(1, n_cutouts,
+                                                                                     options_.cost_storage));
+        if (verbose)
+            std::cout << "Errors matrix mapped to a scratch file in " << options_.scratch_directory
+                      << ", filled by tiles of " << tile_rows << " rows." << std::endl;
+    }
+    for (size_t tile_begin = 0; tile_begin < n_capsules; tile_begin += tile_rows)
+    {
+        const size_t tile_end = std::min(n_capsules, tile_begin + tile_rows);
+        thread_pool_.parallel_for(tile_begin, tile_end, [&](size_t begin, size_t end) {
+            std::vector<float> errors(n_cutouts);
+            for (size_t i = begin; i < end; i++)
+            {
+                // Float rows are written in place, quantized ones go through a temporary row
+                const bool in_place = (output_errors.get_storage() == CostMatrix::FLOAT32);
+                float *row = in_place ? output_errors.get_float_row(i) : errors.data();
+                const CapsuleDescriptor &ref = capsule_index.get_record(capsule_ids[i]).descriptor;
+                if (lab_sectors)
+                    compute_weighted_descriptor_distances(&ref.regions_lab[0][0], lab_weights.data(), cutouts_labs,
+                                                          row, take_sqrt);
+                else
+                    compute_weighted_color_distances(ref.mean_bgr, cutouts_means, row, take_sqrt);
+                if (!in_place)
+                    output_errors.set_row(i, row);
+            }
+        });
+        output_errors.release_rows(tile_begin, tile_end);
+    }
+    return true;
+}
+
+bool CapsulesSolver::solve_at_once(const CapsuleIndex &capsule_index,
+                                   const std::vector<size_t> &capsule_ids,
+                                   const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                                   std::vector<size_t> &output_matches)
+{
+    std::vector<size_t> capsule_positions(capsule_ids.size());
+    std::iota(capsule_positions.begin(), capsule_positions.end(), 0);
+    std::vector<size_t> cells(cutouts_descriptors.size());
+    std::iota(cells.begin(), cells.end(), 0);
+
+    Timer timer("Compute difference scores and find the optimal matching", Timer::MS);
+    CostMatrix errors;
+    if (!solve_subproblem(capsule_index, capsule_ids, cutouts_descriptors, capsule_positions, cells, true, errors,
+                          output_matches))
+        return false;
+    std::cout << "Errors matrix: " << errors.rows() << "x" << errors.cols() << ", "
+              << errors.get_size_in_bytes() / (1024 * 1024) << " MB." << std::endl;
+    return true;
+}
+
+bool CapsulesSolver::solve_by_regions(const CapsuleIndex &capsule_index,
+                                      const std::vector<size_t> &capsule_ids,
+                                      const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                                      size_t grid_rows, size_t grid_cols,
+                                      std::vector<size_t> &output_matches)
+{
+    const size_t n_capsules = capsule_ids.size();
+    const size_t n_cells = cutouts_descriptors.size();
+
+    // Square regions of the grid
+    const size_t block = std::max<size_t>(1, std::lround(std::sqrt(double(options_.region_cells))));
+    const size_t n_region_rows = (grid_rows + block - 1) / block;
+    const size_t n_region_cols = (grid_cols + block - 1) / block;
+    const size_t n_regions = n_region_rows * n_region_cols;
+    std::vector<size_t> cell_regions(n_cells);
+    for (size_t j = 0; j < n_cells; j++)
+        cell_regions[j] = (j / grid_cols / block) * n_region_cols + (j % grid_cols) / block;
+    std::cout << "Solving " << n_regions << " regions of up to " << block << "x" << block << " cells." << std::endl;
+
+    // Descriptors as vectors in which the metric is the Euclidean distance
+    const int n_dims = get_feature_size();
+    cv::Mat capsule_features(n_capsules, n_dims, CV_32F);
+    cv::Mat cell_features(n_cells, n_dims, CV_32F);
+    for (size_t i = 0; i < n_capsules; i++)
+        get_feature(capsule_index.get_record(capsule_ids[i]).descriptor, capsule_features.ptr<float>(i));
+    for (size_t j = 0; j < n_cells; j++)
+        get_feature(cutouts_descriptors[j], cell_features.ptr<float>(j));
+    const auto distance = [n_dims](const float *a, const float *b) {
+        float distance2 = 0;
+        for (int d = 0; d < n_dims; d++)
+            distance2 += (a[d] - b[d]) * (a[d] - b[d]);
+        return std::sqrt(distance2);
+    };
+
+    // Color clusters of the capsules
+    const size_t capsules_per_cluster = 256;
+    const size_t max_clusters = 256;
+    const int n_clusters = std::min(n_capsules, std::max<size_t>(8, std::min(max_clusters,
+                                                                                n_capsules / capsules_per_cluster)));
+    cv::Mat labels, centers;
+    cv::setRNGSeed(0);
+    cv::kmeans(capsule_features, n_clusters, labels,
+               cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 20, 0.01), 1, cv::KMEANS_PP_CENTERS,
+               centers);
+    std::vector<std::vector<size_t>> cluster_capsules(n_clusters);
+    for (size_t i = 0; i < n_capsules; i++)
+        cluster_capsules[labels.at<int>(i)].push_back(i);
+
+    // Cells are distributed among the clusters, within the number of capsules of each cluster
+    std::vector<size_t> cell_clusters;
+    {
+        CostMatrix cluster_errors(n_cells, n_clusters);
+        thread_pool_.parallel_for(0, n_cells, [&](size_t begin, size_t end) {
+            std::vector<float> row(n_clusters);
+            for (size_t j = begin; j < end; j++)
+            {
+                for (int c = 0; c < n_clusters; c++)
+                    row[c] = distance(cell_features.ptr<float>(j), centers.ptr<float>(c));
+                cluster_errors.set_row(j, row.data());
+            }
+        });
+        std::vector<size_t> capacities(n_clusters);
+        for (int c = 0; c < n_clusters; c++)
+            capacities[c] = cluster_capsules[c].size();
+        if (!solve_capacitated_matching(cluster_errors, capacities, cell_clusters))
+            return false;
+    }
+    std::cout << "Cells distributed among " << n_clusters << " color clusters." << std::endl;
+
+    // Number of cells of each region assigned to each cluster, and their mean feature
+    std::vector<size_t> demands(n_regions * n_clusters, 0);
+    std::vector<float> demand_means(n_regions * n_clusters * n_dims, 0.f);
+    for (size_t j = 0; j < n_cells; j++)
+    {
+        const size_t k = cell_regions[j] * n_clusters + cell_clusters[j];
+        demands[k]++;
+        for (int d = 0; d < n_dims; d++)
+            demand_means[k * n_dims + d] += cell_features.ptr<float>(j)[d];
     }
+    for (size_t k = 0; k < demands.size(); k++)
+        for (int d = 0; d < n_dims; d++)
+            demand_means[k * n_dims + d] /= std::max<size_t>(1, demands[k]);
+
+    // Each cluster gives its capsules closest to the cells of each region, and then spare ones
+    std::vector<std::vector<size_t>> region_capsules(n_regions);
+    std::vector<std::vector<std::pair<size_t, size_t>>> cluster_shares(n_clusters); ///< (region, capsule position)
+    std::atomic<bool> success(true);
+    thread_pool_.parallel_for(0, n_clusters, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++)
+        {
+            std::vector<size_t> regions;
+            for (size_t r = 0; r < n_regions; r++)
+                if (demands[r * n_clusters + c] > 0)
+                    regions.push_back(r);
+            if (regions.empty())
+                continue;
+
+            std::vector<size_t> members = cluster_capsules[c];
+            for (const bool spare : {false, true})
+            {
+                // The last target gathers the capsules that aren't given, every other target being preferred to it
+                CostMatrix share_errors(members.size(), regions.size() + 1);
+                std::vector<float> row(regions.size() + 1, std::numeric_limits<float>::max());
+                for (size_t i = 0; i < members.size(); i++)
+                {
+                    for (size_t k = 0; k < regions.size(); k++)
+                        row[k] = distance(capsule_features.ptr<float>(members[i]),
+                                          &demand_means[(regions[k] * n_clusters + c) * n_dims]);
+                    share_errors.set_row(i, row.data());
+                }
+                std::vector<size_t> capacities(regions.size() + 1);
+                for (size_t k = 0; k < regions.size(); k++)
+                {
+                    const size_t demand = demands[regions[k] * n_clusters + c];
+                    capacities[k] = spare ? static_cast<size_t>(std::ceil(options_.region_slack * demand)) : demand;
+                }
+                capacities.back() = members.size();
+                std::vector<size_t> targets;
+                if (!solve_capacitated_matching(share_errors, capacities, targets))
+                {
+                    success = false;
+                    return;
+                }
+                std::vector<size_t> left;
+                for (size_t i = 0; i < members.size(); i++)
+                {
+                    if (targets[i] < regions.size())
+                        cluster_shares[c].emplace_back(regions[targets[i]], members[i]);
+                    else
+                        left.push_back(members[i]);
+                }
+                members.swap(left);
+            }
+        }
+    });
+    if (!success)
+        return false;
+    for (const auto &shares : cluster_shares)
+        for (const auto &share : shares)
+            region_capsules[share.first].push_back(share.second);
+
+    // Regions are solved independently and concurrently, so their solvers are silent and only a summary is printed
+    std::vector<std::vector<size_t>> region_cells(n_regions);
+    for (size_t j = 0; j < n_cells; j++)
+        region_cells[cell_regions[j]].push_back(j);
+    output_matches.assign(n_cells, 0);
+    std::vector<std::vector<size_t>> spare_capsules(n_regions);
+    std::vector<double> region_errors(n_regions, 0.0);
+    std::vector<size_t> region_matrix_sizes(n_regions, 0);
+    std::atomic<size_t> n_mapped_regions(0);
+    thread_pool_.parallel_for(0, n_regions, [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end && success; r++)
+        {
+            if (region_cells[r].empty())
+                continue;
+            CostMatrix errors;
+            std::vector<size_t> matches;
+            if (!solve_subproblem(capsule_index, capsule_ids, cutouts_descriptors, region_capsules[r],
+                                  region_cells[r], false, errors, matches))
+            {
+                success = false;
+                return;
+            }
+            region_matrix_sizes[r] = errors.get_size_in_bytes();
+            if (errors.is_mapped())
+                n_mapped_regions++;
+            std::vector<char> used(region_capsules[r].size(), 0);
+            for (size_t k = 0; k < matches.size(); k++)
+            {
+                output_matches[region_cells[r][k]] = region_capsules[r][matches[k]];
+                region_errors[r] += errors(matches[k], k);
+                used[matches[k]] = 1;
+            }
+            for (size_t i = 0; i < used.size(); i++)
+                if (!used[i])
+                    spare_capsules[r].push_back(region_capsules[r][i]);
+        }
+    }, 1);
+    if (!success)
+        return false;
+    std::cout << "Regions solved: total error " << std::accumulate(region_errors.cbegin(), region_errors.cend(), 0.0)
+              << ", errors matrices of up to "
+              << *std::max_element(region_matrix_sizes.cbegin(), region_matrix_sizes.cend()) / (1024 * 1024)
+              << " MB";
+    if (n_mapped_regions > 0)
+        std::cout << ", " << n_mapped_regions << " of them mapped to scratch files";
+    std::cout << "." << std::endl;
+
+    // Bands along the borders between neighbouring regions are solved again, with the spare capsules of both sides
+    const size_t band = std::min<size_t>(2, block);
+    size_t n_borders = 0, n_improved = 0;
+    double gain = 0;
+    for (size_t r = 0; r < n_regions; r++)
+        for (const bool vertical_border : {true, false})
+        {
+            const size_t region_row = r / n_region_cols, region_col = r % n_region_cols;
+            if ((vertical_border && region_col + 1 == n_region_cols) ||
+                (!vertical_border && region_row + 1 == n_region_rows))
+                continue;
+            const size_t neighbour = vertical_border ? r + 1 : r + n_region_cols;
+
+            // Cells of both regions within the band around the border
+            std::vector<size_t> cells;
+            const size_t border = vertical_border ? (region_col + 1) * block : (region_row + 1) * block;
+            for (const size_t region : {r, neighbour})
+                for (const size_t j : region_cells[region])
+                {
+                    const size_t coordinate = vertical_border ? j % grid_cols : j / grid_cols;
+                    if (coordinate + band >= border && coordinate < border + band)
+                        cells.push_back(j);
+                }
+            if (cells.empty())
+                continue;
+            n_borders++;
+
+            // Current capsules of the cells first, so that the current solution is the diagonal
+            std::vector<size_t> positions;
+            std::vector<size_t> origins; ///< Region getting back each capsule if it becomes spare
+            for (const size_t j : cells)
+            {
+                positions.push_back(output_matches[j]);
+                origins.push_back(cell_regions[j]);
+            }
+            for (const size_t region : {r, neighbour})
+                for (const size_t i : spare_capsules[region])
+                {
+                    positions.push_back(i);
+                    origins.push_back(region);
+                }
+
+            CostMatrix errors;
+            std::vector<size_t> matches;
+            if (!solve_subproblem(capsule_index, capsule_ids, cutouts_descriptors, positions, cells, false, errors,
+                                  matches))
+                return false;
+            double old_error = 0, new_error = 0;
+            for (size_t k = 0; k < cells.size(); k++)
+            {
+                old_error += errors(k, k);
+                new_error += errors(matches[k], k);
+            }
+            if (new_error >= old_error)
+                continue;
+
+            n_improved++;
+            gain += old_error - new_error;
+            std::vector<char> used(positions.size(), 0);
+            for (size_t k = 0; k < cells.size(); k++)
+            {
+                output_matches[cells[k]] = positions[matches[k]];
+                used[matches[k]] = 1;
+            }
+            spare_capsules[r].clear();
+            spare_capsules[neighbour].clear();
+            for (size_t i = 0; i < positions.size(); i++)
+                if (!used[i])
+                    spare_capsules[origins[i]].push_back(positions[i]);
+        }
+    std::cout << "Borders refined: " << n_improved << " out of " << n_borders << ", total error -" << gain << "."
+              << std::endl;
     return true;
 }
 
-bool CapsulesSolver::compute_errors_matrix_multithreaded(const std::vector<cv::String> &ref_capsules_paths,
-                                                         const std::vector<cv::Mat> &cutouts,
-                                                         std::vector<std::vector<double>> &output_errors)
+bool CapsulesSolver::solve_subproblem(const CapsuleIndex &capsule_index,
+                                      const std::vector<size_t> &capsule_ids,
+                                      const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                                      const std::vector<size_t> &capsule_positions,
+                                      const std::vector<size_t> &cells,
+                                      bool verbose,
+                                      CostMatrix &output_errors,
+                                      std::vector<size_t> &output_matches)
+{
+    std::vector<size_t> ids(capsule_positions.size());
+    for (size_t i = 0; i < ids.size(); i++)
+        ids[i] = capsule_ids[capsule_positions[i]];
+    std::vector<CapsuleDescriptor> descriptors(cells.size());
+    for (size_t k = 0; k < cells.size(); k++)
+        descriptors[k] = cutouts_descriptors[cells[k]];
+    if (!compute_errors_matrix_multithreaded(capsule_index, ids, descriptors, output_errors, verbose))
+        return false;
+
+    // The matrix takes at most half of the budget, the other half goes to the Gale-Shapley preference lists, or to
+    // the rows of the mapped matrix scanned at once by the auction
+    const size_t budget = options_.memory_budget_mb * 1024 * 1024;
+    size_t n_candidates = options_.n_candidates;
+    if (budget > 0 && options_.assignment_method == AssignmentSolver::GALE_SHAPLEY)
+    {
+        // The preference lists take 8 bytes per ranked cell
+        const size_t max_candidates = std::max<size_t>(1, budget / 2 / (8 * output_errors.rows()));
+        if ((n_candidates == 0 || n_candidates > max_candidates) && max_candidates < output_errors.cols())
+        {
+            n_candidates = max_candidates;
+            if (verbose)
+                std::cout << "Capsules rank " << n_candidates << " cells at once to fit in the memory budget."
+                          << std::endl;
+        }
+    }
+    std::unique_ptr<AssignmentSolver> algo =
+        AssignmentSolver::create(options_.assignment_method, thread_pool_, n_candidates, budget / 2);
+    algo->set_verbose(verbose);
+    return algo->solve(output_errors, output_matches);
+}
+
+void CapsulesSolver::compute_matching_errors(const CapsuleIndex &capsule_index,
+                                             const std::vector<size_t> &capsule_ids,
+                                             const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                                             const std::vector<size_t> &matches,
+                                             std::vector<float> &output_errors) const
+{
+    const int n_dims = get_feature_size();
+    std::vector<float> capsule_feature(n_dims), cell_feature(n_dims);
+    output_errors.resize(matches.size());
+    for (size_t j = 0; j < matches.size(); j++)
+    {
+        get_feature(capsule_index.get_record(capsule_ids[matches[j]]).descriptor, capsule_feature.data());
+        get_feature(cutouts_descriptors[j], cell_feature.data());
+        float error2 = 0;
+        for (int d = 0; d < n_dims; d++)
+            error2 += (capsule_feature[d] - cell_feature[d]) * (capsule_feature[d] - cell_feature[d]);
+        output_errors[j] = options_.squared_errors ? error2 : std::sqrt(error2);
+    }
+}
+
+void CapsulesSolver::get_feature(const CapsuleDescriptor &descriptor, float *output_feature) const
+{
+    // Weights are folded into the values, so that the weighted distances become Euclidean
+    if (options_.metric == CapsuleDescriptor::LAB_SECTORS)
+    {
+        for (int k = 0; k < CapsuleDescriptor::n_regions; k++)
+            for (int c = 0; c < 3; c++)
+                output_feature[3 * k + c] = std::sqrt(CapsuleDescriptor::region_weights[k]) *
+                                            descriptor.regions_lab[k][c];
+    }
+    else
+    {
+        for (int c = 0; c < 3; c++)
+            output_feature[c] = std::sqrt(color_distance_weights_bgr[c]) * descriptor.mean_bgr[c];
+    }
+}
+
+int CapsulesSolver::get_feature_size() const
 {
-    std::vector<cv::Scalar> cutouts_means;
-    cutouts_means.reserve(cutouts.size());
-    for (const auto &cutout : cutouts)
-        cutouts_means.emplace_back(cv::mean(cutout));
-
-    output_errors.resize(ref_capsules_paths.size());
-    std::vector<std::future<void>> futures;
-    std::mutex writing_mutex;
-
-    int idx = 0;
-    for (const auto &ref_path : ref_capsules_paths)
-    {
-        futures.push_back(std::async(
-            std::launch::async,
-            [&writing_mutex](std::reference_wrapper<std::vector<double>> errors,
-                             std::reference_wrapper<const std::vector<cv::Scalar>> cutouts_means,
-                             std::reference_wrapper<const cv::String> ref_caps_path) {
-                const cv::Scalar ref_mean = cv::mean(cv::imread(ref_caps_path.get()));
-                std::vector<double> errs;
-                errs.reserve(cutouts_means.get().size());
-                for (const auto &cutout_mean : cutouts_means.get())
+    return options_.metric == CapsuleDescriptor::LAB_SECTORS ? 3 * CapsuleDescriptor::n_regions : 3;
+}
+
+void CapsulesSolver::refine_matching(const CapsuleIndex &capsule_index,
+                                     const std::vector<size_t> &capsule_ids,
+                                     const std::vector<CapsuleDescriptor> &cutouts_descriptors,
+                                     const std::vector<std::vector<size_t>> &cell_neighbours,
+                                     std::vector<size_t> &matches)
+{
+    const size_t n_capsules = capsule_ids.size();
+    const size_t n_cells = cutouts_descriptors.size();
+    const size_t unused = SIZE_MAX;
+    const int n_dims = get_feature_size();
+    const auto begin_time = std::chrono::steady_clock::now();
+    const auto deadline = begin_time + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                           std::chrono::duration<double>(options_.refine_seconds));
+
+    // Features of both sides, and the candidates of each cell, which don't change from one pass to the next
+    std::vector<float> capsule_features(n_capsules * n_dims), cell_features(n_cells * n_dims);
+    for (size_t i = 0; i < n_capsules; i++)
+        get_feature(capsule_index.get_record(capsule_ids[i]).descriptor, &capsule_features[i * n_dims]);
+    std::vector<std::vector<size_t>> candidates;
+    find_nearest_capsules(capsule_index, capsule_ids, cutouts_descriptors, options_.refine_neighbours, candidates);
+    for (size_t j = 0; j < n_cells; j++)
+        get_feature(cutouts_descriptors[j], &cell_features[j * n_dims]);
+    const auto error = [&](size_t i, size_t j) {
+        float error2 = 0;
+        for (int d = 0; d < n_dims; d++)
+        {
+            const float diff = capsule_features[i * n_dims + d] - cell_features[j * n_dims + d];
+            error2 += diff * diff;
+        }
+        return options_.squared_errors ? error2 : std::sqrt(error2);
+    };
+
+    // Current state
+    std::vector<size_t> capsule_cells(n_capsules, unused);
+    std::vector<float> cell_errors(n_cells);
+    for (size_t j = 0; j < n_cells; j++)
+    {
+        capsule_cells[matches[j]] = j;
+        cell_errors[j] = error(matches[j], j);
+    }
+    const double initial_error = std::accumulate(cell_errors.cbegin(), cell_errors.cend(), 0.0);
+
+    // With dithering, the residuals of neighbouring cells are allowed to compensate each other
+    const bool dithering = options_.dithering > 0;
+    ErrorDiffusionObjective objective(cell_neighbours, n_dims, options_.dithering);
+    if (dithering)
+    {
+        std::vector<float> residuals(n_cells * n_dims);
+        for (size_t j = 0; j < n_cells; j++)
+            for (int d = 0; d < n_dims; d++)
+                residuals[j * n_dims + d] = capsule_features[matches[j] * n_dims + d] - cell_features[j * n_dims + d];
+        objective.reset(residuals);
+    }
+    const double initial_objective = dithering ? objective.get_value() : 0.0;
+
+    // Changes of the residuals of the cell j and of the cell of i, if the capsule i is put on j
+    const auto get_changes = [&](size_t j, size_t i, float *output_change, float *output_other_change) {
+        for (int d = 0; d < n_dims; d++)
+        {
+            output_change[d] = capsule_features[i * n_dims + d] - capsule_features[matches[j] * n_dims + d];
+            output_other_change[d] = -output_change[d];
+        }
+    };
+
+    // Gain of putting the capsule i on the cell j, either instead of its capsule or by swapping it with the cell of i
+    const auto get_delta = [&](size_t j, size_t i) {
+        const size_t other_cell = capsule_cells[i];
+        if (dithering)
+        {
+            float change[ErrorDiffusionObjective::max_dims], other_change[ErrorDiffusionObjective::max_dims];
+            get_changes(j, i, change, other_change);
+            return objective.get_delta(j, change, other_cell == unused ? ErrorDiffusionObjective::no_cell : other_cell,
+                                       other_change);
+        }
+        if (other_cell == unused)
+            return error(i, j) - cell_errors[j];
+        return error(i, j) + error(matches[j], other_cell) - cell_errors[j] - cell_errors[other_cell];
+    };
+
+    struct Move
+    {
+        float delta;
+        uint32_t cell;
+        uint32_t capsule;
+        bool operator<(const Move &other) const
+        {
+            return delta < other.delta || (delta == other.delta && cell < other.cell);
+        }
+    };
+    const float min_gain = 1e-4f;
+    const size_t cells_between_clock_checks = 256;
+    size_t n_passes = 0;
+    bool converged = false;
+    double elapsed_s = 0;
+    while (!converged && elapsed_s < options_.refine_seconds)
+    {
+        // Best move of each cell, against the state at the beginning of the pass. A pass over a large grid can
+        // outlast the time budget, so the cells left once it's spent keep no move
+        std::vector<Move> best_moves(n_cells, Move{0.f, 0, 0});
+        std::atomic<bool> out_of_time(false);
+        thread_pool_.parallel_for(0, n_cells, [&](size_t begin, size_t end) {
+            for (size_t j = begin; j < end; j++)
+            {
+                if ((j - begin) % cells_between_clock_checks == 0 &&
+                    (out_of_time.load(std::memory_order_relaxed) || std::chrono::steady_clock::now() >= deadline))
                 {
-                    const cv::Scalar diff_means = ref_mean - cutout_mean;
-                    const double diff_b = diff_means[0];
-                    const double diff_g = diff_means[1];
-                    const double diff_r = diff_means[2];
-
-                    // Weighted Euclidean color distance
-                    const double output_error = std::sqrt(3 * diff_r * diff_r + 4 * diff_g * diff_g + 2 * diff_b * diff_b);
-                    errs.emplace_back(output_error);
+                    out_of_time.store(true, std::memory_order_relaxed);
+                    return;
                 }
+                for (const size_t i : candidates[j])
                 {
-                    std::lock_guard<std::mutex> lock(writing_mutex);
-                    std::swap(errs, errors.get());
+                    if (i == matches[j])
+                        continue;
+                    const float delta = get_delta(j, i);
+                    if (delta < best_moves[j].delta)
+                        best_moves[j] = Move{delta, static_cast<uint32_t>(j), static_cast<uint32_t>(i)};
                 }
-            },
-            std::ref(output_errors[idx++]), std::cref(cutouts_means), std::cref(ref_path)));
+            }
+        });
+
+        // Apply the best ones first, as long as they still improve the matching
+        std::vector<Move> moves;
+        for (const Move &move : best_moves)
+            if (move.delta < -min_gain)
+                moves.push_back(move);
+        std::sort(moves.begin(), moves.end());
+        size_t n_swaps = 0, n_replacements = 0;
+        for (const Move &move : moves)
+        {
+            const size_t j = move.cell, i = move.capsule;
+            if (i == matches[j] || get_delta(j, i) >= -min_gain)
+                continue;
+            const size_t old_capsule = matches[j];
+            const size_t other_cell = capsule_cells[i];
+            if (dithering)
+            {
+                float change[ErrorDiffusionObjective::max_dims], other_change[ErrorDiffusionObjective::max_dims];
+                get_changes(j, i, change, other_change);
+                objective.apply(j, change, other_cell == unused ? ErrorDiffusionObjective::no_cell : other_cell,
+                                other_change);
+            }
+            matches[j] = i;
+            capsule_cells[i] = j;
+            capsule_cells[old_capsule] = other_cell;
+            cell_errors[j] = error(i, j);
+            if (other_cell == unused)
+                n_replacements++;
+            else
+            {
+                matches[other_cell] = old_capsule;
+                cell_errors[other_cell] = error(old_capsule, other_cell);
+                n_swaps++;
+            }
+        }
+
+        n_passes++;
+        converged = (n_swaps + n_replacements == 0) && !out_of_time;
+        elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin_time).count();
+        std::cout << "Refinement pass " << n_passes << ": " << n_swaps << " swaps, " << n_replacements
+                  << " replacements by unused capsules, total error "
+                  << std::accumulate(cell_errors.cbegin(), cell_errors.cend(), 0.0);
+        if (dithering)
+            std::cout << ", dithered objective " << objective.get_value();
+        std::cout << std::endl;
     }
 
-    futures.clear();
-    return true;
+    const double final_error = std::accumulate(cell_errors.cbegin(), cell_errors.cend(), 0.0);
+    std::cout << "Refinement: total error " << initial_error << " -> " << final_error;
+    if (dithering)
+        std::cout << ", dithered objective " << initial_objective << " -> " << objective.get_value();
+    std::cout << " in " << n_passes << " passes, " << (converged ? "converged." : "time budget spent.") << std::endl;
 }
@@ -4,13 +4,27 @@
  * 2020 Thomas Rouch                                                                                                 *
  *********************************************************************************************************************/
 
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <future>
 #include <iostream>
+#include <string>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include "circle_grid_pattern.h"
 
-CircleGridPattern::CircleGridPattern(int width, int height, int n_rows)
+namespace
+{
+/// @brief Gets the first pixel of a window of @p size pixels centered on @p center, along an axis of @p length pixels
+int get_window_begin(float center, int size, int length)
+{
+    return std::min(length - size, std::max(0, cvRound(center - 0.5f * size)));
+}
+} // namespace
+
+CircleGridPattern::CircleGridPattern(int width, int height, int n_rows, ThreadPool &thread_pool) : thread_pool_(thread_pool)
 {
     // Finds the optimal grid geometry
     const double a = 2 + std::sqrt(3) * (n_rows - 1.0);           // a
@@ -52,11 +66,42 @@ CircleGridPattern::CircleGridPattern(int width, int height, int n_rows)
             grid_.emplace_back(x_row, y_row);
     }
 
-    // Initializes images used for cutout-extraction
-    cutout_.create(2 * radius_, 2 * radius_, CV_8UC3);
+    // Initializes the mask used for cutout-extraction
     circular_mask_.create(2 * radius_, 2 * radius_, CV_8UC3);
     circular_mask_.setTo(0);
     cv::circle(circular_mask_, cv::Point2f(radius_, radius_), radius_, cv::Scalar::all(255), -1);
+
+    // The disk being convex, each row of the mask is covered by a single span
+    disk_spans_.resize(circular_mask_.rows);
+    for (int y = 0; y < circular_mask_.rows; y++)
+    {
+        const cv::Vec3b *mask_row = circular_mask_.ptr<cv::Vec3b>(y);
+        int x_begin = 0, x_end = circular_mask_.cols;
+        while (x_begin < x_end && mask_row[x_begin][0] == 0)
+            x_begin++;
+        while (x_end > x_begin && mask_row[x_end - 1][0] == 0)
+            x_end--;
+        disk_spans_[y] = std::make_pair(x_begin, x_end);
+    }
+}
+
+void CircleGridPattern::get_neighbours(std::vector<std::vector<size_t>> &output_neighbours) const
+{
+    // Touching circles are 2 radii apart, the next closest ones 2 * sqrt(3) radii apart
+    const double max_distance = 2.5 * radius_;
+    output_neighbours.assign(grid_.size(), std::vector<size_t>());
+    for (int i = 0; i < n_rows_; i++)
+        for (int j = 0; j < n_cols_; j++)
+        {
+            const size_t cell = i * n_cols_ + j;
+            for (int neighbour_i = std::max(0, i - 1); neighbour_i <= std::min(n_rows_ - 1, i + 1); neighbour_i++)
+                for (int neighbour_j = std::max(0, j - 1); neighbour_j <= std::min(n_cols_ - 1, j + 1); neighbour_j++)
+                {
+                    const size_t neighbour = neighbour_i * n_cols_ + neighbour_j;
+                    if (neighbour != cell && cv::norm(grid_[neighbour] - grid_[cell]) < max_distance)
+                        output_neighbours[cell].push_back(neighbour);
+                }
+        }
 }
 
 size_t CircleGridPattern::get_rows()
@@ -71,10 +116,10 @@ size_t CircleGridPattern::get_cols()
 
 cv::Size CircleGridPattern::get_cutout_size()
 {
-    return cutout_.size();
+    return circular_mask_.size();
 }
 
-bool CircleGridPattern::extract_cutouts(const cv::Mat &image, std::vector<cv::Mat> &output_cutouts) const
+bool CircleGridPattern::check_image(const cv::Mat &image) const
 {
     if (image.rows < grid_height_ || image.cols < grid_width_)
     {
@@ -88,14 +133,50 @@ bool CircleGridPattern::extract_cutouts(const cv::Mat &image, std::vector<cv::Ma
         std::cerr << "Wrong image depth. Expected CV_8UC3. Got " << image.depth() << "." << std::endl;
         return false;
     }
+    return true;
+}
+
+bool CircleGridPattern::extract_cutouts(const cv::Mat &image, std::vector<cv::Mat> &output_cutouts) const
+{
+    if (!check_image(image))
+        return false;
 
-    // Extract cutouts
+    // Extract cutouts, each one being cropped into a disk in place
     output_cutouts.resize(grid_.size());
-    for (size_t i = 0; i < grid_.size(); i++)
-    {
-        cv::getRectSubPix(image, cutout_.size(), grid_[i], cutout_);
-        output_cutouts[i] = cutout_ & circular_mask_;
-    }
+    thread_pool_.parallel_for(0, grid_.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            cv::getRectSubPix(image, circular_mask_.size(), grid_[i], output_cutouts[i]);
+            cv::bitwise_and(output_cutouts[i], circular_mask_, output_cutouts[i]);
+        }
+    });
+    return true;
+}
+
+bool CircleGridPattern::describe_cells(const cv::Mat &image, std::vector<CapsuleDescriptor> &output_descriptors) const
+{
+    if (!check_image(image))
+        return false;
+
+    const int size = circular_mask_.rows;
+    output_descriptors.resize(grid_.size());
+    thread_pool_.parallel_for(0, n_rows_, [&](size_t begin, size_t end) {
+        // Buffers of the chunk, reused by all its rows
+        cv::Mat float_band, lab_band;
+        for (size_t i = begin; i < end; i++)
+        {
+            const size_t first_cell = i * n_cols_;
+            const cv::Rect band(0, get_window_begin(grid_[first_cell].y, size, image.rows), image.cols, size);
+            const cv::Mat bgr_band = image(band);
+            bgr_band.convertTo(float_band, CV_32FC3, 1.0 / 255);
+            cv::cvtColor(float_band, lab_band, cv::COLOR_BGR2Lab);
+            for (size_t cell = first_cell; cell < first_cell + n_cols_; cell++)
+            {
+                const cv::Rect window(get_window_begin(grid_[cell].x, size, image.cols), 0, size, size);
+                CapsuleDescriptor::compute(bgr_band, lab_band, window, output_descriptors[cell]);
+            }
+        }
+    });
     return true;
 }
 
@@ -106,16 +187,123 @@ bool CircleGridPattern::generate_image(const std::vector<cv::Mat> &sub_images, c
         std::cerr << "Wrong number of sub-images. Expected " << grid_.size() << "." << std::endl;
         return false;
     }
+    for (const cv::Mat &sub_image : sub_images)
+        if (sub_image.type() != CV_8UC3 || sub_image.empty())
+        {
+            std::cerr << "Wrong sub-image. Expected a CV_8UC3 image." << std::endl;
+            return false;
+        }
 
     output_image.create(grid_height_, grid_width_, CV_8UC3);
     output_image.setTo(cv::Scalar::all(0));
-    cv::Mat roi;
-    for (int i = 0; i < grid_.size(); i++)
+    for (int parity = 0; parity < 2; parity++)
     {
-        cv::resize(sub_images[i], cutout_, cutout_.size());
-        cv::Rect rect(grid_[i] - cv::Point2f(radius_, radius_), cutout_.size());
-        roi = cv::Mat(output_image, rect);
-        cutout_.copyTo(roi, circular_mask_);
+        const size_t n_rows = (n_rows_ + 1 - parity) / 2;
+        thread_pool_.parallel_for(0, n_rows, [&](size_t begin, size_t end) {
+            cv::Mat cutout;
+            for (size_t k = begin; k < end; k++)
+            {
+                const size_t first_cell = (2 * k + parity) * n_cols_;
+                for (size_t cell = first_cell; cell < first_cell + n_cols_; cell++)
+                {
+                    if (sub_images[cell].size() == circular_mask_.size())
+                        draw_disk(sub_images[cell], cell, 0, output_image);
+                    else
+                    {
+                        cv::resize(sub_images[cell], cutout, circular_mask_.size());
+                        draw_disk(cutout, cell, 0, output_image);
+                    }
+                }
+            }
+        });
     }
     return true;
 }
+
+bool CircleGridPattern::render_bands(const SubImageSource &get_sub_image, int band_height,
+                                     const BandSink &write_band) const
+{
+    if (band_height <= 0)
+        band_height = 2 * circular_mask_.rows;
+    const int n_bands = (grid_height_ + band_height - 1) / band_height;
+    const size_t max_pending_bands = 2 * thread_pool_.size() + 1;
+
+    // Keep a few bands rendering ahead of the one being written
+    std::deque<std::future<cv::Mat>> pending_bands;
+    int next_band = 0;
+    bool success = true;
+    while (success && (next_band < n_bands || !pending_bands.empty()))
+    {
+        for (; next_band < n_bands && pending_bands.size() < max_pending_bands; next_band++)
+        {
+            const int y_begin = next_band * band_height;
+            const int y_end = std::min(grid_height_, y_begin + band_height);
+            pending_bands.push_back(thread_pool_.submit([this, &get_sub_image, y_begin, y_end]() {
+                return render_band(get_sub_image, y_begin, y_end);
+            }));
+        }
+        const cv::Mat band = pending_bands.front().get();
+        pending_bands.pop_front();
+        success = !band.empty() && write_band(band);
+    }
+
+    // The bands still rendering refer to the source
+    for (auto &pending_band : pending_bands)
+        pending_band.wait();
+    return success;
+}
+
+int CircleGridPattern::get_image_width() const
+{
+    return grid_width_;
+}
+
+int CircleGridPattern::get_image_height() const
+{
+    return grid_height_;
+}
+
+cv::Mat CircleGridPattern::render_band(const SubImageSource &get_sub_image, int y_begin, int y_end) const
+{
+    cv::Mat band(y_end - y_begin, grid_width_, CV_8UC3, cv::Scalar::all(0));
+    cv::Mat cutout;
+    for (int i = 0; i < n_rows_; i++)
+    {
+        // Only the rows of circles crossing the band
+        const size_t first_cell = i * n_cols_;
+        const int top = cvRound(grid_[first_cell].y - radius_);
+        if (top >= y_end || top + circular_mask_.rows <= y_begin)
+            continue;
+        for (size_t cell = first_cell; cell < first_cell + n_cols_; cell++)
+        {
+            const cv::Mat sub_image = get_sub_image(cell);
+            if (sub_image.type() != CV_8UC3 || sub_image.empty())
+            {
+                std::cerr << "Wrong sub-image for the circle " + std::to_string(cell) + ".\n";
+                return cv::Mat();
+            }
+            if (sub_image.size() == circular_mask_.size())
+                draw_disk(sub_image, cell, y_begin, band);
+            else
+            {
+                cv::resize(sub_image, cutout, circular_mask_.size(), 0, 0, cv::INTER_AREA);
+                draw_disk(cutout, cell, y_begin, band);
+            }
+        }
+    }
+    return band;
+}
+
+void CircleGridPattern::draw_disk(const cv::Mat &sub_image, size_t cell, int band_top, cv::Mat &output_band) const
+{
+    const int left = cvRound(grid_[cell].x - radius_);
+    const int top = cvRound(grid_[cell].y - radius_) - band_top;
+    for (int y = std::max(0, -top); y < std::min(sub_image.rows, output_band.rows - top); y++)
+    {
+        const int x_begin = std::max(disk_spans_[y].first, -left);
+        const int x_end = std::min(disk_spans_[y].second, output_band.cols - left);
+        if (x_begin < x_end)
+            std::memcpy(output_band.ptr<cv::Vec3b>(top + y) + left + x_begin, sub_image.ptr<cv::Vec3b>(y) + x_begin,
+                        (x_end - x_begin) * sizeof(cv::Vec3b));
+    }
+}
@@ -0,0 +1,225 @@
+/*********************************************************************************************************************
+ * File : color_distance.cpp                                                                                         *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <cmath>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define COLOR_DISTANCE_X86
+#endif
+
+#include "color_distance.h"
+
+namespace
+{
+const float weight_b = color_distance_weights_bgr[0];
+const float weight_g = color_distance_weights_bgr[1];
+const float weight_r = color_distance_weights_bgr[2];
+
+/// @brief Computes the distances of the colors [begin, end)
+void compute_distances_scalar(const float ref_bgr[3], const ColorsSoA &colors, float *output_distances,
+                              bool take_sqrt, size_t begin, size_t end)
+{
+    const float *b = colors.b.data();
+    const float *g = colors.g.data();
+    const float *r = colors.r.data();
+    for (size_t j = begin; j < end; j++)
+    {
+        const float diff_b = b[j] - ref_bgr[0];
+        const float diff_g = g[j] - ref_bgr[1];
+        const float diff_r = r[j] - ref_bgr[2];
+        const float dist2 = weight_r * diff_r * diff_r + weight_g * diff_g * diff_g + weight_b * diff_b * diff_b;
+        output_distances[j] = take_sqrt ? std::sqrt(dist2) : dist2;
+    }
+}
+
+/// @brief Computes the distances of the descriptors [begin, end)
+void compute_descriptor_distances_scalar(const float *ref, const float *weights, const DescriptorsSoA &descriptors,
+                                         float *output_distances, bool take_sqrt, size_t begin, size_t end)
+{
+    for (size_t j = begin; j < end; j++)
+    {
+        float dist2 = 0;
+        for (size_t c = 0; c < descriptors.n_channels(); c++)
+        {
+            const float diff = descriptors.channels[c][j] - ref[c];
+            dist2 += weights[c] * diff * diff;
+        }
+        output_distances[j] = take_sqrt ? std::sqrt(dist2) : dist2;
+    }
+}
+
+#ifdef COLOR_DISTANCE_X86
+__attribute__((target("avx2,fma"))) void compute_distances_avx2(const float ref_bgr[3], const ColorsSoA &colors,
+                                                                 float *output_distances, bool take_sqrt)
+{
+    const float *b = colors.b.data();
+    const float *g = colors.g.data();
+    const float *r = colors.r.data();
+    const __m256 ref_b = _mm256_set1_ps(ref_bgr[0]);
+    const __m256 ref_g = _mm256_set1_ps(ref_bgr[1]);
+    const __m256 ref_r = _mm256_set1_ps(ref_bgr[2]);
+    const __m256 w_b = _mm256_set1_ps(weight_b);
+    const __m256 w_g = _mm256_set1_ps(weight_g);
+    const __m256 w_r = _mm256_set1_ps(weight_r);
+
+    const size_t n = colors.size();
+    const size_t n_simd = n - n % 8;
+    for (size_t j = 0; j < n_simd; j += 8)
+    {
+        const __m256 diff_b = _mm256_sub_ps(_mm256_loadu_ps(b + j), ref_b);
+        const __m256 diff_g = _mm256_sub_ps(_mm256_loadu_ps(g + j), ref_g);
+        const __m256 diff_r = _mm256_sub_ps(_mm256_loadu_ps(r + j), ref_r);
+        __m256 dist2 = _mm256_mul_ps(_mm256_mul_ps(diff_b, diff_b), w_b);
+        dist2 = _mm256_fmadd_ps(_mm256_mul_ps(diff_g, diff_g), w_g, dist2);
+        dist2 = _mm256_fmadd_ps(_mm256_mul_ps(diff_r, diff_r), w_r, dist2);
+        _mm256_storeu_ps(output_distances + j, take_sqrt ? _mm256_sqrt_ps(dist2) : dist2);
+    }
+    compute_distances_scalar(ref_bgr, colors, output_distances, take_sqrt, n_simd, n);
+}
+
+__attribute__((target("avx512f"))) void compute_distances_avx512(const float ref_bgr[3], const ColorsSoA &colors,
+                                                                  float *output_distances, bool take_sqrt)
+{
+    const float *b = colors.b.data();
+    const float *g = colors.g.data();
+    const float *r = colors.r.data();
+    const __m512 ref_b = _mm512_set1_ps(ref_bgr[0]);
+    const __m512 ref_g = _mm512_set1_ps(ref_bgr[1]);
+    const __m512 ref_r = _mm512_set1_ps(ref_bgr[2]);
+    const __m512 w_b = _mm512_set1_ps(weight_b);
+    const __m512 w_g = _mm512_set1_ps(weight_g);
+    const __m512 w_r = _mm512_set1_ps(weight_r);
+
+    const size_t n = colors.size();
+    const size_t n_simd = n - n % 16;
+    for (size_t j = 0; j < n_simd; j += 16)
+    {
+        const __m512 diff_b = _mm512_sub_ps(_mm512_loadu_ps(b + j), ref_b);
+        const __m512 diff_g = _mm512_sub_ps(_mm512_loadu_ps(g + j), ref_g);
+        const __m512 diff_r = _mm512_sub_ps(_mm512_loadu_ps(r + j), ref_r);
+        __m512 dist2 = _mm512_mul_ps(_mm512_mul_ps(diff_b, diff_b), w_b);
+        dist2 = _mm512_fmadd_ps(_mm512_mul_ps(diff_g, diff_g), w_g, dist2);
+        dist2 = _mm512_fmadd_ps(_mm512_mul_ps(diff_r, diff_r), w_r, dist2);
+        _mm512_storeu_ps(output_distances + j, take_sqrt ? _mm512_sqrt_ps(dist2) : dist2);
+    }
+    compute_distances_scalar(ref_bgr, colors, output_distances, take_sqrt, n_simd, n);
+}
+
+__attribute__((target("avx2,fma"))) void compute_descriptor_distances_avx2(const float *ref, const float *weights,
+                                                                            const DescriptorsSoA &descriptors,
+                                                                            float *output_distances, bool take_sqrt)
+{
+    const size_t n = descriptors.size();
+    const size_t n_simd = n - n % 8;
+    for (size_t j = 0; j < n_simd; j += 8)
+    {
+        __m256 dist2 = _mm256_setzero_ps();
+        for (size_t c = 0; c < descriptors.n_channels(); c++)
+        {
+            const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(descriptors.channels[c].data() + j),
+                                              _mm256_set1_ps(ref[c]));
+            dist2 = _mm256_fmadd_ps(_mm256_mul_ps(diff, diff), _mm256_set1_ps(weights[c]), dist2);
+        }
+        _mm256_storeu_ps(output_distances + j, take_sqrt ? _mm256_sqrt_ps(dist2) : dist2);
+    }
+    compute_descriptor_distances_scalar(ref, weights, descriptors, output_distances, take_sqrt, n_simd, n);
+}
+
+__attribute__((target("avx512f"))) void compute_descriptor_distances_avx512(const float *ref, const float *weights,
+                                                                             const DescriptorsSoA &descriptors,
+                                                                             float *output_distances, bool take_sqrt)
+{
+    const size_t n = descriptors.size();
+    const size_t n_simd = n - n % 16;
+    for (size_t j = 0; j < n_simd; j += 16)
+    {
+        __m512 dist2 = _mm512_setzero_ps();
+        for (size_t c = 0; c < descriptors.n_channels(); c++)
+        {
+            const __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(descriptors.channels[c].data() + j),
+                                              _mm512_set1_ps(ref[c]));
+            dist2 = _mm512_fmadd_ps(_mm512_mul_ps(diff, diff), _mm512_set1_ps(weights[c]), dist2);
+        }
+        _mm512_storeu_ps(output_distances + j, take_sqrt ? _mm512_sqrt_ps(dist2) : dist2);
+    }
+    compute_descriptor_distances_scalar(ref, weights, descriptors, output_distances, take_sqrt, n_simd, n);
+}
+#endif
+} // namespace
+
+ColorDistanceKernel get_best_color_distance_kernel()
+{
+#ifdef COLOR_DISTANCE_X86
+    static const ColorDistanceKernel best_kernel = __builtin_cpu_supports("avx512f")
+                                                       ? ColorDistanceKernel::AVX512
+                                                   : (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+                                                       ? ColorDistanceKernel::AVX2
+                                                       : ColorDistanceKernel::SCALAR;
+    return best_kernel;
+#else
+    return ColorDistanceKernel::SCALAR;
+#endif
+}
+
+const char *get_color_distance_kernel_name(ColorDistanceKernel kernel)
+{
+    switch (kernel)
+    {
+    case ColorDistanceKernel::AVX2:
+        return "AVX2";
+    case ColorDistanceKernel::AVX512:
+        return "AVX-512";
+    default:
+        return "Scalar";
+    }
+}
+
+void compute_weighted_color_distances(const float ref_bgr[3],
+                                      const ColorsSoA &colors,
+                                      float *output_distances,
+                                      bool take_sqrt,
+                                      ColorDistanceKernel kernel)
+{
+    switch (kernel)
+    {
+#ifdef COLOR_DISTANCE_X86
+    case ColorDistanceKernel::AVX512:
+        compute_distances_avx512(ref_bgr, colors, output_distances, take_sqrt);
+        break;
+    case ColorDistanceKernel::AVX2:
+        compute_distances_avx2(ref_bgr, colors, output_distances, take_sqrt);
+        break;
+#endif
+    default:
+        compute_distances_scalar(ref_bgr, colors, output_distances, take_sqrt, 0, colors.size());
+        break;
+    }
+}
+
+void compute_weighted_descriptor_distances(const float *ref,
+                                           const float *weights,
+                                           const DescriptorsSoA &descriptors,
+                                           float *output_distances,
+                                           bool take_sqrt,
+                                           ColorDistanceKernel kernel)
+{
+    switch (kernel)
+    {
+#ifdef COLOR_DISTANCE_X86
+    case ColorDistanceKernel::AVX512:
+        compute_descriptor_distances_avx512(ref, weights, descriptors, output_distances, take_sqrt);
+        break;
+    case ColorDistanceKernel::AVX2:
+        compute_descriptor_distances_avx2(ref, weights, descriptors, output_distances, take_sqrt);
+        break;
+#endif
+    default:
+        compute_descriptor_distances_scalar(ref, weights, descriptors, output_distances, take_sqrt, 0,
+                                            descriptors.size());
+        break;
+    }
+}
@@ -0,0 +1,195 @@
+/*********************************************************************************************************************
+ * File : cost_matrix.cpp                                                                                            *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <sys/mman.h>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+
+#include "cost_matrix.h"
+
+namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+namespace
+{
+const size_t row_alignment = 64; ///< Cache line, and widest SIMD register
+
+/// @brief Gets the size in bytes of a row, padding included
+size_t get_row_step(size_t n_cols, CostMatrix::Storage storage)
+{
+    const size_t elem_size = (storage == CostMatrix::FLOAT32) ? sizeof(float) : sizeof(uint16_t);
+    return ((n_cols * elem_size + row_alignment - 1) / row_alignment) * row_alignment;
+}
+} // namespace
+
+CostMatrix::CostMatrix() : data_(nullptr),
+                           n_rows_(0),
+                           n_cols_(0),
+                           row_step_(0),
+                           storage_(FLOAT32),
+                           quantization_scale_(1.f),
+                           dequantization_scale_(1.f)
+{
+}
+
+CostMatrix::CostMatrix(size_t n_rows, size_t n_cols, Storage storage, float max_cost) : CostMatrix()
+{
+    create(n_rows, n_cols, storage, max_cost);
+}
+
+void CostMatrix::create(size_t n_rows, size_t n_cols, Storage storage, float max_cost)
+{
+    n_rows_ = n_rows;
+    n_cols_ = n_cols;
+    storage_ = storage;
+    row_step_ = get_row_step(n_cols, storage);
+    quantization_scale_ = std::numeric_limits<uint16_t>::max() / max_cost;
+    dequantization_scale_ = max_cost / std::numeric_limits<uint16_t>::max();
+
+    allocation_.reset();
+    mapped_region_ = bip::mapped_region();
+    data_ = nullptr;
+    if (n_rows_ * row_step_ == 0)
+        return;
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, row_alignment, n_rows_ * row_step_) != 0)
+        throw std::bad_alloc();
+    allocation_.reset(static_cast<uint8_t *>(ptr));
+    data_ = allocation_.get();
+}
+
+bool CostMatrix::create_mapped(size_t n_rows, size_t n_cols, const std::string &scratch_directory,
+                               Storage storage, float max_cost)
+{
+    create(0, 0, storage, max_cost);
+    const size_t size = get_size_in_bytes(n_rows, n_cols, storage);
+    if (size == 0)
+        return true;
+
+    const fs::path path = fs::path(scratch_directory) / fs::unique_path("cost_matrix_%%%%-%%%%-%%%%.tmp");
+    try
+    {
+        // Sparse file of the right size
+        {
+            std::filebuf file;
+            if (!file.open(path.c_str(), std::ios_base::in | std::ios_base::out | std::ios_base::trunc |
+                                             std::ios_base::binary))
+            {
+                std::cerr << "Unable to create the scratch file " << path << std::endl;
+                return false;
+            }
+            file.pubseekoff(size - 1, std::ios_base::beg);
+            file.sputc(0);
+        }
+        const bip::file_mapping file_mapping(path.c_str(), bip::read_write);
+        mapped_region_ = bip::mapped_region(file_mapping, bip::read_write);
+    }
+    catch (bip::interprocess_exception &e)
+    {
+        std::cerr << "Unable to map the scratch file " << path << ": " << e.what() << std::endl;
+        fs::remove(path);
+        return false;
+    }
+
+    // The mapping outlives the file name
+    fs::remove(path);
+    n_rows_ = n_rows;
+    n_cols_ = n_cols;
+    row_step_ = get_row_step(n_cols, storage);
+    data_ = static_cast<uint8_t *>(mapped_region_.get_address());
+    return true;
+}
+
+size_t CostMatrix::get_size_in_bytes(size_t n_rows, size_t n_cols, Storage storage)
+{
+    return n_rows * get_row_step(n_cols, storage);
+}
+
+size_t CostMatrix::rows() const
+{
+    return n_rows_;
+}
+
+size_t CostMatrix::cols() const
+{
+    return n_cols_;
+}
+
+CostMatrix::Storage CostMatrix::get_storage() const
+{
+    return storage_;
+}
+
+bool CostMatrix::empty() const
+{
+    return n_rows_ == 0 || n_cols_ == 0;
+}
+
+bool CostMatrix::is_mapped() const
+{
+    return mapped_region_.get_address() != nullptr;
+}
+
+size_t CostMatrix::get_size_in_bytes() const
+{
+    return n_rows_ * row_step_;
+}
+
+float *CostMatrix::get_float_row(size_t i)
+{
+    return reinterpret_cast<float *>(data_ + i * row_step_);
+}
+
+const float *CostMatrix::get_float_row(size_t i) const
+{
+    return reinterpret_cast<const float *>(data_ + i * row_step_);
+}
+
+void CostMatrix::set_row(size_t i, const float *costs)
+{
+    if (storage_ == FLOAT32)
+    {
+        std::memcpy(get_float_row(i), costs, n_cols_ * sizeof(float));
+        return;
+    }
+
+    uint16_t *row = reinterpret_cast<uint16_t *>(data_ + i * row_step_);
+    const float max_quantized = std::numeric_limits<uint16_t>::max();
+    for (size_t j = 0; j < n_cols_; j++)
+        row[j] = static_cast<uint16_t>(std::min(max_quantized, std::max(0.f, costs[j] * quantization_scale_ + 0.5f)));
+}
+
+void CostMatrix::get_row(size_t i, float *output_costs) const
+{
+    if (storage_ == FLOAT32)
+    {
+        std::memcpy(output_costs, get_float_row(i), n_cols_ * sizeof(float));
+        return;
+    }
+
+    const uint16_t *row = reinterpret_cast<const uint16_t *>(data_ + i * row_step_);
+    for (size_t j = 0; j < n_cols_; j++)
+        output_costs[j] = dequantization_scale_ * row[j];
+}
+
+void CostMatrix::release_rows(size_t begin, size_t end) const
+{
+    if (!is_mapped() || begin >= end)
+        return;
+
+    // madvise only takes whole pages. Releasing the neighbouring rows sharing them is harmless, the file keeps the
+    // content of the pages and they're read back on the next access
+    const size_t page_size = bip::mapped_region::get_page_size();
+    const size_t first_page = (begin * row_step_) / page_size;
+    const size_t last_page = (end * row_step_ + page_size - 1) / page_size;
+    madvise(data_ + first_page * page_size, (last_page - first_page) * page_size, MADV_DONTNEED);
+}
@@ -0,0 +1,127 @@
+/*********************************************************************************************************************
+ * File : error_diffusion_objective.cpp                                                                              *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+
+#include "error_diffusion_objective.h"
+
+namespace
+{
+const float hexagon_size = 7.f; ///< A cell and its 6 neighbours
+}
+
+ErrorDiffusionObjective::ErrorDiffusionObjective(const std::vector<std::vector<size_t>> &neighbours,
+                                                 int n_dims,
+                                                 float strength) : neighbours_(neighbours),
+                                                                   n_dims_(std::min(n_dims, max_dims)),
+                                                                   strength_(strength) {}
+
+void ErrorDiffusionObjective::reset(const std::vector<float> &residuals)
+{
+    residuals_ = residuals;
+    blurred_.assign(residuals.size(), 0.f);
+    for (size_t j = 0; j < neighbours_.size(); j++)
+        for (int d = 0; d < n_dims_; d++)
+        {
+            float sum = residuals_[j * n_dims_ + d];
+            for (const size_t k : neighbours_[j])
+                sum += residuals_[k * n_dims_ + d];
+            blurred_[j * n_dims_ + d] = sum / hexagon_size;
+        }
+}
+
+double ErrorDiffusionObjective::get_value() const
+{
+    double cells_term = 0, blurred_term = 0;
+    for (size_t k = 0; k < residuals_.size(); k++)
+    {
+        cells_term += residuals_[k] * residuals_[k];
+        blurred_term += blurred_[k] * blurred_[k];
+    }
+    return (1 - strength_) * cells_term + strength_ * blurred_term;
+}
+
+float ErrorDiffusionObjective::get_delta(size_t cell_a, const float *change_a,
+                                         size_t cell_b, const float *change_b) const
+{
+    // Own residuals
+    float cells_delta = 0;
+    for (int d = 0; d < n_dims_; d++)
+    {
+        const float residual = residuals_[cell_a * n_dims_ + d];
+        cells_delta += (2 * residual + change_a[d]) * change_a[d];
+    }
+    if (cell_b != no_cell)
+        for (int d = 0; d < n_dims_; d++)
+        {
+            const float residual = residuals_[cell_b * n_dims_ + d];
+            cells_delta += (2 * residual + change_b[d]) * change_b[d];
+        }
+
+    // Blurred residuals of both hexagons, the cells they share getting both changes
+    size_t cells[max_affected_cells];
+    const int n_cells = get_affected_cells(cell_a, cell_b, cells);
+    float blurred_delta = 0;
+    for (int k = 0; k < n_cells; k++)
+    {
+        const float weight_a = get_blur_weight(cells[k], cell_a);
+        const float weight_b = (cell_b != no_cell) ? get_blur_weight(cells[k], cell_b) : 0.f;
+        for (int d = 0; d < n_dims_; d++)
+        {
+            const float blurred = blurred_[cells[k] * n_dims_ + d];
+            const float change = weight_a * change_a[d] + (weight_b != 0 ? weight_b * change_b[d] : 0.f);
+            blurred_delta += (2 * blurred + change) * change;
+        }
+    }
+    return (1 - strength_) * cells_delta + strength_ * blurred_delta;
+}
+
+void ErrorDiffusionObjective::apply(size_t cell_a, const float *change_a, size_t cell_b, const float *change_b)
+{
+    size_t cells[max_affected_cells];
+    const int n_cells = get_affected_cells(cell_a, cell_b, cells);
+    for (int k = 0; k < n_cells; k++)
+    {
+        const float weight_a = get_blur_weight(cells[k], cell_a);
+        const float weight_b = (cell_b != no_cell) ? get_blur_weight(cells[k], cell_b) : 0.f;
+        for (int d = 0; d < n_dims_; d++)
+            blurred_[cells[k] * n_dims_ + d] += weight_a * change_a[d] +
+                                                (weight_b != 0 ? weight_b * change_b[d] : 0.f);
+    }
+    for (int d = 0; d < n_dims_; d++)
+        residuals_[cell_a * n_dims_ + d] += change_a[d];
+    if (cell_b != no_cell)
+        for (int d = 0; d < n_dims_; d++)
+            residuals_[cell_b * n_dims_ + d] += change_b[d];
+}
+
+float ErrorDiffusionObjective::get_blur_weight(size_t cell, size_t source) const
+{
+    if (cell == source)
+        return 1.f / hexagon_size;
+    const std::vector<size_t> &neighbours = neighbours_[cell];
+    return std::find(neighbours.cbegin(), neighbours.cend(), source) != neighbours.cend() ? 1.f / hexagon_size : 0.f;
+}
+
+int ErrorDiffusionObjective::get_affected_cells(size_t cell_a, size_t cell_b, size_t *output_cells) const
+{
+    // The lattice being symmetric, the hexagon of a cell is also the set of blurred residuals it contributes to
+    int n_cells = 0;
+    for (const size_t cell : {cell_a, cell_b})
+    {
+        if (cell == no_cell)
+            continue;
+        const int n_before = n_cells;
+        const auto add = [&](size_t affected) {
+            if (std::find(output_cells, output_cells + n_before, affected) == output_cells + n_before)
+                output_cells[n_cells++] = affected;
+        };
+        add(cell);
+        for (const size_t neighbour : neighbours_[cell])
+            add(neighbour);
+    }
+    return n_cells;
+}
@@ -6,109 +6,296 @@
 
 #include <algorithm>
 #include <iostream>
-#include <numeric>
+#include <string>
 
 #include "gale_shapley/gale_shapley_algorithm.h"
 
-GaleShapleyAlgorithm::GaleShapleyAlgorithm() {}
+const uint64_t GaleShapleyAlgorithm::no_engagement;
 
-bool GaleShapleyAlgorithm::solve(const std::vector<std::vector<double>> &input_scores, std::vector<size_t> &output_matches)
+GaleShapleyAlgorithm::GaleShapleyAlgorithm(ThreadPool &thread_pool,
+                                           size_t n_candidates) : thread_pool_(thread_pool),
+                                                                  n_candidates_(n_candidates),
+                                                                  scores_(nullptr),
+                                                                  slot_size_(0),
+                                                                  n_engaged_women_(0) {}
+
+bool GaleShapleyAlgorithm::solve(const CostMatrix &input_scores, std::vector<size_t> &output_matches)
+{
+    if (!prepare(input_scores))
+        return false;
+
+    // All the men are free
+    std::vector<uint32_t> free_men(input_scores.rows());
+    for (size_t i = 0; i < free_men.size(); i++)
+        free_men[i] = i;
+    return find_stable_configuration(free_men, output_matches);
+}
+
+bool GaleShapleyAlgorithm::solve(const CostMatrix &input_scores, const std::vector<size_t> &initial_matches,
+                                 std::vector<size_t> &output_matches)
+{
+    if (!prepare(input_scores))
+        return false;
+
+    std::vector<uint32_t> free_men;
+    seed_engagements(initial_matches, free_men);
+    return find_stable_configuration(free_men, output_matches);
+}
+
+void GaleShapleyAlgorithm::reset()
+{
+    scores_ = nullptr;
+    slot_size_ = 0;
+    preferences_.clear();
+    preference_scores_.clear();
+    cursors_.clear();
+    slot_lengths_.clear();
+    last_ranked_.clear();
+    all_ranked_.clear();
+    n_engaged_women_ = 0;
+}
+
+bool GaleShapleyAlgorithm::prepare(const CostMatrix &input_scores)
 {
     // Check if there are enough men
-    const int n_men = input_scores.size();
-    const int n_women = input_scores[0].size();
+    const size_t n_men = input_scores.rows();
+    const size_t n_women = input_scores.cols();
     if (n_men < n_women)
     {
         std::cerr << "There's not enough men to get each woman engaged. Got " << n_men << " men and "
                   << n_women << " women." << std::endl;
         return false;
     }
+    scores_ = &input_scores;
+    slot_size_ = (n_candidates_ == 0 || n_candidates_ > n_women) ? n_women : n_candidates_;
 
-    // Men
-    std::vector<int> women_indices(n_women);
-    std::iota(women_indices.begin(), women_indices.end(), 0); // List of women indices
-    men_.reserve(n_men);
-    for (const auto &women_scores : input_scores)
+    if (verbose_)
     {
-        if (women_scores.size() != n_women)
+        std::cout << "Gale-Shapley Algorithm: " << n_men << " men and " << n_women << " women";
+        if (slot_size_ < n_women)
+            std::cout << ", " << slot_size_ << " candidates per man";
+        std::cout << "." << std::endl;
+    }
+
+    // The buffers of the previous problem are reused, nobody has ranked any woman yet
+    preferences_.resize(n_men * slot_size_);
+    preference_scores_.resize(n_men * slot_size_);
+    cursors_.assign(n_men, 0);
+    slot_lengths_.assign(n_men, 0);
+    last_ranked_.assign(n_men, 0);
+    all_ranked_.assign(n_men, 0);
+
+    // All the women are single
+    if (engagements_.size() != n_women)
+        engagements_ = std::vector<std::atomic<uint64_t>>(n_women);
+    for (auto &engagement : engagements_)
+        engagement.store(no_engagement, std::memory_order_relaxed);
+    n_engaged_women_ = 0;
+    return true;
+}
+
+void GaleShapleyAlgorithm::seed_engagements(const std::vector<size_t> &initial_matches,
+                                            std::vector<uint32_t> &output_free_men)
+{
+    const uint32_t single = UINT32_MAX;
+    const size_t n_men = scores_->rows();
+    const size_t n_women = scores_->cols();
+
+    // Engage the initial couples
+    std::vector<uint32_t> wives(n_men, single);
+    size_t n_ignored = 0;
+    for (size_t j = 0; j < std::min(n_women, initial_matches.size()); j++)
+    {
+        const size_t man_id = initial_matches[j];
+        if (man_id == no_match)
+            continue;
+        if (man_id >= n_men || wives[man_id] != single)
         {
-            std::cerr << "Wrong array format. Each row must have the same size. The first rows has "
-                      << n_women << " scores." << std::endl;
-            return false;
+            n_ignored++;
+            continue;
         }
-        std::sort(women_indices.begin(), women_indices.end(),
-                  [&women_scores](int a, int b) { return women_scores[a] > women_scores[b]; });
-        // Initialize a man with a list of the women indices sorted according to its preferences
-        men_.emplace_back(women_indices);
+        wives[man_id] = j;
+        engagements_[j].store(pack_engagement((*scores_)(man_id, j), man_id), std::memory_order_relaxed);
+        n_engaged_women_++;
     }
+    if (n_ignored > 0)
+        std::cerr << "Ignored " << n_ignored << " invalid initial engagements." << std::endl;
 
-    // Women
-    women_.reserve(n_women);
-    std::vector<double> men_scores(n_men, -1);
-    for (size_t j = 0; j < n_women; j++)
+    // A man is free if a woman he prefers to his wife, or any woman if he's single, would accept him
+    std::vector<char> is_free(n_men, 0);
+    thread_pool_.parallel_for(0, n_men, [&](size_t begin, size_t end) {
+        std::vector<float> row(n_women);
+        for (size_t i = begin; i < end; i++)
+        {
+            scores_->get_row(i, row.data());
+            scores_->release_rows(i, i + 1);
+            const uint32_t wife = wives[i];
+            for (uint32_t j = 0; j < n_women && !is_free[i]; j++)
+                if (j != wife && (wife == single || row[j] < row[wife] || (row[j] == row[wife] && j < wife)))
+                    is_free[i] = would_accept(j, i, row[j]);
+        }
+    });
+
+    // Their wives become single, which may in turn free the men preferring them to their own wives
+    std::vector<uint32_t> single_women;
+    const auto free_man = [&](size_t i) {
+        is_free[i] = 1;
+        if (wives[i] == single)
+            return;
+        engagements_[wives[i]].store(no_engagement, std::memory_order_relaxed);
+        n_engaged_women_--;
+        single_women.push_back(wives[i]);
+        wives[i] = single;
+    };
+    for (size_t i = 0; i < n_men; i++)
+        if (is_free[i])
+            free_man(i);
+    while (!single_women.empty())
     {
+        const uint32_t woman_id = single_women.back();
+        single_women.pop_back();
         for (size_t i = 0; i < n_men; i++)
-            men_scores[i] = input_scores[i][j];
-        women_.emplace_back(men_scores);
+        {
+            if (is_free[i])
+                continue;
+            const uint32_t wife = wives[i];
+            const float score = (*scores_)(i, woman_id);
+            if (wife == single || score < (*scores_)(i, wife) || (score == (*scores_)(i, wife) && woman_id < wife))
+                free_man(i);
+        }
     }
 
-    std::cout << "Gale-Shapley Algorithm: " << men_.size() << " men and " << women_.size() << " women." << std::endl;
+    // The others resume where they stopped: after their wife, or nowhere if all the women rejected them
+    output_free_men.clear();
+    for (size_t i = 0; i < n_men; i++)
+    {
+        if (is_free[i])
+            output_free_men.push_back(i);
+        else if (wives[i] == single)
+            all_ranked_[i] = 1;
+        else
+            last_ranked_[i] = wives[i];
+    }
+    if (verbose_)
+        std::cout << "Warm start: " << n_engaged_women_ << " engagements kept, " << output_free_men.size()
+                  << " men propose again." << std::endl;
+}
 
-    // Solve
-    if (!find_stable_configuration())
-        return false;
+bool GaleShapleyAlgorithm::find_stable_configuration(const std::vector<uint32_t> &free_men,
+                                                     std::vector<size_t> &output_matches)
+{
+    if (verbose_)
+        std::cout << "Starts solving..." << std::endl;
 
-    output_matches.clear();
-    output_matches.reserve(women_.size());
-    for (const auto &woman : women_)
-        output_matches.emplace_back(woman.get_man_id());
+    // Each chunk of free men ranks its best women, in parallel since it reads the whole matrix, and then starts as the
+    // worklist of a thread
+    thread_pool_.parallel_for(0, free_men.size(), [&](size_t begin, size_t end) {
+        RankingScratch scratch;
+        std::vector<uint32_t> worklist;
+        worklist.reserve(end - begin);
+        for (size_t k = end; k > begin; k--) // The first man is at the back of the worklist
+            if (rank_next_women(free_men[k - 1], true, scratch))
+                worklist.push_back(free_men[k - 1]);
+        propose(worklist, scratch);
+    });
 
+    const size_t n_women = engagements_.size();
+    if (n_engaged_women_ != n_women)
+    {
+        std::cerr << "Only " << n_engaged_women_ << " women out of " << n_women << " got engaged." << std::endl;
+        return false;
+    }
+
+    output_matches.resize(n_women);
+    for (size_t j = 0; j < n_women; j++)
+        output_matches[j] = static_cast<uint32_t>(engagements_[j].load(std::memory_order_relaxed));
     return true;
 }
 
-bool GaleShapleyAlgorithm::find_stable_configuration()
+void GaleShapleyAlgorithm::propose(std::vector<uint32_t> &free_men, RankingScratch &scratch)
 {
-    std::cout << "Starts solving..." << std::endl;
-    bool men_keep_proposing = true; // More optimal to use this as termination criterion !
-    int last_decile = 0;            // From 0 to 10
-    while (men_keep_proposing)
+    const size_t n_women = engagements_.size();
+    while (!free_men.empty())
     {
-        men_keep_proposing = false;
-        int n_changes = 0;
-        // Men propose
-        size_t man_id = 0;
-        for (auto it_man = men_.begin(); it_man != men_.end(); it_man++, man_id++)
+        // The man at the back of the worklist proposes until he gets engaged or runs out of women
+        const uint32_t man_id = free_men.back();
+        free_men.pop_back();
+        while (true)
         {
-            if (it_man->is_engaged())
-                continue;
+            if (cursors_[man_id] == slot_lengths_[man_id] && !rank_next_women(man_id, false, scratch))
+                break; // He remains single
 
-            size_t best_woman_id;
-            if (!it_man->propose_to_best_woman(best_woman_id))
-                continue;
+            const size_t k = man_id * slot_size_ + cursors_[man_id]++;
+            const uint32_t woman_id = preferences_[k];
+            const uint64_t proposal = pack_engagement(preference_scores_[k], man_id);
 
-            men_keep_proposing = true;
-            women_[best_woman_id].add_proposal(man_id);
-        }
+            // Another thread may steal her in the meantime, in which case she's reconsidered with her new fiance
+            std::atomic<uint64_t> &engagement = engagements_[woman_id];
+            uint64_t old_engagement = engagement.load(std::memory_order_relaxed);
+            while (proposal < old_engagement &&
+                   !engagement.compare_exchange_weak(old_engagement, proposal, std::memory_order_acq_rel,
+                                                     std::memory_order_relaxed))
+                ;
+            if (proposal > old_engagement)
+                continue; // Rejected
 
-        // Women dispose
-        for (auto &woman : women_)
-        {
-            size_t old_man_id, new_man_id;
-            if (woman.update_engagement(old_man_id, new_man_id))
+            // She dumps her fiance, who becomes free again
+            if (old_engagement != no_engagement)
             {
-                n_changes++;
-                men_[old_man_id].break_engagement();
-                men_[new_man_id].engage();
+                free_men.push_back(static_cast<uint32_t>(old_engagement));
+                break;
             }
-        }
 
-        const int decile = (10 * Woman::number_of_engaged_women) / women_.size();
-        if (decile > last_decile)
-        {
-            last_decile = decile;
-            std::cout << "Engaged women: " << 10 * decile << "%" << std::endl;
+            const size_t n_engaged_women = ++n_engaged_women_;
+            const size_t decile = (10 * n_engaged_women) / n_women; // From 0 to 10
+            if (verbose_ && decile > (10 * (n_engaged_women - 1)) / n_women)
+                std::cout << "Engaged women: " + std::to_string(10 * decile) + "%\n" << std::flush;
+            break;
         }
     }
+}
+
+bool GaleShapleyAlgorithm::rank_next_women(uint32_t man_id, bool first_ranking, RankingScratch &scratch)
+{
+    if (all_ranked_[man_id])
+        return false;
+
+    const size_t n_women = scores_->cols();
+    std::vector<float> &row = scratch.row;
+    std::vector<uint32_t> &candidates = scratch.candidates;
+    row.resize(n_women);
+    scores_->get_row(man_id, row.data());
+    scores_->release_rows(man_id, man_id + 1);
+    const auto is_better = [&row](uint32_t a, uint32_t b) {
+        return row[a] < row[b] || (row[a] == row[b] && a < b);
+    };
 
+    // Candidates are worse than the last ranked woman, and wouldn't reject him right away
+    const uint32_t last_ranked = last_ranked_[man_id];
+    candidates.clear();
+    for (uint32_t j = 0; j < n_women; j++)
+        if ((first_ranking || is_better(last_ranked, j)) && would_accept(j, man_id, row[j]))
+            candidates.push_back(j);
+
+    // Partial selection of the best ones
+    const size_t n = std::min(slot_size_, candidates.size());
+    all_ranked_[man_id] = (n == candidates.size());
+    cursors_[man_id] = 0;
+    slot_lengths_[man_id] = n;
+    if (n == 0)
+        return false;
+    if (n < candidates.size())
+        std::nth_element(candidates.begin(), candidates.begin() + n, candidates.end(), is_better);
+    std::sort(candidates.begin(), candidates.begin() + n, is_better);
+
+    // Best women first
+    uint32_t *preferences = preferences_.data() + man_id * slot_size_;
+    float *preference_scores = preference_scores_.data() + man_id * slot_size_;
+    for (size_t k = 0; k < n; k++)
+    {
+        preferences[k] = candidates[k];
+        preference_scores[k] = row[candidates[k]];
+    }
+    last_ranked_[man_id] = candidates[n - 1];
     return true;
 }
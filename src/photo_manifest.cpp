@@ -0,0 +1,133 @@
+/*********************************************************************************************************************
+ * File : photo_manifest.cpp                                                                                         *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <boost/filesystem.hpp>
+
+#include "photo_manifest.h"
+
+namespace fs = boost::filesystem;
+
+const std::string PhotoManifest::manifest_filename = "photos.manifest";
+
+namespace
+{
+/// @brief Writes an entry as a line of the manifest
+void write_entry(std::ostream &stream, const PhotoManifest::Entry &entry)
+{
+    stream << PhotoManifest::to_hex(entry.hash) << " " << entry.n_capsules << " " << entry.photo_name << "\n";
+}
+} // namespace
+
+PhotoManifest::PhotoManifest(const std::string &capsules_dir) : manifest_path_((fs::path(capsules_dir) / manifest_filename).string())
+{
+}
+
+bool PhotoManifest::load()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    if (!fs::exists(manifest_path_))
+        return true;
+
+    std::ifstream manifest_file(manifest_path_);
+    if (!manifest_file)
+    {
+        std::cerr << "Unable to read the manifest " << manifest_path_ << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(manifest_file, line))
+    {
+        std::istringstream line_stream(line);
+        Entry entry;
+        if (!(line_stream >> std::hex >> entry.hash >> std::dec >> entry.n_capsules))
+            continue;
+        line_stream >> std::ws;
+        std::getline(line_stream, entry.photo_name);
+        entries_[entry.hash] = entry;
+    }
+    return true;
+}
+
+bool PhotoManifest::contains(uint64_t hash) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.count(hash) > 0;
+}
+
+bool PhotoManifest::find_photo(const std::string &photo_name, Entry &output_entry) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &it : entries_)
+        if (it.second.photo_name == photo_name)
+        {
+            output_entry = it.second;
+            return true;
+        }
+    return false;
+}
+
+bool PhotoManifest::add(const Entry &entry)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ofstream manifest_file(manifest_path_, std::ios::app);
+    write_entry(manifest_file, entry);
+    if (!manifest_file)
+    {
+        std::cerr << "Unable to append to the manifest " << manifest_path_ << std::endl;
+        return false;
+    }
+    entries_[entry.hash] = entry;
+    return true;
+}
+
+bool PhotoManifest::remove(uint64_t hash)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.erase(hash);
+
+    // Replace the manifest atomically
+    const std::string tmp_path = manifest_path_ + ".tmp";
+    {
+        std::ofstream manifest_file(tmp_path, std::ios::trunc);
+        for (const auto &it : entries_)
+            write_entry(manifest_file, it.second);
+        if (!manifest_file)
+        {
+            std::cerr << "Unable to write the manifest " << tmp_path << std::endl;
+            return false;
+        }
+    }
+    fs::rename(tmp_path, manifest_path_);
+    return true;
+}
+
+uint64_t PhotoManifest::hash_content(const std::vector<uint8_t> &content)
+{
+    return hash_content(content.data(), content.size());
+}
+
+uint64_t PhotoManifest::hash_content(const uint8_t *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string PhotoManifest::to_hex(uint64_t hash)
+{
+    std::ostringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return ss.str();
+}
@@ -0,0 +1,121 @@
+/*********************************************************************************************************************
+ * File : png_band_writer.cpp                                                                                        *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <iostream>
+#include <png.h>
+
+#include "png_band_writer.h"
+
+PngBandWriter::PngBandWriter() : file_(nullptr),
+                                 png_(nullptr),
+                                 info_(nullptr),
+                                 width_(0),
+                                 height_(0),
+                                 n_written_rows_(0) {}
+
+PngBandWriter::~PngBandWriter()
+{
+    release();
+}
+
+bool PngBandWriter::open(const std::string &path, int width, int height, int compression_level)
+{
+    release();
+    if (width <= 0 || height <= 0)
+    {
+        std::cerr << "Wrong PNG size. Got " << height << "x" << width << "." << std::endl;
+        return false;
+    }
+    file_ = std::fopen(path.c_str(), "wb");
+    if (!file_)
+    {
+        std::cerr << "Unable to create " << path << std::endl;
+        return false;
+    }
+    png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (png_)
+        info_ = png_create_info_struct(png_);
+    if (!info_)
+    {
+        std::cerr << "Unable to allocate the PNG structures." << std::endl;
+        release();
+        return false;
+    }
+
+    // libpng reports its errors by jumping back here, after having printed them
+    if (setjmp(png_jmpbuf(png_)))
+    {
+        release();
+        return false;
+    }
+    png_init_io(png_, file_);
+    png_set_compression_level(png_, compression_level);
+    png_set_IHDR(png_, info_, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_, info_);
+    png_set_bgr(png_);
+    width_ = width;
+    height_ = height;
+    n_written_rows_ = 0;
+    return true;
+}
+
+bool PngBandWriter::write_rows(const cv::Mat &band)
+{
+    if (!png_)
+    {
+        std::cerr << "The PNG file isn't open." << std::endl;
+        return false;
+    }
+    if (band.type() != CV_8UC3 || band.cols != width_ || n_written_rows_ + band.rows > height_)
+    {
+        std::cerr << "Wrong band of rows. Expected a CV_8UC3 image " << width_ << " pixels wide, with at most "
+                  << height_ - n_written_rows_ << " rows." << std::endl;
+        return false;
+    }
+
+    if (setjmp(png_jmpbuf(png_)))
+    {
+        release();
+        return false;
+    }
+    for (int y = 0; y < band.rows; y++)
+        png_write_row(png_, band.ptr<png_byte>(y));
+    n_written_rows_ += band.rows;
+    return true;
+}
+
+bool PngBandWriter::close()
+{
+    if (!png_)
+        return false;
+    if (n_written_rows_ != height_)
+    {
+        std::cerr << "Only " << n_written_rows_ << " rows out of " << height_ << " have been written." << std::endl;
+        release();
+        return false;
+    }
+
+    if (setjmp(png_jmpbuf(png_)))
+    {
+        release();
+        return false;
+    }
+    png_write_end(png_, info_);
+    release();
+    return true;
+}
+
+void PngBandWriter::release()
+{
+    if (png_)
+        png_destroy_write_struct(&png_, info_ ? &info_ : nullptr);
+    png_ = nullptr;
+    info_ = nullptr;
+    if (file_)
+        std::fclose(file_);
+    file_ = nullptr;
+}
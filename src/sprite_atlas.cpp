@@ -0,0 +1,74 @@
+/*********************************************************************************************************************
+ * File : sprite_atlas.cpp                                                                                           *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <atomic>
+#include <iostream>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "sprite_atlas.h"
+
+SpriteAtlas::SpriteAtlas(const CapsuleIndex &capsule_index,
+                         ThreadPool &thread_pool) : capsule_index_(capsule_index),
+                                                    thread_pool_(thread_pool) {}
+
+bool SpriteAtlas::get_sprites(const std::vector<size_t> &capsule_ids, int size, std::vector<cv::Mat> &output_sprites)
+{
+    if (size <= 0)
+    {
+        std::cerr << "Wrong sprite size. Expected a positive size. Got " << size << "." << std::endl;
+        return false;
+    }
+    SizedSprites &sized_sprites = sprites_by_size_[size];
+
+    // List the capsules that aren't cached yet
+    std::vector<size_t> missing_ids;
+    for (const size_t id : capsule_ids)
+        if (sized_sprites.sprites.emplace(id, cv::Mat()).second)
+            missing_ids.push_back(id);
+
+    // Resize them into a new block, thumbnails being read in place from the index unless they're too small
+    if (!missing_ids.empty())
+    {
+        cv::Mat block(static_cast<int>(missing_ids.size()) * size, size, CV_8UC3);
+        const bool use_thumbnails = capsule_index_.get_thumbnail_size() >= size;
+        std::atomic<size_t> n_failures(0);
+        thread_pool_.parallel_for(0, missing_ids.size(), [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; k++)
+            {
+                const size_t id = missing_ids[k];
+                const cv::Mat source = use_thumbnails ? capsule_index_.get_thumbnail(id)
+                                                      : capsule_index_.get_image(id);
+                if (source.empty())
+                {
+                    std::cerr << "Unable to read the capsule " + capsule_index_.get_path(id) + "\n";
+                    n_failures++;
+                    continue;
+                }
+                cv::Mat sprite = block.rowRange(k * size, (k + 1) * size);
+                cv::resize(source, sprite, sprite.size(), 0, 0, cv::INTER_AREA);
+            }
+        });
+        if (n_failures > 0)
+        {
+            for (const size_t id : missing_ids)
+                sized_sprites.sprites.erase(id);
+            return false;
+        }
+        for (size_t k = 0; k < missing_ids.size(); k++)
+            sized_sprites.sprites[missing_ids[k]] = block.rowRange(k * size, (k + 1) * size);
+        sized_sprites.blocks.push_back(block);
+    }
+
+    output_sprites.resize(capsule_ids.size());
+    for (size_t k = 0; k < capsule_ids.size(); k++)
+        output_sprites[k] = sized_sprites.sprites.at(capsule_ids[k]);
+    return true;
+}
+
+void SpriteAtlas::clear()
+{
+    sprites_by_size_.clear();
+}
@@ -0,0 +1,195 @@
+/*********************************************************************************************************************
+ * File : thread_pool.cpp                                                                                            *
+ *                                                                                                                   *
+ * 2020 Thomas Rouch                                                                                                 *
+ *********************************************************************************************************************/
+
+#include <algorithm>
+#include <exception>
+
+#include "thread_pool.h"
+
+namespace
+{
+// Pool and queue owned by the current thread. Threads outside of any pool don't own a queue
+thread_local const ThreadPool *current_pool = nullptr;
+thread_local size_t current_worker_id = 0;
+} // namespace
+
+ThreadPool::ThreadPool(size_t n_threads) : n_pending_tasks_(0), next_queue_(0), stop_(false)
+{
+    if (n_threads == 0)
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    queues_.reserve(n_threads);
+    for (size_t i = 0; i < n_threads; i++)
+        queues_.emplace_back(new WorkQueue());
+
+    workers_.reserve(n_threads);
+    for (size_t i = 0; i < n_threads; i++)
+        workers_.emplace_back(&ThreadPool::worker_loop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        stop_ = true;
+    }
+    wake_condition_.notify_all();
+    for (auto &worker : workers_)
+        worker.join();
+}
+
+size_t ThreadPool::size() const
+{
+    return workers_.size();
+}
+
+void ThreadPool::parallel_for(size_t begin, size_t end,
+                              const std::function<void(size_t, size_t)> &func,
+                              size_t chunk_size)
+{
+    if (begin >= end)
+        return;
+    if (chunk_size == 0)
+        chunk_size = std::max<size_t>(1, (end - begin) / (4 * size()));
+
+    const size_t n_chunks = (end - begin + chunk_size - 1) / chunk_size;
+    if (n_chunks == 1)
+    {
+        func(begin, end);
+        return;
+    }
+
+    // The chunks reference the stack of the caller, so they're always counted as done, even if they throw, and the
+    // first exception is only rethrown once none of them is running anymore
+    size_t n_remaining_chunks = n_chunks;
+    std::mutex done_mutex;
+    std::condition_variable done_condition;
+    std::exception_ptr exception;
+    std::atomic<bool> failed(false);
+    for (size_t chunk_begin = begin; chunk_begin < end; chunk_begin += chunk_size)
+    {
+        const size_t chunk_end = std::min(end, chunk_begin + chunk_size);
+        push_task([&, chunk_begin, chunk_end]() {
+            std::exception_ptr chunk_exception;
+            try
+            {
+                if (!failed.load(std::memory_order_relaxed)) // Skip the remaining chunks after a failure
+                    func(chunk_begin, chunk_end);
+            }
+            catch (...)
+            {
+                chunk_exception = std::current_exception();
+                failed.store(true, std::memory_order_relaxed);
+            }
+            std::lock_guard<std::mutex> lock(done_mutex);
+            if (chunk_exception && !exception)
+                exception = chunk_exception;
+            if (--n_remaining_chunks == 0)
+                done_condition.notify_all();
+        });
+    }
+
+    // Help the workers instead of sleeping, then wait for the chunks still being processed
+    while (run_pending_task())
+        ;
+    {
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done_condition.wait(lock, [&n_remaining_chunks]() { return n_remaining_chunks == 0; });
+    }
+    if (exception)
+        std::rethrow_exception(exception);
+}
+
+void ThreadPool::push_task(std::function<void()> task)
+{
+    // Count the task before queuing it, so that the counter never underflows when it's popped right away
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        n_pending_tasks_++;
+    }
+    const size_t queue_id = (current_pool == this) ? current_worker_id : next_queue_++ % queues_.size();
+    {
+        std::lock_guard<std::mutex> lock(queues_[queue_id]->mutex);
+        queues_[queue_id]->tasks.push_back(std::move(task));
+    }
+    wake_condition_.notify_one();
+}
+
+bool ThreadPool::pop_task(size_t queue_id, std::function<void()> &task)
+{
+    // Own queue first, most recent task to benefit from hot caches
+    {
+        WorkQueue &queue = *queues_[queue_id];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            n_pending_tasks_--;
+            return true;
+        }
+    }
+
+    // Steal the oldest task of another queue
+    for (size_t i = 1; i < queues_.size(); i++)
+    {
+        WorkQueue &queue = *queues_[(queue_id + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            n_pending_tasks_--;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::run_pending_task()
+{
+    const size_t queue_id = (current_pool == this) ? current_worker_id : 0;
+    std::function<void()> task;
+    if (!pop_task(queue_id, task))
+        return false;
+    run_task(task);
+    return true;
+}
+
+void ThreadPool::run_task(std::function<void()> &task)
+{
+    // Tasks report their own exceptions, through their future or their parallel_for. Anything else is dropped rather
+    // than terminating the program
+    try
+    {
+        task();
+    }
+    catch (...)
+    {
+    }
+}
+
+void ThreadPool::worker_loop(size_t worker_id)
+{
+    current_pool = this;
+    current_worker_id = worker_id;
+
+    std::function<void()> task;
+    while (true)
+    {
+        if (pop_task(worker_id, task))
+        {
+            run_task(task);
+            task = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        wake_condition_.wait(lock, [this]() { return stop_ || n_pending_tasks_ > 0; });
+        if (stop_ && n_pending_tasks_ == 0)
+            return;
+    }
+}